@@ -2,32 +2,118 @@
 
 #include "ddsbase.h"
 
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#ifdef UNIX
+#include <unistd.h>
+#endif
+#ifdef LINUX
+#include <sys/mman.h>
+#endif
+
 #ifdef HAVE_MINI
 #include <mini/rawbase.h>
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64)
+#define DDS_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
 #define DDS_MAXSTR (256)
 
 #define DDS_BLOCKSIZE (1<<20)
 #define DDS_INTERLEAVE (1<<24)
 
+// decoded bytes per independently coded chunk of a version 3 stream
+#define DDS_CHUNKSIZE (1<<22)
+
 #define DDS_RL (7)
 
+// alignment of large buffers if huge pages are enabled
+#define DDS_HUGEPAGE (1<<21)
+
+// zero bytes after a chunk passed to DDS_decode, enough for the longest run plus a 64 bit load
+#define DDS_PADDING (256)
+
 #define DDS_ISINTEL (*((unsigned char *)(&DDS_INTEL)+1)==0)
 
 char DDS_ID[]="DDS v3d\n";
 char DDS_ID2[]="DDS v3e\n";
+char DDS_ID3[]="DDS v3f\n";
+
+// state of one DDS bit stream. every encode and decode owns its context, so that several
+// streams can be encoded and decoded concurrently.
+struct DDS_context
+   {
+   unsigned char *cache;
+   unsigned int cachepos,cachesize;
 
-unsigned char *DDS_cache;
-unsigned int DDS_cachepos,DDS_cachesize;
+   unsigned int buffer;
+   unsigned int bufsize;
 
-unsigned int DDS_buffer;
-unsigned int DDS_bufsize;
+   // while a file is streamed into the cache only the first cacheready bytes are valid
+   std::atomic<unsigned int> cacheready;
+   };
 
 unsigned short int DDS_INTEL=1;
 
+// large buffers are aligned to huge pages, see setDDShugepages
+std::atomic<BOOLINT> DDS_hugepages(FALSE);
+
 // helper functions for DDS:
 
+// enable huge page friendly allocation of the buffers of file reads and decoded streams
+void setDDShugepages(BOOLINT enable)
+   {DDS_hugepages=enable;}
+
+// allocate a buffer that is released with free, buffers of a huge page or more
+// are aligned to huge pages and marked for transparent huge pages if enabled
+unsigned char *DDS_malloc(size_t size)
+   {
+#ifdef UNIX
+   void *ptr;
+
+   if (DDS_hugepages && size>=DDS_HUGEPAGE)
+      {
+      if (posix_memalign(&ptr,DDS_HUGEPAGE,size)!=0) return(NULL);
+#ifdef LINUX
+      madvise(ptr,size,MADV_HUGEPAGE);
+#endif
+      return((unsigned char *)ptr);
+      }
+#endif
+
+   return((unsigned char *)malloc(size));
+   }
+
+// number of bytes from the current position to the end of a regular file
+BOOLINT DDS_remaining(FILE *file,unsigned long long *bytes)
+   {
+#ifdef UNIX
+   struct stat st;
+   off_t pos;
+
+   if (fstat(fileno(file),&st)!=0 || !S_ISREG(st.st_mode)) return(FALSE);
+   if ((pos=ftello(file))<0 || pos>st.st_size) return(FALSE);
+
+   *bytes=st.st_size-pos;
+#else
+   long start,end;
+
+   if ((start=ftell(file))<0 || fseek(file,0,SEEK_END)!=0) return(FALSE);
+   end=ftell(file);
+   if (fseek(file,start,SEEK_SET)!=0 || end<start) return(FALSE);
+
+   *bytes=end-start;
+#endif
+
+   return(TRUE);
+   }
+
 inline unsigned int DDS_shiftl(const unsigned int value,const unsigned int bits)
    {return((bits>=32)?0:value<<bits);}
 
@@ -44,111 +130,117 @@ inline void DDS_swapuint(unsigned int *x)
       ((tmp&0xff000000)>>24);
    }
 
-void DDS_initbuffer()
+void DDS_initbuffer(DDS_context *ctx)
    {
-   DDS_buffer=0;
-   DDS_bufsize=0;
+   ctx->buffer=0;
+   ctx->bufsize=0;
    }
 
-inline void DDS_clearbits()
+inline void DDS_clearbits(DDS_context *ctx)
    {
-   DDS_cache=NULL;
-   DDS_cachepos=0;
-   DDS_cachesize=0;
+   ctx->cache=NULL;
+   ctx->cachepos=0;
+   ctx->cachesize=0;
    }
 
-inline void DDS_writebits(unsigned int value,unsigned int bits)
+inline void DDS_writebits(DDS_context *ctx,unsigned int value,unsigned int bits)
    {
    value&=DDS_shiftl(1,bits)-1;
 
-   if (DDS_bufsize+bits<32)
+   if (ctx->bufsize+bits<32)
       {
-      DDS_buffer=DDS_shiftl(DDS_buffer,bits)|value;
-      DDS_bufsize+=bits;
+      ctx->buffer=DDS_shiftl(ctx->buffer,bits)|value;
+      ctx->bufsize+=bits;
       }
    else
       {
-      DDS_buffer=DDS_shiftl(DDS_buffer,32-DDS_bufsize);
-      DDS_bufsize-=32-bits;
-      DDS_buffer|=DDS_shiftr(value,DDS_bufsize);
+      ctx->buffer=DDS_shiftl(ctx->buffer,32-ctx->bufsize);
+      ctx->bufsize-=32-bits;
+      ctx->buffer|=DDS_shiftr(value,ctx->bufsize);
 
-      if (DDS_cachepos+4>DDS_cachesize)
-         if (DDS_cache==NULL)
+      if (ctx->cachepos+4>ctx->cachesize)
+         if (ctx->cache==NULL)
             {
-            if ((DDS_cache=(unsigned char *)malloc(DDS_BLOCKSIZE))==NULL) MEMERROR();
-            DDS_cachesize=DDS_BLOCKSIZE;
+            if ((ctx->cache=(unsigned char *)malloc(DDS_BLOCKSIZE))==NULL) MEMERROR();
+            ctx->cachesize=DDS_BLOCKSIZE;
             }
          else
             {
-            if ((DDS_cache=(unsigned char *)realloc(DDS_cache,DDS_cachesize+DDS_BLOCKSIZE))==NULL) MEMERROR();
-            DDS_cachesize+=DDS_BLOCKSIZE;
+            if ((ctx->cache=(unsigned char *)realloc(ctx->cache,ctx->cachesize+DDS_BLOCKSIZE))==NULL) MEMERROR();
+            ctx->cachesize+=DDS_BLOCKSIZE;
             }
 
-      if (DDS_ISINTEL) DDS_swapuint(&DDS_buffer);
-      *((unsigned int *)&DDS_cache[DDS_cachepos])=DDS_buffer;
-      DDS_cachepos+=4;
+      if (DDS_ISINTEL) DDS_swapuint(&ctx->buffer);
+      *((unsigned int *)&ctx->cache[ctx->cachepos])=ctx->buffer;
+      ctx->cachepos+=4;
 
-      DDS_buffer=value&(DDS_shiftl(1,DDS_bufsize)-1);
+      ctx->buffer=value&(DDS_shiftl(1,ctx->bufsize)-1);
       }
    }
 
-inline void DDS_flushbits()
+inline void DDS_flushbits(DDS_context *ctx)
    {
    unsigned int bufsize;
 
-   bufsize=DDS_bufsize;
+   bufsize=ctx->bufsize;
 
    if (bufsize>0)
       {
-      DDS_writebits(0,32-bufsize);
-      DDS_cachepos-=(32-bufsize)/8;
+      DDS_writebits(ctx,0,32-bufsize);
+      ctx->cachepos-=(32-bufsize)/8;
       }
    }
 
-inline void DDS_savebits(unsigned char **data,unsigned int *size)
+inline void DDS_savebits(DDS_context *ctx,unsigned char **data,unsigned int *size)
    {
-   *data=DDS_cache;
-   *size=DDS_cachepos;
+   *data=ctx->cache;
+   *size=ctx->cachepos;
    }
 
-inline void DDS_loadbits(unsigned char *data,unsigned int size)
+inline void DDS_loadbits(DDS_context *ctx,unsigned char *data,unsigned int size)
    {
-   DDS_cache=data;
-   DDS_cachesize=size;
+   ctx->cache=data;
+   ctx->cachesize=size;
 
-   if ((DDS_cache=(unsigned char *)realloc(DDS_cache,DDS_cachesize+4))==NULL) MEMERROR();
-   *((unsigned int *)&DDS_cache[DDS_cachesize])=0;
+   if ((ctx->cache=(unsigned char *)realloc(ctx->cache,ctx->cachesize+4))==NULL) MEMERROR();
+   memset(&ctx->cache[ctx->cachesize],0,4);
 
-   DDS_cachesize=4*((DDS_cachesize+3)/4);
-   if ((DDS_cache=(unsigned char *)realloc(DDS_cache,DDS_cachesize))==NULL) MEMERROR();
+   ctx->cachesize=4*((ctx->cachesize+3)/4);
+   if ((ctx->cache=(unsigned char *)realloc(ctx->cache,ctx->cachesize))==NULL) MEMERROR();
    }
 
-inline unsigned int DDS_readbits(unsigned int bits)
+// wait until the cache holds the bytes up to pos
+inline void DDS_waitbits(DDS_context *ctx,unsigned int pos)
+   {
+   while (ctx->cacheready.load(std::memory_order_acquire)<pos) std::this_thread::yield();
+   }
+
+inline unsigned int DDS_readbits(DDS_context *ctx,unsigned int bits)
    {
    unsigned int value;
 
-   if (bits<DDS_bufsize)
+   if (bits<ctx->bufsize)
       {
-      DDS_bufsize-=bits;
-      value=DDS_shiftr(DDS_buffer,DDS_bufsize);
+      ctx->bufsize-=bits;
+      value=DDS_shiftr(ctx->buffer,ctx->bufsize);
       }
    else
       {
-      value=DDS_shiftl(DDS_buffer,bits-DDS_bufsize);
+      value=DDS_shiftl(ctx->buffer,bits-ctx->bufsize);
 
-      if (DDS_cachepos>=DDS_cachesize) DDS_buffer=0;
+      if (ctx->cachepos>=ctx->cachesize) ctx->buffer=0;
       else
          {
-         DDS_buffer=*((unsigned int *)&DDS_cache[DDS_cachepos]);
-         if (DDS_ISINTEL) DDS_swapuint(&DDS_buffer);
-         DDS_cachepos+=4;
+         ctx->buffer=*((unsigned int *)&ctx->cache[ctx->cachepos]);
+         if (DDS_ISINTEL) DDS_swapuint(&ctx->buffer);
+         ctx->cachepos+=4;
          }
 
-      DDS_bufsize+=32-bits;
-      value|=DDS_shiftr(DDS_buffer,DDS_bufsize);
+      ctx->bufsize+=32-bits;
+      value|=DDS_shiftr(ctx->buffer,ctx->bufsize);
       }
 
-   DDS_buffer&=DDS_shiftl(1,DDS_bufsize)-1;
+   ctx->buffer&=DDS_shiftl(1,ctx->bufsize)-1;
 
    return(value);
    }
@@ -159,62 +251,163 @@ inline int DDS_code(int bits)
 inline int DDS_decode(int bits)
    {return(bits>=1?bits+1:bits);}
 
-// deinterleave a byte stream
-void DDS_deinterleave(unsigned char *data,unsigned int bytes,unsigned int skip,unsigned int block=0,BOOLINT restore=FALSE)
+// set on the workers of DDS_foreach, whose chunks already keep all hardware threads busy
+thread_local BOOLINT DDS_nested=FALSE;
+
+// call func(begin,end) on one part of the range [0,count) per hardware thread
+template <class F>
+void DDS_parallel(unsigned int count,F func)
    {
-   unsigned int i,j,k;
+   const unsigned int grain=1<<16;
 
-   unsigned char *data2,*ptr;
+   unsigned int threads,part,i;
 
-   if (skip<=1) return;
+   std::vector<std::thread> workers;
 
-   if (block==0)
+   threads=DDS_nested?1:std::thread::hardware_concurrency();
+   if (threads>count/grain) threads=count/grain;
+
+   if (threads<=1)
       {
-      if ((data2=(unsigned char *)malloc(bytes))==NULL) MEMERROR();
+      func(0,count);
+      return;
+      }
 
-      if (!restore)
-         for (ptr=data2,i=0; i<skip; i++)
-            for (j=i; j<bytes; j+=skip) *ptr++=data[j];
-      else
-         for (ptr=data,i=0; i<skip; i++)
-            for (j=i; j<bytes; j+=skip) data2[j]=*ptr++;
+   part=(count+threads-1)/threads;
 
-      memcpy(data,data2,bytes);
-      }
+   for (i=part; i<count; i+=part)
+      workers.push_back(std::thread(func,i,(count-i<part)?count:i+part));
+
+   func(0,part);
+
+   for (i=0; i<workers.size(); i++) workers[i].join();
+   }
+
+// call func(i) for each i in [0,count) on all hardware threads, the next idle thread takes the next index
+template <class F>
+void DDS_foreach(unsigned int count,F func)
+   {
+   unsigned int threads,i;
+
+   std::atomic<unsigned int> next(0);
+   std::vector<std::thread> workers;
+
+   auto work=[&]()
+      {
+      BOOLINT nested=DDS_nested;
+      unsigned int k;
+
+      DDS_nested=TRUE;
+      while ((k=next++)<count) func(k);
+      DDS_nested=nested;
+      };
+
+   threads=DDS_nested?1:std::thread::hardware_concurrency();
+   if (threads>count) threads=count;
+
+   for (i=1; i<threads; i++) workers.push_back(std::thread(work));
+
+   work();
+
+   for (i=0; i<workers.size(); i++) workers[i].join();
+   }
+
+// move the bytes k*skip+i to plane i at offset plane[i]+k and back, for all k in [begin,end)
+template <int SKIP>
+inline void DDS_gather(unsigned char *data,unsigned char *data2,const unsigned int *plane,
+                       unsigned int begin,unsigned int end,BOOLINT restore)
+   {
+   unsigned int i,k;
+
+   if (!restore)
+      for (k=begin; k<end; k++)
+         for (i=0; i<SKIP; i++) data2[plane[i]+k]=data[k*SKIP+i];
    else
+      for (k=begin; k<end; k++)
+         for (i=0; i<SKIP; i++) data2[k*SKIP+i]=data[plane[i]+k];
+   }
+
+// interleave two planes into the pairs k*2, k*2+1 for all k in [begin,end), the common case of 16 bit volumes
+inline void DDS_interleave2(const unsigned char *plane0,const unsigned char *plane1,unsigned char *data2,
+                            unsigned int begin,unsigned int end)
+   {
+   unsigned int k=begin;
+
+#ifdef DDS_HAVE_SSE2
+   for (; k+16<=end; k+=16)
+      {
+      __m128i a=_mm_loadu_si128((const __m128i *)(plane0+k));
+      __m128i b=_mm_loadu_si128((const __m128i *)(plane1+k));
+      _mm_storeu_si128((__m128i *)(data2+2*k),_mm_unpacklo_epi8(a,b));
+      _mm_storeu_si128((__m128i *)(data2+2*k+16),_mm_unpackhi_epi8(a,b));
+      }
+#endif
+
+   for (; k<end; k++)
       {
-      if ((data2=(unsigned char *)malloc((bytes<skip*block)?bytes:skip*block))==NULL) MEMERROR();
+      data2[2*k]=plane0[k];
+      data2[2*k+1]=plane1[k];
+      }
+   }
 
-      if (!restore)
-         {
-         for (k=0; k<bytes/skip/block; k++)
-            {
-            for (ptr=data2,i=0; i<skip; i++)
-               for (j=i; j<skip*block; j+=skip) *ptr++=data[k*skip*block+j];
+// deinterleave a single block of a byte stream from data into data2 of the same size
+void DDS_gatherblock(unsigned char *data,unsigned char *data2,unsigned int bytes,unsigned int skip,BOOLINT restore)
+   {
+   unsigned int cnt=bytes/skip,rest=bytes%skip;
 
-            memcpy(data+k*skip*block,data2,skip*block);
-            }
+   unsigned int plane[4],i;
 
-         for (ptr=data2,i=0; i<skip; i++)
-            for (j=i; j<bytes-k*skip*block; j+=skip) *ptr++=data[k*skip*block+j];
+   // the bytes at i, i+skip, i+2*skip, ... are stored consecutively starting at offset i*cnt+min(i,rest)
+   for (i=0; i<skip; i++) plane[i]=i*cnt+min(i,rest);
 
-         memcpy(data+k*skip*block,data2,bytes-k*skip*block);
-         }
-      else
+   // all components of a byte are moved together, so each part of data2 is written once
+   DDS_parallel(cnt,[=,&plane](unsigned int begin,unsigned int end)
+      {
+      switch (skip)
          {
-         for (k=0; k<bytes/skip/block; k++)
-            {
-            for (ptr=data+k*skip*block,i=0; i<skip; i++)
-               for (j=i; j<skip*block; j+=skip) data2[j]=*ptr++;
+         case 2:
+            if (restore) DDS_interleave2(data+plane[0],data+plane[1],data2,begin,end);
+            else DDS_gather<2>(data,data2,plane,begin,end,restore);
+            break;
+         case 3: DDS_gather<3>(data,data2,plane,begin,end,restore); break;
+         default: DDS_gather<4>(data,data2,plane,begin,end,restore); break;
+         }
+      });
 
-            memcpy(data+k*skip*block,data2,skip*block);
-            }
+   // the last bytes only exist in the first rest planes
+   for (i=0; i<rest; i++)
+      if (!restore) data2[plane[i]+cnt]=data[cnt*skip+i];
+      else data2[cnt*skip+i]=data[plane[i]+cnt];
+   }
 
-         for (ptr=data+k*skip*block,i=0; i<skip; i++)
-            for (j=i; j<bytes-k*skip*block; j+=skip) data2[j]=*ptr++;
+// deinterleave a single block of a byte stream, data2 is scratch space of the same size
+void DDS_deinterleaveblock(unsigned char *data,unsigned char *data2,unsigned int bytes,unsigned int skip,BOOLINT restore)
+   {
+   DDS_gatherblock(data,data2,bytes,skip,restore);
 
-         memcpy(data+k*skip*block,data2,bytes-k*skip*block);
-         }
+   DDS_parallel(bytes,[=](unsigned int begin,unsigned int end)
+      {memcpy(data+begin,data2+begin,end-begin);});
+   }
+
+// deinterleave a byte stream
+void DDS_deinterleave(unsigned char *data,unsigned int bytes,unsigned int skip,unsigned int block=0,BOOLINT restore=FALSE)
+   {
+   unsigned int unit,k,n;
+
+   unsigned char *data2;
+
+   if (skip<=1) return;
+
+   // consecutive blocks of skip*block bytes are deinterleaved separately, a block of zero means the whole stream
+   if (block==0 || bytes/skip<block) unit=bytes;
+   else unit=skip*block;
+
+   if ((data2=(unsigned char *)malloc(unit))==NULL) MEMERROR();
+
+   for (k=0; k<bytes; k+=n)
+      {
+      n=(bytes-k<unit)?bytes-k:unit;
+      DDS_deinterleaveblock(data+k,data2,n,skip,restore);
       }
 
    free(data2);
@@ -225,7 +418,7 @@ void DDS_interleave(unsigned char *data,unsigned int bytes,unsigned int skip,uns
    {DDS_deinterleave(data,bytes,skip,block,TRUE);}
 
 // encode a Differential Data Stream
-void DDS_encode(unsigned char *data,unsigned int bytes,unsigned int skip,unsigned int strip,
+void DDS_encode(DDS_context *ctx,unsigned char *data,unsigned int bytes,unsigned int skip,unsigned int strip,
                 unsigned char **chunk,unsigned int *size,
                 unsigned int block=0)
    {
@@ -259,12 +452,12 @@ void DDS_encode(unsigned char *data,unsigned int bytes,unsigned int skip,unsigne
       lookup[i+128]=bits;
       }
 
-   DDS_initbuffer();
+   DDS_initbuffer(ctx);
 
-   DDS_clearbits();
+   DDS_clearbits(ctx);
 
-   DDS_writebits(skip-1,2);
-   DDS_writebits(strip-1,16);
+   DDS_writebits(ctx,skip-1,2);
+   DDS_writebits(ctx,strip-1,16);
 
    ptr1=ptr2=data;
    pre1=pre2=0;
@@ -307,8 +500,8 @@ void DDS_encode(unsigned char *data,unsigned int bytes,unsigned int skip,unsigne
          }
       else
          {
-         DDS_writebits(cnt2,DDS_RL);
-         DDS_writebits(DDS_code(bits2),3);
+         DDS_writebits(ctx,cnt2,DDS_RL);
+         DDS_writebits(ctx,DDS_code(bits2),3);
 
          while (cnt2-->0)
             {
@@ -321,7 +514,7 @@ void DDS_encode(unsigned char *data,unsigned int bytes,unsigned int skip,unsigne
             while (act2<-128) act2+=256;
             while (act2>127) act2-=256;
 
-            DDS_writebits(act2+(1<<bits2)/2,bits2);
+            DDS_writebits(ctx,act2+(1<<bits2)/2,bits2);
             }
 
          cnt2=cnt1;
@@ -339,8 +532,8 @@ void DDS_encode(unsigned char *data,unsigned int bytes,unsigned int skip,unsigne
       }
    else
       {
-      DDS_writebits(cnt2,DDS_RL);
-      DDS_writebits(DDS_code(bits2),3);
+      DDS_writebits(ctx,cnt2,DDS_RL);
+      DDS_writebits(ctx,DDS_code(bits2),3);
 
       while (cnt2-->0)
          {
@@ -353,7 +546,7 @@ void DDS_encode(unsigned char *data,unsigned int bytes,unsigned int skip,unsigne
          while (act2<-128) act2+=256;
          while (act2>127) act2-=256;
 
-         DDS_writebits(act2+(1<<bits2)/2,bits2);
+         DDS_writebits(ctx,act2+(1<<bits2)/2,bits2);
          }
 
       cnt2=cnt1;
@@ -362,8 +555,8 @@ void DDS_encode(unsigned char *data,unsigned int bytes,unsigned int skip,unsigne
 
    if (cnt2!=0)
       {
-      DDS_writebits(cnt2,DDS_RL);
-      DDS_writebits(DDS_code(bits2),3);
+      DDS_writebits(ctx,cnt2,DDS_RL);
+      DDS_writebits(ctx,DDS_code(bits2),3);
 
       while (cnt2-->0)
          {
@@ -376,18 +569,18 @@ void DDS_encode(unsigned char *data,unsigned int bytes,unsigned int skip,unsigne
          while (act2<-128) act2+=256;
          while (act2>127) act2-=256;
 
-         DDS_writebits(act2+(1<<bits2)/2,bits2);
+         DDS_writebits(ctx,act2+(1<<bits2)/2,bits2);
          }
       }
 
-   DDS_flushbits();
-   DDS_savebits(chunk,size);
+   DDS_flushbits(ctx);
+   DDS_savebits(ctx,chunk,size);
 
    DDS_interleave(data,bytes,skip,block);
    }
 
-// decode a Differential Data Stream
-void DDS_decode(unsigned char *chunk,unsigned int size,
+// decode a Differential Data Stream bit by bit, the reference for DDS_decode
+void DDS_refdecode(DDS_context *ctx,unsigned char *chunk,unsigned int size,
                 unsigned char **data,unsigned int *bytes,
                 unsigned int block=0)
    {
@@ -398,25 +591,25 @@ void DDS_decode(unsigned char *chunk,unsigned int size,
    unsigned int cnt,cnt1,cnt2;
    int bits,act;
 
-   DDS_initbuffer();
+   DDS_initbuffer(ctx);
 
-   DDS_clearbits();
-   DDS_loadbits(chunk,size);
+   DDS_clearbits(ctx);
+   DDS_loadbits(ctx,chunk,size);
 
-   skip=DDS_readbits(2)+1;
-   strip=DDS_readbits(16)+1;
+   skip=DDS_readbits(ctx,2)+1;
+   strip=DDS_readbits(ctx,16)+1;
 
    ptr1=ptr2=NULL;
    cnt=act=0;
 
-   while ((cnt1=DDS_readbits(DDS_RL))!=0)
+   while ((cnt1=DDS_readbits(ctx,DDS_RL))!=0)
       {
-      bits=DDS_decode(DDS_readbits(3));
+      bits=DDS_decode(DDS_readbits(ctx,3));
 
       for (cnt2=0; cnt2<cnt1; cnt2++)
          {
-         if (strip==1 || cnt<=strip) act+=DDS_readbits(bits)-(1<<bits)/2;
-         else act+=*(ptr2-strip)-*(ptr2-strip-1)+DDS_readbits(bits)-(1<<bits)/2;
+         if (strip==1 || cnt<=strip) act+=DDS_readbits(ctx,bits)-(1<<bits)/2;
+         else act+=*(ptr2-strip)-*(ptr2-strip-1)+DDS_readbits(ctx,bits)-(1<<bits)/2;
 
          while (act<0) act+=256;
          while (act>255) act-=256;
@@ -447,6 +640,362 @@ void DDS_decode(unsigned char *chunk,unsigned int size,
    *bytes=cnt;
    }
 
+// load 64 bits in big endian order
+inline unsigned long long DDS_load64(const unsigned char *ptr)
+   {
+   return(((unsigned long long)ptr[0]<<56)|((unsigned long long)ptr[1]<<48)|
+          ((unsigned long long)ptr[2]<<40)|((unsigned long long)ptr[3]<<32)|
+          ((unsigned long long)ptr[4]<<24)|((unsigned long long)ptr[5]<<16)|
+          ((unsigned long long)ptr[6]<<8)|(unsigned long long)ptr[7]);
+   }
+
+// read up to 32 bits at a bit position, the same bits DDS_readbits returns
+inline unsigned int DDS_peekbits(const unsigned char *cache,unsigned long long pos,unsigned int bits)
+   {return((unsigned int)(((DDS_load64(cache+(pos>>3))<<(pos&7))>>1)>>(63-bits)));}
+
+// decode the K values of BITS each at the top of a 64 bit window, unrolled
+template <int BITS,bool PREDICT,int K>
+struct DDS_decodewindow
+   {
+   static inline void decode(unsigned long long window,unsigned char &base,unsigned char *ptr,const unsigned char *prev)
+      {
+      base+=(unsigned int)((window>>(63-BITS))>>1)-(1<<BITS)/2;
+      *ptr=PREDICT?base+*prev:base;
+      DDS_decodewindow<BITS,PREDICT,K-1>::decode(window<<BITS,base,ptr+1,prev+1);
+      }
+   };
+
+template <int BITS,bool PREDICT>
+struct DDS_decodewindow<BITS,PREDICT,0>
+   {
+   static inline void decode(unsigned long long,unsigned char &,unsigned char *,const unsigned char *) {}
+   };
+
+// decode a run of count values with a constant bit width starting at bit position pos.
+// the bits are taken from a 64 bit window with constant shifts. the prediction from the previous line telescopes:
+// the differences along the line sum up to prev[i]-prev[-1], so a value is base+prev[i] with base only
+// accumulating the residuals, and runs without residuals have no dependency from one value to the next.
+template <int BITS,bool PREDICT>
+inline void DDS_decoderun(const unsigned char *chunk,unsigned long long pos,
+                          unsigned char *ptr,unsigned int count,unsigned int strip,unsigned char *act)
+   {
+   // a window loaded at any bit position holds at least 57 bits
+   const unsigned int perwindow=(BITS>0)?57/(BITS>0?BITS:1):count;
+
+   unsigned long long window;
+   unsigned int i,n;
+
+   const unsigned char *prev=ptr-strip;
+   unsigned char base;
+
+   base=PREDICT?*act-prev[-1]:*act;
+
+   i=0;
+
+   // whole windows with a constant number of values, which the compiler unrolls
+   if (BITS>0)
+      for (; i+perwindow<=count; i+=perwindow)
+         {
+         DDS_decodewindow<BITS,PREDICT,(BITS>0)?57/(BITS>0?BITS:1):0>::decode(DDS_load64(chunk+(pos>>3))<<(pos&7),base,ptr+i,prev+i);
+         pos+=perwindow*BITS;
+         }
+
+   // the rest of the run
+   window=(BITS>0)?DDS_load64(chunk+(pos>>3))<<(pos&7):0;
+   for (; i<count; i++)
+      {
+      if (BITS>0)
+         {
+         base+=(unsigned int)((window>>(63-BITS))>>1)-(1<<BITS)/2;
+         window<<=BITS;
+         }
+
+      ptr[i]=PREDICT?base+prev[i]:base;
+      }
+
+   *act=ptr[count-1];
+   }
+
+// decode a run for each of the bit widths DDS_decode(0..7)
+template <bool PREDICT>
+inline void DDS_decoderun(unsigned int bits,const unsigned char *chunk,unsigned long long pos,
+                          unsigned char *ptr,unsigned int count,unsigned int strip,unsigned char *act)
+   {
+   switch (bits)
+      {
+      case 0: DDS_decoderun<0,PREDICT>(chunk,pos,ptr,count,strip,act); break;
+      case 2: DDS_decoderun<2,PREDICT>(chunk,pos,ptr,count,strip,act); break;
+      case 3: DDS_decoderun<3,PREDICT>(chunk,pos,ptr,count,strip,act); break;
+      case 4: DDS_decoderun<4,PREDICT>(chunk,pos,ptr,count,strip,act); break;
+      case 5: DDS_decoderun<5,PREDICT>(chunk,pos,ptr,count,strip,act); break;
+      case 6: DDS_decoderun<6,PREDICT>(chunk,pos,ptr,count,strip,act); break;
+      case 7: DDS_decoderun<7,PREDICT>(chunk,pos,ptr,count,strip,act); break;
+      default: DDS_decoderun<8,PREDICT>(chunk,pos,ptr,count,strip,act); break;
+      }
+   }
+
+// decode a Differential Data Stream.
+// the chunk has to be followed by DDS_PADDING zero bytes, it may still be streamed in (see DDS_readstream).
+// values are read with one 64 bit load at their bit position, bounds and stream progress are checked once per run.
+// the stream does not record its decoded size, so the output is preallocated from the compressed size and
+// grows geometrically, checked once per run instead of once per byte.
+void DDS_decode(DDS_context *ctx,unsigned char *chunk,unsigned int size,
+                unsigned char **data,unsigned int *bytes,
+                unsigned int block=0,BOOLINT stream=FALSE)
+   {
+   unsigned int skip,strip;
+
+   unsigned char *ptr;
+   unsigned long long capacity;
+
+   unsigned long long pos,end;
+   unsigned int ready;
+
+   unsigned int cnt,cnt1,cnt2;
+   unsigned int bits,half;
+   unsigned char act;
+
+   // without streaming the whole chunk is there from the start
+   ready=stream?0:size+DDS_PADDING;
+   if (ready<DDS_PADDING)
+      {
+      DDS_waitbits(ctx,DDS_PADDING);
+      ready=ctx->cacheready.load(std::memory_order_acquire);
+      }
+
+   skip=DDS_peekbits(chunk,0,2)+1;
+   strip=DDS_peekbits(chunk,2,16)+1;
+   pos=18;
+
+   capacity=4ull*size;
+   if (capacity<DDS_BLOCKSIZE) capacity=DDS_BLOCKSIZE;
+   if (capacity>0xffffffffull) capacity=0xffffffffull;
+
+   if ((ptr=DDS_malloc(capacity))==NULL) {MEMERROR(); *data=NULL; *bytes=0; return;}
+
+   cnt=0;
+   act=0;
+
+   // past the end of the chunk there are only zero bits, which would end the stream with a zero run length.
+   // the chunks of a version 3 stream are followed by the next chunk instead, so a run has to start inside.
+   end=8ull*size;
+
+   while (pos+DDS_RL+3<=end)
+      {
+      // a run takes at most DDS_RL+3+127*8 bits, all of them are inside the chunk or its padding
+      if ((pos>>3)+DDS_PADDING>ready)
+         {
+         DDS_waitbits(ctx,(pos>>3)+DDS_PADDING);
+         ready=ctx->cacheready.load(std::memory_order_acquire);
+         }
+
+      // run length and bit width code in one read
+      bits=DDS_peekbits(chunk,pos,DDS_RL+3);
+      if ((cnt1=bits>>3)==0) break;
+      bits=DDS_decode(bits&7);
+      half=(1<<bits)/2;
+      pos+=DDS_RL+3;
+
+      if (cnt+cnt1>capacity)
+         {
+         if (capacity==0xffffffffull) {ERRORMSG(); break;}
+
+         capacity*=2;
+         if (capacity>0xffffffffull) capacity=0xffffffffull;
+
+         if ((ptr=(unsigned char *)realloc(ptr,capacity))==NULL) {MEMERROR(); *data=NULL; *bytes=0; return;}
+         }
+
+      // the common cases: no predictor at all (strip==1 or still in the first line) or all values predicted
+      if (strip==1 || cnt+cnt1<=strip+1)
+         if (bits==0) memset(ptr+cnt,act,cnt1);
+         else DDS_decoderun<false>(bits,chunk,pos,ptr+cnt,cnt1,strip,&act);
+      else if (cnt>strip)
+         DDS_decoderun<true>(bits,chunk,pos,ptr+cnt,cnt1,strip,&act);
+      else
+         for (cnt2=0; cnt2<cnt1; cnt2++)
+            {
+            if (cnt+cnt2<=strip) act+=DDS_peekbits(chunk,pos+cnt2*bits,bits)-half;
+            else act+=ptr[cnt+cnt2-strip]-ptr[cnt+cnt2-strip-1]+DDS_peekbits(chunk,pos+cnt2*bits,bits)-half;
+            ptr[cnt+cnt2]=act;
+            }
+
+      cnt+=cnt1;
+      pos+=cnt1*bits;
+      }
+
+   if (cnt==0)
+      {
+      free(ptr);
+      ptr=NULL;
+      }
+   else if (skip>1 && (block==0 || cnt/skip<block))
+      {
+      // a stream interleaved as a whole goes into an exact size buffer directly, instead of a scratch copy and back
+      unsigned char *ptr2;
+      if ((ptr2=DDS_malloc(cnt))==NULL) {MEMERROR(); free(ptr); *data=NULL; *bytes=0; return;}
+      DDS_gatherblock(ptr,ptr2,cnt,skip,TRUE);
+      free(ptr);
+      ptr=ptr2;
+      }
+   else
+      {
+      if ((ptr=(unsigned char *)realloc(ptr,cnt))==NULL) MEMERROR();
+      DDS_interleave(ptr,cnt,skip,block);
+      }
+
+   *data=ptr;
+   *bytes=cnt;
+   }
+
+// store a 32 bit number in big endian order
+inline void DDS_putuint(unsigned char *ptr,unsigned int value)
+   {
+   ptr[0]=value>>24;
+   ptr[1]=(value>>16)&255;
+   ptr[2]=(value>>8)&255;
+   ptr[3]=value&255;
+   }
+
+// load a 32 bit number in big endian order
+inline unsigned int DDS_getuint(const unsigned char *ptr)
+   {return(((unsigned int)ptr[0]<<24)|((unsigned int)ptr[1]<<16)|((unsigned int)ptr[2]<<8)|(unsigned int)ptr[3]);}
+
+// size of the chunk table of a version 3 stream
+inline unsigned long long DDS_tablesize(unsigned int chunks)
+   {return(4+8ull*(chunks+1));}
+
+// write a version 3 stream: the data is split into chunks of whole lines that are encoded independently on all hardware threads.
+// the stream starts with a chunk table, which holds the number of chunks followed by the offset of each chunk
+// in the stream and in the decoded data, both ending with the total size, all as 32 bit big endian numbers.
+void DDS_writechunks(FILE *file,unsigned char *data,unsigned int bytes,unsigned int skip,unsigned int strip)
+   {
+   unsigned int line,chunksize,chunks,i;
+   unsigned long long offset;
+
+   unsigned char *table;
+
+   if (skip<1 || skip>4) skip=1;
+   if (strip<1 || strip>65536) strip=1;
+
+   // the first line of a chunk has no previous line to predict from, so chunks start at a line
+   line=skip*strip;
+   chunksize=(line<DDS_CHUNKSIZE)?DDS_CHUNKSIZE/line*line:line;
+   chunks=(bytes-1)/chunksize+1;
+
+   std::vector<unsigned char *> chunk(chunks);
+   std::vector<unsigned int> size(chunks);
+
+   DDS_foreach(chunks,[&](unsigned int i)
+      {
+      DDS_context ctx;
+
+      DDS_encode(&ctx,data+i*chunksize,(bytes-i*chunksize<chunksize)?bytes-i*chunksize:chunksize,skip,strip,&chunk[i],&size[i]);
+      });
+
+   if ((table=(unsigned char *)malloc(DDS_tablesize(chunks)))==NULL) MEMERROR();
+
+   DDS_putuint(table,chunks);
+
+   offset=DDS_tablesize(chunks);
+
+   for (i=0; i<=chunks; i++)
+      {
+      if (offset>0xffffffffull-DDS_PADDING) ERRORMSG();
+
+      DDS_putuint(table+4+4*i,offset);
+      DDS_putuint(table+4+4*(chunks+1)+4*i,(i<chunks)?i*chunksize:bytes);
+
+      if (i<chunks) offset+=size[i];
+      }
+
+   if (fwrite(table,DDS_tablesize(chunks),1,file)!=1) IOERROR();
+   free(table);
+
+   for (i=0; i<chunks; i++)
+      if (chunk[i]!=NULL)
+         {
+         if (fwrite(chunk[i],size[i],1,file)!=1) IOERROR();
+         free(chunk[i]);
+         }
+   }
+
+// decode a version 3 stream, the chunks are decoded on all hardware threads and copied into their place of the decoded data.
+// the stream has to be followed by DDS_PADDING zero bytes. while it is still being streamed in (see DDS_readstream),
+// each chunk is decoded as soon as it has arrived, so that the decoding overlaps with reading the rest of the file.
+unsigned char *DDS_decodechunks(DDS_context *ctx,unsigned char *stream,unsigned int size,unsigned int *bytes,
+                                BOOLINT streamed=FALSE,BOOLINT reference=FALSE)
+   {
+   unsigned int chunks,i;
+
+   unsigned char *data;
+
+   std::atomic<unsigned int> failures(0);
+
+   if (streamed) DDS_waitbits(ctx,4);
+   if (size<4) return(NULL);
+
+   chunks=DDS_getuint(stream);
+   if (chunks<1 || DDS_tablesize(chunks)>size) return(NULL);
+
+   if (streamed) DDS_waitbits(ctx,DDS_tablesize(chunks));
+
+   std::vector<unsigned int> offset(chunks+1),position(chunks+1);
+
+   for (i=0; i<=chunks; i++)
+      {
+      offset[i]=DDS_getuint(stream+4+4*i);
+      position[i]=DDS_getuint(stream+4+4*(chunks+1)+4*i);
+      }
+
+   if (offset[0]!=DDS_tablesize(chunks) || offset[chunks]!=size || position[0]!=0) return(NULL);
+
+   for (i=0; i<chunks; i++)
+      if (offset[i]>=offset[i+1] || position[i]>=position[i+1]) return(NULL);
+
+   if ((data=DDS_malloc(position[chunks]))==NULL) {MEMERROR(); return(NULL);}
+
+   DDS_foreach(chunks,[&](unsigned int i)
+      {
+      DDS_context chunkctx;
+
+      unsigned char *chunk,*decoded;
+      unsigned int decodedbytes;
+
+      chunk=stream+offset[i];
+
+      // the decoder reads at most a run beyond the end of a chunk
+      if (streamed) DDS_waitbits(ctx,offset[i+1]+DDS_PADDING);
+
+      if (!reference) DDS_decode(&chunkctx,chunk,offset[i+1]-offset[i],&decoded,&decodedbytes);
+      else
+         {
+         // the reference decoder takes over the chunk as its cache
+         if ((chunk=(unsigned char *)malloc(offset[i+1]-offset[i]))==NULL) MEMERROR();
+         memcpy(chunk,stream+offset[i],offset[i+1]-offset[i]);
+
+         DDS_refdecode(&chunkctx,chunk,offset[i+1]-offset[i],&decoded,&decodedbytes);
+         free(chunkctx.cache);
+         }
+
+      if (decodedbytes!=position[i+1]-position[i]) failures++;
+      else memcpy(data+position[i],decoded,decodedbytes);
+
+      if (decoded!=NULL) free(decoded);
+      });
+
+   if (failures>0)
+      {
+      ERRORMSG();
+      free(data);
+      return(NULL);
+      }
+
+   *bytes=position[chunks];
+
+   return(data);
+   }
+
 // write a RAW file
 void writeRAWfile(const char *filename,unsigned char *data,unsigned int bytes,BOOLINT nofree)
    {
@@ -462,12 +1011,41 @@ void writeRAWfile(const char *filename,unsigned char *data,unsigned int bytes,BO
    if (!nofree) free(data);
    }
 
-// read from a RAW file
+// read from a RAW file.
+// the rest of a regular file is read into a single allocation of its size,
+// other streams are read into a buffer that grows by DDS_BLOCKSIZE.
 unsigned char *readRAWfiled(FILE *file,unsigned int *bytes)
    {
    unsigned char *data;
    unsigned int cnt,blkcnt;
 
+   unsigned long long size;
+
+   if (DDS_remaining(file,&size))
+      {
+      if (size==0) return(NULL);
+      if (size>0xffffffffull) {ERRORMSG(); return(NULL);}
+
+      if ((data=DDS_malloc(size))==NULL) {MEMERROR(); return(NULL);}
+
+      for (cnt=0; cnt<size; cnt+=blkcnt)
+         if ((blkcnt=fread(&data[cnt],1,size-cnt,file))==0) break;
+
+      if (cnt==0)
+         {
+         free(data);
+         return(NULL);
+         }
+
+      // the file was truncated while reading
+      if (cnt<size)
+         if ((data=(unsigned char *)realloc(data,cnt))==NULL) MEMERROR();
+
+      *bytes=cnt;
+
+      return(data);
+      }
+
    data=NULL;
    cnt=0;
 
@@ -519,22 +1097,29 @@ void writeDDSfile(const char *filename,unsigned char *data,unsigned int bytes,un
 
    FILE *file;
 
+   DDS_context ctx;
+
    unsigned char *chunk;
    unsigned int size;
 
    if (bytes<1) ERRORMSG();
 
-   if (bytes>DDS_INTERLEAVE) version=2;
+   // streams of more than one chunk are written as version 3, which replaces version 2
+   if (bytes>DDS_CHUNKSIZE) version=3;
 
    if ((file=fopen(filename,"wb"))==NULL) IOERROR();
-   fprintf(file,"%s",(version==1)?DDS_ID:DDS_ID2);
+   fprintf(file,"%s",(version==1)?DDS_ID:DDS_ID3);
 
-   DDS_encode(data,bytes,skip,strip,&chunk,&size,version==1?0:DDS_INTERLEAVE);
-
-   if (chunk!=NULL)
+   if (version==3) DDS_writechunks(file,data,bytes,skip,strip);
+   else
       {
-      if (fwrite(chunk,size,1,file)!=1) IOERROR();
-      free(chunk);
+      DDS_encode(&ctx,data,bytes,skip,strip,&chunk,&size);
+
+      if (chunk!=NULL)
+         {
+         if (fwrite(chunk,size,1,file)!=1) IOERROR();
+         free(chunk);
+         }
       }
 
    fclose(file);
@@ -542,51 +1127,172 @@ void writeDDSfile(const char *filename,unsigned char *data,unsigned int bytes,un
    if (!nofree) free(data);
    }
 
-// read a Differential Data Stream
+// read the rest of a file into a buffer followed by DDS_PADDING zero bytes on a separate thread.
+// the cacheready count of the context follows the bytes read so far, so that decoding can start right away.
+unsigned char *DDS_readstream(DDS_context *ctx,FILE *file,unsigned int *bytes,std::thread *reader,BOOLINT *failed)
+   {
+   unsigned long long remaining;
+
+   unsigned char *data;
+   unsigned int size;
+
+   if (!DDS_remaining(file,&remaining)) return(NULL);
+   if (remaining==0 || remaining>0xffffffffu-DDS_PADDING) return(NULL);
+
+   *bytes=remaining;
+   size=*bytes+DDS_PADDING;
+
+   if ((data=DDS_malloc(size))==NULL) {MEMERROR(); return(NULL);}
+   memset(data+*bytes,0,DDS_PADDING);
+
+   ctx->cacheready.store(0);
+   *failed=FALSE;
+
+   *reader=std::thread([=]()
+      {
+      unsigned int cnt,blkcnt;
+
+      for (cnt=0; cnt<*bytes; cnt+=blkcnt)
+         {
+         blkcnt=fread(&data[cnt],1,(*bytes-cnt<DDS_BLOCKSIZE)?*bytes-cnt:DDS_BLOCKSIZE,file);
+         if (blkcnt==0)
+            {
+            memset(&data[cnt],0,size-cnt);
+            *failed=TRUE;
+            break;
+            }
+
+         ctx->cacheready.store(cnt+blkcnt,std::memory_order_release);
+         }
+
+      // the padding is valid as well, the decoder never waits beyond the end
+      ctx->cacheready.store(size,std::memory_order_release);
+      });
+
+   return(data);
+   }
+
+// open a Differential Data Stream and skip its identifier, the version is 1, 2 or 3
+FILE *DDS_openfile(const char *filename,int *version)
+   {
+   FILE *file;
+
+   char id[sizeof(DDS_ID)];
+
+   if ((file=fopen(filename,"rb"))==NULL) return(NULL);
+
+   // all identifiers have the same length
+   if (fread(id,1,strlen(DDS_ID),file)==strlen(DDS_ID))
+      {
+      id[strlen(DDS_ID)]='\0';
+
+      if (strcmp(id,DDS_ID)==0) *version=1;
+      else if (strcmp(id,DDS_ID2)==0) *version=2;
+      else if (strcmp(id,DDS_ID3)==0) *version=3;
+      else *version=0;
+      }
+   else *version=0;
+
+   if (*version==0)
+      {
+      fclose(file);
+      return(NULL);
+      }
+
+   return(file);
+   }
+
+// read a Differential Data Stream.
+// the file is read on a second thread while the bit stream is decoded, the decoder only waits when it catches up.
 unsigned char *readDDSfile(const char *filename,unsigned int *bytes)
    {
-   int version=1;
+   int version;
 
    FILE *file;
 
-   int cnt;
+   DDS_context ctx;
 
    unsigned char *chunk,*data;
    unsigned int size;
 
-   if ((file=fopen(filename,"rb"))==NULL) return(NULL);
+   std::thread reader;
+   BOOLINT failed;
 
-   for (cnt=0; DDS_ID[cnt]!='\0'; cnt++)
-      if (fgetc(file)!=DDS_ID[cnt])
-         {
-         fclose(file);
-         version=0;
-         break;
-         }
+   if ((file=DDS_openfile(filename,&version))==NULL) return(NULL);
 
-   if (version==0)
+   if ((chunk=DDS_readstream(&ctx,file,&size,&reader,&failed))==NULL)
       {
-      if ((file=fopen(filename,"rb"))==NULL) return(NULL);
+      IOERROR();
+      fclose(file);
+      return(NULL);
+      }
 
-      for (cnt=0; DDS_ID2[cnt]!='\0'; cnt++)
-         if (fgetc(file)!=DDS_ID2[cnt])
-            {
-            fclose(file);
-            return(NULL);
-            }
+   if (version==3) data=DDS_decodechunks(&ctx,chunk,size,bytes,TRUE);
+   else DDS_decode(&ctx,chunk,size,&data,bytes,version==1?0:DDS_INTERLEAVE,TRUE);
+
+   reader.join();
+   fclose(file);
+
+   free(chunk);
 
-      version=2;
+   if (failed)
+      {
+      IOERROR();
+      if (data!=NULL) free(data);
+      return(NULL);
       }
 
-   if ((chunk=readRAWfiled(file,&size))==NULL) IOERROR();
+   return(data);
+   }
+
+// decode a Differential Data Stream with DDS_decode and with the bit by bit reference decoder
+BOOLINT checkDDSfile(const char *filename,double *seconds,double *refseconds)
+   {
+   int version;
+
+   FILE *file;
+
+   DDS_context ctx,refctx;
+
+   unsigned char *chunk,*padded,*data,*refdata;
+   unsigned int size,bytes,refbytes;
 
+   double start;
+
+   BOOLINT same;
+
+   if ((file=DDS_openfile(filename,&version))==NULL) return(FALSE);
+
+   chunk=readRAWfiled(file,&size);
    fclose(file);
 
-   DDS_decode(chunk,size,&data,bytes,version==1?0:DDS_INTERLEAVE);
+   if (chunk==NULL) return(FALSE);
 
-   free(chunk);
+   // DDS_decode works on a zero padded copy, the reference decoder pads the chunk itself
+   if ((padded=(unsigned char *)calloc(size+DDS_PADDING,1))==NULL) {MEMERROR(); free(chunk); return(FALSE);}
+   memcpy(padded,chunk,size);
 
-   return(data);
+   start=gettime();
+   if (version==3) data=DDS_decodechunks(&ctx,padded,size,&bytes);
+   else DDS_decode(&ctx,padded,size,&data,&bytes,version==1?0:DDS_INTERLEAVE);
+   if (seconds!=NULL) *seconds=gettime()-start;
+
+   start=gettime();
+   if (version==3) refdata=DDS_decodechunks(&refctx,padded,size,&refbytes,FALSE,TRUE);
+   else DDS_refdecode(&refctx,chunk,size,&refdata,&refbytes,version==1?0:DDS_INTERLEAVE);
+   if (refseconds!=NULL) *refseconds=gettime()-start;
+
+   same=(data!=NULL && refdata!=NULL && bytes==refbytes && memcmp(data,refdata,bytes)==0);
+
+   // the reference decoder reallocated the chunk into its cache
+   if (version==3) free(chunk);
+   else free(refctx.cache);
+   free(padded);
+
+   if (data!=NULL) free(data);
+   if (refdata!=NULL) free(refdata);
+
+   return(same);
    }
 
 void swapshort(unsigned char *ptr,unsigned int size)
@@ -760,7 +1466,15 @@ void writePVMvolume(const char *filename,unsigned char *volume,
       }
    }
 
+// start of the line after ptr, NULL if the header ends without a newline
+static unsigned char *nextPVMline(unsigned char *ptr)
+   {
+   unsigned char *newline=(unsigned char *)strchr((char *)ptr,'\n');
+   return((newline==NULL)?NULL:newline+1);
+   }
+
 // read a compressed PVM volume
+// a corrupt header or a truncated file frees the data and returns NULL
 unsigned char *readPVMvolume(const char *filename,
                              unsigned int *width,unsigned int *height,unsigned int *depth,unsigned int *components,
                              float *scalex,float *scaley,float *scalez,
@@ -780,10 +1494,12 @@ unsigned char *readPVMvolume(const char *filename,
 
    unsigned int len1=0,len2=0,len3=0,len4=0;
 
+   long long voxels;
+
    if ((data=readDDSfile(filename,&bytes))==NULL)
       if ((data=readRAWfile(filename,&bytes))==NULL) return(NULL);
 
-   if (bytes<5) return(NULL);
+   if (bytes<5) {free(data); return(NULL);}
 
    if ((data=(unsigned char *)realloc(data,bytes+1))==NULL) MEMERROR();
    data[bytes]='\0';
@@ -792,21 +1508,21 @@ unsigned char *readPVMvolume(const char *filename,
       {
       if (strncmp((char *)data,"PVM2\n",5)==0) version=2;
       else if (strncmp((char *)data,"PVM3\n",5)==0) version=3;
-      else return(NULL);
+      else {free(data); return(NULL);}
 
       ptr=&data[5];
-      if (sscanf((char *)ptr,"%d %d %d\n%g %g %g\n",width,height,depth,&sx,&sy,&sz)!=6) ERRORMSG();
-      if (*width<1 || *height<1 || *depth<1 || sx<=0.0f || sy<=0.0f || sz<=0.0f) ERRORMSG();
-      ptr=(unsigned char *)strchr((char *)ptr,'\n')+1;
+      if (sscanf((char *)ptr,"%u %u %u\n%g %g %g\n",width,height,depth,&sx,&sy,&sz)!=6) {free(data); return(NULL);}
+      if (*width<1 || *height<1 || *depth<1 || sx<=0.0f || sy<=0.0f || sz<=0.0f) {free(data); return(NULL);}
+      if ((ptr=nextPVMline(ptr))==NULL) {free(data); return(NULL);}
       }
    else
       {
       ptr=&data[4];
       while (*ptr=='#')
-         while (*ptr++!='\n');
+         if ((ptr=nextPVMline(ptr))==NULL) {free(data); return(NULL);}
 
-      if (sscanf((char *)ptr,"%d %d %d\n",width,height,depth)!=3) ERRORMSG();
-      if (*width<1 || *height<1 || *depth<1) ERRORMSG();
+      if (sscanf((char *)ptr,"%u %u %u\n",width,height,depth)!=3) {free(data); return(NULL);}
+      if (*width<1 || *height<1 || *depth<1) {free(data); return(NULL);}
       }
 
    if (scalex!=NULL && scaley!=NULL && scalez!=NULL)
@@ -816,38 +1532,51 @@ unsigned char *readPVMvolume(const char *filename,
       *scalez=sz;
       }
 
-   ptr=(unsigned char *)strchr((char *)ptr,'\n')+1;
-   if (sscanf((char *)ptr,"%d\n",&numc)!=1) ERRORMSG();
-   if (numc<1) ERRORMSG();
+   if ((ptr=nextPVMline(ptr))==NULL) {free(data); return(NULL);}
+   if (sscanf((char *)ptr,"%u\n",&numc)!=1) {free(data); return(NULL);}
+   if (numc<1) {free(data); return(NULL);}
 
    if (components!=NULL) *components=numc;
-   else if (numc!=1) ERRORMSG();
+   else if (numc!=1) {free(data); return(NULL);}
 
-   ptr=(unsigned char *)strchr((char *)ptr,'\n')+1;
-   if (version==3) len1=strlen((char *)(ptr+(*width)*(*height)*(*depth)*numc))+1;
-   if (version==3) len2=strlen((char *)(ptr+(*width)*(*height)*(*depth)*numc+len1))+1;
-   if (version==3) len3=strlen((char *)(ptr+(*width)*(*height)*(*depth)*numc+len1+len2))+1;
-   if (version==3) len4=strlen((char *)(ptr+(*width)*(*height)*(*depth)*numc+len1+len2+len3))+1;
-   if ((volume=(unsigned char *)malloc((*width)*(*height)*(*depth)*numc+len1+len2+len3+len4))==NULL) MEMERROR();
-   if (data+bytes!=ptr+(*width)*(*height)*(*depth)*numc+len1+len2+len3+len4) ERRORMSG();
+   if ((ptr=nextPVMline(ptr))==NULL) {free(data); return(NULL);}
 
-   memcpy(volume,ptr,(*width)*(*height)*(*depth)*numc+len1+len2+len3+len4);
-   free(data);
+   // 64 bit voxel count, the product of the dimensions may exceed 32 bit
+   voxels=(long long)(*width)*(*height)*(*depth)*numc;
+   if (voxels>data+bytes-ptr) {free(data); return(NULL);}
+
+   // each string has to start within the data, the terminator at data[bytes] stops the last one
+   if (version==3)
+      {
+      if (ptr+voxels>=data+bytes) {free(data); return(NULL);}
+      len1=strlen((char *)(ptr+voxels))+1;
+      if (ptr+voxels+len1>=data+bytes) {free(data); return(NULL);}
+      len2=strlen((char *)(ptr+voxels+len1))+1;
+      if (ptr+voxels+len1+len2>=data+bytes) {free(data); return(NULL);}
+      len3=strlen((char *)(ptr+voxels+len1+len2))+1;
+      if (ptr+voxels+len1+len2+len3>=data+bytes) {free(data); return(NULL);}
+      len4=strlen((char *)(ptr+voxels+len1+len2+len3))+1;
+      }
+   if (data+bytes!=ptr+voxels+len1+len2+len3+len4) {free(data); return(NULL);}
+
+   // move the voxels in place over the header instead of copying them into a second buffer
+   memmove(data,ptr,voxels+len1+len2+len3+len4);
+   if ((volume=(unsigned char *)realloc(data,voxels+len1+len2+len3+len4))==NULL) MEMERROR();
 
    if (description!=NULL)
-      if (len1>1) *description=volume+(*width)*(*height)*(*depth)*numc;
+      if (len1>1) *description=volume+voxels;
       else *description=NULL;
 
    if (courtesy!=NULL)
-      if (len2>1) *courtesy=volume+(*width)*(*height)*(*depth)*numc+len1;
+      if (len2>1) *courtesy=volume+voxels+len1;
       else *courtesy=NULL;
 
    if (parameter!=NULL)
-      if (len3>1) *parameter=volume+(*width)*(*height)*(*depth)*numc+len1+len2;
+      if (len3>1) *parameter=volume+voxels+len1+len2;
       else *parameter=NULL;
 
    if (comment!=NULL)
-      if (len4>1) *comment=volume+(*width)*(*height)*(*depth)*numc+len1+len2+len3;
+      if (len4>1) *comment=volume+voxels+len1+len2+len3;
       else *comment=NULL;
 
    return(volume);
@@ -964,83 +1693,181 @@ void convrgb(unsigned char **data,long long bytes)
    if ((*data=(unsigned char *)realloc(*data,bytes/3))==NULL) MEMERROR();
    }
 
-// helper to get a short value from a volume
-inline int getshort(unsigned short int *data,
-                    long long width,long long height,long long depth,
-                    long long i,long long j,long long k)
-   {return(data[i+(j+k*height)*width]);}
+// helper to get a 16 bit value from a volume
+template <bool MSB>
+inline int getshort(const unsigned char *data,long long idx)
+   {return(MSB?256*data[2*idx]+data[2*idx+1]:data[2*idx]+256*data[2*idx+1]);}
 
 // helper to get a gradient value from a volume
-inline double getgrad(unsigned short int *data,
+template <bool MSB>
+inline double getgrad(const unsigned char *data,
                       long long width,long long height,long long depth,
                       long long i,long long j,long long k)
    {
+   long long idx=i+(j+k*height)*width,slice=width*height;
+
    double gx,gy,gz;
 
    if (i>0)
-      if (i<width-1) gx=(getshort(data,width,height,depth,i+1,j,k)-getshort(data,width,height,depth,i-1,j,k))/2.0;
-      else gx=getshort(data,width,height,depth,i,j,k)-getshort(data,width,height,depth,i-1,j,k);
+      if (i<width-1) gx=(getshort<MSB>(data,idx+1)-getshort<MSB>(data,idx-1))/2.0;
+      else gx=getshort<MSB>(data,idx)-getshort<MSB>(data,idx-1);
    else
-      if (i<width-1) gx=getshort(data,width,height,depth,i+1,j,k)-getshort(data,width,height,depth,i,j,k);
+      if (i<width-1) gx=getshort<MSB>(data,idx+1)-getshort<MSB>(data,idx);
       else gx=0.0;
 
    if (j>0)
-      if (j<height-1) gy=(getshort(data,width,height,depth,i,j+1,k)-getshort(data,width,height,depth,i,j-1,k))/2.0;
-      else gy=getshort(data,width,height,depth,i,j,k)-getshort(data,width,height,depth,i,j-1,k);
+      if (j<height-1) gy=(getshort<MSB>(data,idx+width)-getshort<MSB>(data,idx-width))/2.0;
+      else gy=getshort<MSB>(data,idx)-getshort<MSB>(data,idx-width);
    else
-      if (j<height-1) gy=getshort(data,width,height,depth,i,j+1,k)-getshort(data,width,height,depth,i,j,k);
+      if (j<height-1) gy=getshort<MSB>(data,idx+width)-getshort<MSB>(data,idx);
       else gy=0.0;
 
    if (k>0)
-      if (k<depth-1) gz=(getshort(data,width,height,depth,i,j,k+1)-getshort(data,width,height,depth,i,j,k-1))/2.0;
-      else gz=getshort(data,width,height,depth,i,j,k)-getshort(data,width,height,depth,i,j,k-1);
+      if (k<depth-1) gz=(getshort<MSB>(data,idx+slice)-getshort<MSB>(data,idx-slice))/2.0;
+      else gz=getshort<MSB>(data,idx)-getshort<MSB>(data,idx-slice);
    else
-      if (k<depth-1) gz=getshort(data,width,height,depth,i,j,k+1)-getshort(data,width,height,depth,i,j,k);
+      if (k<depth-1) gz=getshort<MSB>(data,idx+slice)-getshort<MSB>(data,idx);
       else gz=0.0;
 
    return(sqrt(gx*gx+gy*gy+gz*gz));
    }
 
-// quantize 16 bit data to 8 bit using a non-linear mapping
-unsigned char *quantize(unsigned char *data,
-                        long long width,long long height,long long depth,
-                        BOOLINT msb,
-                        BOOLINT linear,BOOLINT nofree)
+// voxels per step of quantize, the weights of one step are kept in memory
+#define DDS_QUANTSTEP (1<<20)
+
+// slices per step of quantize
+inline long long DDS_quantslices(long long width,long long height,long long depth)
+   {
+   long long slices=DDS_QUANTSTEP/(width*height);
+
+   if (slices<1) slices=1;
+   if (slices>depth) slices=depth;
+
+   return(slices);
+   }
+
+// call func(first,count) on consecutive parts of whole slices with about DDS_QUANTSTEP voxels
+template <class F>
+void DDS_forslices(long long width,long long height,long long depth,F func)
+   {
+   long long slice,slices,k;
+
+   slice=width*height;
+   slices=DDS_quantslices(width,height,depth);
+
+   for (k=0; k<depth; k+=slices)
+      func(k*slice,((depth-k<slices)?depth-k:slices)*slice);
+   }
+
+// squared gradient magnitudes times four below this are looked up
+#define DDS_QUANTLOOKUP (1<<16)
+
+// the gradient weights sqrt(getgrad) of the voxels [begin,end).
+// inner voxels take central differences without any border checks. four times the squared magnitude
+// is an integer there, small ones are looked up in a table of sqrt(sqrt(s/4)), which is exactly
+// what getgrad computes, since all the products and sums are exact in double precision.
+template <bool MSB>
+void DDS_gradweights(const unsigned char *data,
+                     long long width,long long height,long long depth,
+                     long long begin,long long end,
+                     const double *lookup,double *weight)
+   {
+   long long idx,i,j,k,n,slice;
+
+   long long dx,dy,dz,s;
+
+   const unsigned char *ptr;
+
+   slice=width*height;
+
+   i=begin%width;
+   j=(begin/width)%height;
+   k=begin/slice;
+
+   for (idx=begin; idx<end; idx=n)
+      {
+      // the rest of the current line
+      n=(end-idx<width-i)?end:idx+width-i;
+
+      if (j>0 && j<height-1 && k>0 && k<depth-1)
+         for (ptr=data+2*idx; idx<n; idx++,i++,ptr+=2)
+            if (i>0 && i<width-1)
+               {
+               dx=getshort<MSB>(ptr,1)-getshort<MSB>(ptr,-1);
+               dy=getshort<MSB>(ptr,width)-getshort<MSB>(ptr,-width);
+               dz=getshort<MSB>(ptr,slice)-getshort<MSB>(ptr,-slice);
+
+               s=dx*dx+dy*dy+dz*dz;
+
+               if (s<DDS_QUANTLOOKUP) weight[idx-begin]=lookup[s];
+               else weight[idx-begin]=sqrt(sqrt(s/4.0));
+               }
+            else
+               weight[idx-begin]=sqrt(getgrad<MSB>(data,width,height,depth,i,j,k));
+      else
+         for (; idx<n; idx++,i++)
+            weight[idx-begin]=sqrt(getgrad<MSB>(data,width,height,depth,i,j,k));
+
+      if (i==width)
+         {
+         i=0;
+         if (++j==height)
+            {
+            j=0;
+            k++;
+            }
+         }
+      }
+   }
+
+// quantize 16 bit data to 8 bit using a non-linear mapping.
+// the volume is processed in steps of whole slices, each of them on all hardware threads.
+// the gradient weights of a step are summed up into the histogram in voxel order,
+// so that the histogram and thus the result is the same as with a serial quantization.
+template <bool MSB>
+unsigned char *DDS_quantize(unsigned char *data,
+                            long long width,long long height,long long depth,
+                            BOOLINT linear,BOOLINT nofree)
    {
-   long long i,j,k;
+   long long i,k;
 
    unsigned char *data2;
-   unsigned short int *data3;
-   long long idx;
 
-   int v,vmin,vmax;
+   int vmin,vmax;
 
    double *err,eint;
+   double *weight,*grad;
+
+   unsigned char lookup[65536];
 
    BOOLINT done;
 
-   if ((data3=(unsigned short int*)malloc(width*height*depth*sizeof(unsigned short int)))==NULL) MEMERROR();
+   std::mutex mutex;
 
    vmin=65535;
    vmax=0;
 
-   for (k=0; k<depth; k++)
-      for (j=0; j<height; j++)
-         for (i=0; i<width; i++)
-            {
-            idx=i+(j+k*height)*width;
+   DDS_forslices(width,height,depth,[&](long long first,long long count)
+      {
+      DDS_parallel(count,[&](unsigned int begin,unsigned int end)
+         {
+         int v,lmin=65535,lmax=0;
+         unsigned int idx;
 
-            if (msb)
-               v=256*data[2*idx]+data[2*idx+1];
-            else
-               v=data[2*idx]+256*data[2*idx+1];
-            data3[idx]=v;
+         for (idx=begin; idx<end; idx++)
+            {
+            v=getshort<MSB>(data,first+idx);
 
-            if (v<vmin) vmin=v;
-            if (v>vmax) vmax=v;
+            if (v<lmin) lmin=v;
+            if (v>lmax) lmax=v;
             }
 
-   if (!nofree) free(data);
+         std::lock_guard<std::mutex> lock(mutex);
+
+         if (lmin<vmin) vmin=lmin;
+         if (lmax>vmax) vmax=lmax;
+         });
+      });
 
    if (vmin==vmax) vmax=vmin+1;
 
@@ -1054,10 +1881,39 @@ unsigned char *quantize(unsigned char *data,
       {
       for (i=0; i<65536; i++) err[i]=0.0;
 
-      for (k=0; k<depth; k++)
-         for (j=0; j<height; j++)
-            for (i=0; i<width; i++)
-               err[getshort(data3,width,height,depth,i,j,k)]+=sqrt(getgrad(data3,width,height,depth,i,j,k));
+      weight=new double[DDS_quantslices(width,height,depth)*width*height];
+
+      grad=new double[DDS_QUANTLOOKUP];
+      for (i=0; i<DDS_QUANTLOOKUP; i++) grad[i]=sqrt(sqrt(i/4.0));
+
+      DDS_forslices(width,height,depth,[&](long long first,long long count)
+         {
+         DDS_parallel(count,[&](unsigned int begin,unsigned int end)
+            {DDS_gradweights<MSB>(data,width,height,depth,first+begin,first+end,grad,weight+begin);});
+
+         // runs of the same value are summed up in a register
+         int v=getshort<MSB>(data,first);
+         double sum=err[v];
+
+         for (long long idx=0; idx<count; idx++)
+            {
+            int v2=getshort<MSB>(data,first+idx);
+
+            if (v2!=v)
+               {
+               err[v]=sum;
+               v=v2;
+               sum=err[v];
+               }
+
+            sum+=weight[idx];
+            }
+
+         err[v]=sum;
+         });
+
+      delete[] weight;
+      delete[] grad;
 
       for (i=0; i<65536; i++) err[i]=pow(err[i],1.0/3);
 
@@ -1085,22 +1941,38 @@ unsigned char *quantize(unsigned char *data,
          for (i=0; i<65536; i++) err[i]*=255.0/err[65535];
       }
 
+   for (i=0; i<65536; i++) lookup[i]=(int)(err[i]+0.5);
+
+   delete[] err;
+
    if ((data2=(unsigned char *)malloc(width*height*depth))==NULL) MEMERROR();
 
-   for (k=0; k<depth; k++)
-      for (j=0; j<height; j++)
-         for (i=0; i<width; i++)
-            {
-            idx=i+(j+k*height)*width;
-            data2[idx]=(int)(err[data3[idx]]+0.5);
-            }
+   DDS_forslices(width,height,depth,[&](long long first,long long count)
+      {
+      DDS_parallel(count,[&](unsigned int begin,unsigned int end)
+         {
+         unsigned int idx;
+
+         for (idx=begin; idx<end; idx++)
+            data2[first+idx]=lookup[getshort<MSB>(data,first+idx)];
+         });
+      });
 
-   delete err;
-   free(data3);
+   if (!nofree) free(data);
 
    return(data2);
    }
 
+// quantize 16 bit data to 8 bit using a non-linear mapping
+unsigned char *quantize(unsigned char *data,
+                        long long width,long long height,long long depth,
+                        BOOLINT msb,
+                        BOOLINT linear,BOOLINT nofree)
+   {
+   if (msb) return(DDS_quantize<true>(data,width,height,depth,linear,nofree));
+   else return(DDS_quantize<false>(data,width,height,depth,linear,nofree));
+   }
+
 // copy a PVM volume to a RAW volume
 char *processPVMvolume(const char *filename)
    {
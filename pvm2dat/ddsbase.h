@@ -7,6 +7,9 @@
 
 void writeDDSfile(const char *filename,unsigned char *data,unsigned int bytes,unsigned int skip=0,unsigned int strip=0,BOOLINT nofree=FALSE);
 unsigned char *readDDSfile(const char *filename,unsigned int *bytes);
+BOOLINT checkDDSfile(const char *filename,double *seconds=NULL,double *refseconds=NULL);
+
+void setDDShugepages(BOOLINT enable=TRUE);
 
 void writeRAWfile(const char *filename,unsigned char *data,unsigned int bytes,BOOLINT nofree=FALSE);
 unsigned char *readRAWfile(const char *filename,unsigned int *bytes);
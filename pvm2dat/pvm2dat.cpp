@@ -4,6 +4,399 @@
 #include "ddsbase.h"
 
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#ifdef LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef UNIX
+#include <dirent.h>
+#endif
+
+
+// HEADER: 16 bit width, 16 bit height, 16 bit depth, 16 bit bitsPerVoxel intensity resolution
+// if any dimension exceeds 65535, width, height and depth are 0 and followed by 32 bit width, height, depth
+// DATA: voxel intensities (here we always use 8 bit resolution)
+// the volume is written in blocks straight from the decoded data, seconds receives the time spent writing
+static bool writeDAT(const char *filename, const unsigned char *volume, unsigned int width, unsigned int height, unsigned int depth, double *seconds = NULL)
+{
+    const size_t blockSize = 1 << 22;
+
+    size_t byteSizeVolume = (size_t)width*height*depth; // 8-bit voxels
+
+    FILE *file;
+
+    if (byteSizeVolume < 1) { ERRORMSG(); return(false); }
+
+    double start = gettime();
+
+    if ((file = fopen(filename, "wb")) == NULL) { IOERROR(); return(false); }
+
+    bool ok = true;
+    unsigned short bitsPerVoxel = 8;
+    bool extended = (width > 65535 || height > 65535 || depth > 65535);
+    if (extended)
+    {
+        unsigned short header[] = { 0, 0, 0, bitsPerVoxel };
+        unsigned int extent[] = { width, height, depth };
+        if (fwrite(header, 2, 4, file) != 4) ok = false; // write header
+        if (fwrite(extent, 4, 3, file) != 3) ok = false; // write 32 bit dimensions
+    }
+    else
+    {
+        unsigned short header[] = { (unsigned short)width, (unsigned short)height, (unsigned short)depth, bitsPerVoxel };
+        if (fwrite(header, 2, 4, file) != 4) ok = false; // write header
+    }
+
+    // write volume
+    for (size_t offset = 0; ok && offset < byteSizeVolume; offset += blockSize)
+    {
+        size_t bytes = (byteSizeVolume - offset < blockSize) ? byteSizeVolume - offset : blockSize;
+        if (fwrite(volume + offset, 1, bytes, file) != bytes) ok = false;
+    }
+
+    if (fclose(file) != 0) ok = false;
+    if (!ok) IOERROR();
+
+    if (seconds != NULL) *seconds = gettime() - start;
+
+    return(ok);
+}
+
+
+// decode the volume on many threads at once, re-encode it concurrently and decode that again.
+// every result has to match a serial decode bit for bit, which fails if DDS streams share any state.
+static int stressTest(const char *filename, unsigned int numThreads, unsigned int rounds)
+{
+    unsigned char *reference;
+
+    unsigned int width, height, depth, components;
+
+    float scalex, scaley, scalez;
+
+    if ((reference = readPVMvolume(filename, &width, &height, &depth, &components, &scalex, &scaley, &scalez)) == NULL) return(1);
+
+    size_t bytes = (size_t)width*height*depth*components;
+
+    std::atomic<unsigned int> failures(0), checks(0);
+
+    // reads and compares one volume, the copy is freed
+    auto check = [&](unsigned char *volume, unsigned int w, unsigned int h, unsigned int d, unsigned int c)
+    {
+        if (volume == NULL || w != width || h != height || d != depth || c != components || memcmp(volume, reference, bytes) != 0) failures++;
+        checks++;
+        if (volume != NULL) free(volume);
+    };
+
+    printf("stress testing with %u threads and %u rounds\n", numThreads, rounds);
+
+    double start = gettime();
+
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < numThreads; t++)
+    {
+        threads.push_back(std::thread([&, t]()
+        {
+            std::string copy = std::string(filename) + ".stress" + std::to_string(t);
+
+            for (unsigned int r = 0; r < rounds; r++)
+            {
+                unsigned int w, h, d, c;
+
+                unsigned char *volume = readPVMvolume(filename, &w, &h, &d, &c);
+                if (volume == NULL) { failures++; continue; }
+
+                writePVMvolume(copy.c_str(), volume, w, h, d, c, scalex, scaley, scalez);
+                check(volume, w, h, d, c);
+
+                volume = readPVMvolume(copy.c_str(), &w, &h, &d, &c);
+                check(volume, w, h, d, c);
+            }
+
+            removefile(copy.c_str());
+        }));
+    }
+
+    for (unsigned int t = 0; t < threads.size(); t++) threads[t].join();
+
+    free(reference);
+
+    printf("%u of %u concurrent decodes differ from the serial decode (%.2f s)\n", failures.load(), checks.load(), gettime() - start);
+
+    return(failures > 0 ? 1 : 0);
+}
+
+
+// drop the file from the page cache, so that the next read comes from the disk
+static bool evictFile(const char *filename)
+{
+#ifdef LINUX
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return(false);
+    bool evicted = (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+    close(fd);
+    return(evicted);
+#else
+    return(false);
+#endif
+}
+
+// read throughput of readRAWfile and readDDSfile against the raw bandwidth of reading the file into one reused buffer.
+// each read is timed once with the file evicted from the page cache and as the best of several cached reads.
+static int readBenchmark(const char *filename, unsigned int rounds)
+{
+    const size_t blockSize = 1 << 24;
+
+    unsigned int fileBytes = 0;
+
+    unsigned char *data = readRAWfile(filename, &fileBytes);
+    if (data == NULL) return(1);
+    free(data);
+
+    std::vector<unsigned char> block(blockSize);
+
+    auto rawRead = [&]() -> bool
+    {
+        FILE *file = fopen(filename, "rb");
+        if (file == NULL) return(false);
+        while (fread(block.data(), 1, blockSize, file) == blockSize);
+        fclose(file);
+        return(true);
+    };
+
+    auto fileRead = [&](bool hugepages) -> bool
+    {
+        unsigned int bytes;
+        setDDShugepages(hugepages);
+        unsigned char *data = readRAWfile(filename, &bytes);
+        setDDShugepages(FALSE);
+        if (data == NULL) return(false);
+        free(data);
+        return(true);
+    };
+
+    auto ddsRead = [&](bool hugepages) -> bool
+    {
+        unsigned int bytes;
+        setDDShugepages(hugepages);
+        unsigned char *data = readDDSfile(filename, &bytes);
+        setDDShugepages(FALSE);
+        if (data == NULL) return(false);
+        free(data);
+        return(true);
+    };
+
+    // prints the throughput in MB of the file per second
+    auto measure = [&](const char *name, std::function<bool()> read)
+    {
+        double cold = -1.0, warm = 1e30;
+
+        if (evictFile(filename))
+        {
+            double start = gettime();
+            if (!read()) return;
+            cold = gettime() - start;
+        }
+
+        for (unsigned int r = 0; r < rounds; r++)
+        {
+            double start = gettime();
+            if (!read()) return;
+            warm = fmin(warm, gettime() - start);
+        }
+
+        double megabytes = fileBytes / (1024.0*1024.0);
+        if (cold > 0.0) printf("%-28s %10.1f MB/s %10.1f MB/s\n", name, megabytes / cold, megabytes / warm);
+        else printf("%-28s %15s %10.1f MB/s\n", name, "n/a", megabytes / warm);
+    };
+
+    printf("read throughput of %.1f MB, best of %u cached reads\n", fileBytes / (1024.0*1024.0), rounds);
+    printf("%-28s %15s %15s\n", "", "uncached", "cached");
+
+    measure("raw bandwidth", rawRead);
+    measure("readRAWfile", [&]() { return(fileRead(false)); });
+    measure("readRAWfile, huge pages", [&]() { return(fileRead(true)); });
+    measure("readDDSfile", [&]() { return(ddsRead(false)); });
+    measure("readDDSfile, huge pages", [&]() { return(ddsRead(true)); });
+
+    return(0);
+}
+
+
+// the inputs of a batch: the PVM files in a directory or the lines of a manifest,
+// each line holds an input file optionally followed by its output file
+static bool listBatch(const char *source, const char *outputDir, std::vector<std::pair<std::string, std::string> > &jobs)
+{
+    auto outputFor = [&](const std::string &input)
+    {
+        size_t slash = input.find_last_of("/\\");
+        std::string name = (slash == std::string::npos) ? input : input.substr(slash + 1);
+        size_t dot = name.find_last_of('.');
+        if (dot != std::string::npos) name = name.substr(0, dot);
+        return(std::string(outputDir) + "/" + name + ".dat");
+    };
+
+#ifdef UNIX
+    struct stat st;
+    if (stat(source, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(source);
+        if (dir == NULL) return(false);
+
+        std::vector<std::string> names;
+        while (struct dirent *entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && (name.compare(name.size() - 4, 4, ".pvm") == 0 || name.compare(name.size() - 4, 4, ".PVM") == 0))
+                names.push_back(name);
+        }
+        closedir(dir);
+
+        std::sort(names.begin(), names.end());
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            std::string input = std::string(source) + "/" + names[i];
+            jobs.push_back(std::make_pair(input, outputFor(input)));
+        }
+
+        return(true);
+    }
+#endif
+
+    std::ifstream manifest(source);
+    if (!manifest) return(false);
+
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+        std::istringstream fields(line);
+        std::string input, output;
+        if (!(fields >> input) || input[0] == '#') continue;
+        if (!(fields >> output)) output = outputFor(input);
+        jobs.push_back(std::make_pair(input, output));
+    }
+
+    return(true);
+}
+
+// convert many volumes at once on a pool of worker threads. a volume is only decoded when its estimated size
+// fits into the memory budget next to the volumes in flight. the size is not known before decoding, it is
+// estimated from the file size and the largest decoded to compressed ratio seen so far and corrected after decoding.
+// a volume that exceeds the budget on its own is still converted once nothing else is in flight.
+static int batchConvert(const char *source, const char *outputDir, unsigned int numThreads, double budgetMB)
+{
+    std::vector<std::pair<std::string, std::string> > jobs;
+
+    if (!listBatch(source, outputDir, jobs))
+    {
+        printf("cannot read %s\n", source);
+        return(1);
+    }
+
+    const double budget = budgetMB * 1024.0 * 1024.0;
+
+    std::mutex mutex;
+    std::condition_variable released;
+    double reserved = 0.0, ratio = 4.0;
+    unsigned int inFlight = 0;
+
+    std::atomic<unsigned int> next(0), converted(0), failed(0);
+    std::atomic<unsigned long long> totalBytes(0);
+
+    printf("converting %u volumes with %u threads and a memory budget of %.0f MB\n", (unsigned int)jobs.size(), numThreads, budgetMB);
+
+    double start = gettime();
+
+    auto work = [&]()
+    {
+        unsigned int job;
+
+        while ((job = next++) < jobs.size())
+        {
+            const char *input = jobs[job].first.c_str();
+            const char *output = jobs[job].second.c_str();
+
+            unsigned int fileBytes = 0;
+            FILE *file = fopen(input, "rb");
+            if (file != NULL)
+            {
+                fseek(file, 0, SEEK_END);
+                fileBytes = ftell(file);
+                fclose(file);
+            }
+
+            double estimate;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                estimate = fileBytes * ratio;
+                released.wait(lock, [&]() { return(inFlight == 0 || reserved + estimate <= budget); });
+                reserved += estimate;
+                inFlight++;
+            }
+
+            double jobStart = gettime(), writeSeconds = 0.0;
+
+            unsigned int width, height, depth, components;
+            unsigned char *volume = readPVMvolume(input, &width, &height, &depth, &components);
+
+            double decodeSeconds = gettime() - jobStart;
+            double volumeBytes = (volume != NULL) ? (double)width*height*depth*components : 0.0;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                reserved += volumeBytes - estimate;
+                if (fileBytes > 0 && volumeBytes / fileBytes > ratio) ratio = volumeBytes / fileBytes;
+            }
+            released.notify_all();
+
+            bool ok = false;
+            if (volume == NULL) printf("%s: cannot read PVM file\n", input);
+            else if (components > 1) printf("%s: color volumes not supported\n", input);
+            else ok = writeDAT(output, volume, width, height, depth, &writeSeconds);
+
+            if (volume != NULL) free(volume);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                reserved -= volumeBytes;
+                inFlight--;
+            }
+            released.notify_all();
+
+            if (ok)
+            {
+                double seconds = gettime() - jobStart;
+                printf("%s -> %s: %ux%ux%u, %.1f MB in %.2f s (decode %.2f s, write %.2f s), %.1f MB/s\n",
+                       input, output, width, height, depth, volumeBytes / (1024.0*1024.0),
+                       seconds, decodeSeconds, writeSeconds, volumeBytes / (1024.0*1024.0) / fmax(seconds, 1e-9));
+                totalBytes += (unsigned long long)volumeBytes;
+                converted++;
+            }
+            else failed++;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < numThreads; t++) workers.push_back(std::thread(work));
+    work();
+    for (unsigned int t = 0; t < workers.size(); t++) workers[t].join();
+
+    double seconds = gettime() - start;
+    printf("converted %u of %u volumes, %.1f MB in %.2f s, %.1f MB/s\n", converted.load(), (unsigned int)jobs.size(),
+           totalBytes / (1024.0*1024.0), seconds, totalBytes / (1024.0*1024.0) / fmax(seconds, 1e-9));
+
+    return(failed > 0 ? 1 : 0);
+}
 
 
 int main(int argc, char *argv[])
@@ -14,9 +407,41 @@ int main(int argc, char *argv[])
 
     float scalex, scaley, scalez;
 
+    if (argc==3 && strcmp(argv[1], "-check")==0)
+    {
+        double seconds, refseconds;
+        BOOLINT same = checkDDSfile(argv[2], &seconds, &refseconds);
+        printf("decoded in %.3f s, reference decoder %.3f s (%.1fx), output %s\n",
+               seconds, refseconds, refseconds / fmax(seconds, 1e-9), same ? "identical" : "DIFFERS");
+        return(same ? 0 : 1);
+    }
+
+    if (argc>=3 && strcmp(argv[1], "-stress")==0)
+    {
+        unsigned int numThreads = (argc>3) ? atoi(argv[3]) : 16;
+        return(stressTest(argv[2], numThreads > 0 ? numThreads : 1, 4));
+    }
+
+    if (argc>=3 && strcmp(argv[1], "-readbench")==0)
+    {
+        unsigned int rounds = (argc>3) ? atoi(argv[3]) : 5;
+        return(readBenchmark(argv[2], rounds > 0 ? rounds : 1));
+    }
+
+    if (argc>=4 && strcmp(argv[1], "-batch")==0)
+    {
+        unsigned int numThreads = (argc>4) ? atoi(argv[4]) : std::thread::hardware_concurrency();
+        double budgetMB = (argc>5) ? atof(argv[5]) : 4096.0;
+        return(batchConvert(argv[2], argv[3], numThreads > 0 ? numThreads : 1, budgetMB > 0.0 ? budgetMB : 1.0));
+    }
+
     if (argc!=2 && argc!=3)
     {
         printf("usage: %s <input.pvm> [<output.dat>]\n",argv[0]);
+        printf("       %s -check <input.pvm>\n",argv[0]);
+        printf("       %s -stress <input.pvm> [<threads>]\n",argv[0]);
+        printf("       %s -readbench <input.pvm> [<rounds>]\n",argv[0]);
+        printf("       %s -batch <directory or manifest> <output directory> [<threads> [<memory budget in MB>]]\n",argv[0]);
         exit(1);
     }
 
@@ -34,28 +459,7 @@ int main(int argc, char *argv[])
     }
 
     if (argc>2)
-    {
-
-        unsigned int byteSizeHeader = 2*4;
-        unsigned int byteSizeVolume = width*height*depth*components; // assuming 8-bit voxels
-
-        // HEADER: 16 bit width, 16 bit height, 16 bit depth, 8 bit bitsPerVoxel intensity resolution
-        // DATA: voxel intensities (here we always use 8 bit resolution)
-
-        FILE *file;
-        const char *filename = argv[2];
-
-        if (byteSizeVolume < 1) ERRORMSG();
-
-        if ((file = fopen(filename, "wb")) == NULL) IOERROR();
-        unsigned short bitsPerVoxel = 8;
-        unsigned short header[] = { (unsigned short)width, (unsigned short)height, (unsigned short)depth, bitsPerVoxel };
-        if (fwrite(header, 2, 4, file) != byteSizeHeader) IOERROR(); // write wid
-        if (fwrite(volume, 1, byteSizeVolume, file) != byteSizeVolume) IOERROR(); // write volume
-
-        fclose(file);
-
-    }
+        if (!writeDAT(argv[2], volume, width, height, depth)) exit(1);
 
     free(volume);
 
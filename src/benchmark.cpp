@@ -0,0 +1,254 @@
+#include "benchmark.h"
+#include "parallel.h"
+#include "gradients.h"
+
+#include <QElapsedTimer>
+
+#include <random>
+#include <cmath>
+
+
+//-------------------------------------------------------------------------------------------------
+// Benchmarks
+//-------------------------------------------------------------------------------------------------
+
+void benchmarkNormalization(const Volume *volume)
+{
+	if (!volume) { return; }
+
+	const size_t size = volume->getSize();
+	std::vector<float> values(size);
+
+	// thread counts to measure: powers of two and the hardware thread count
+	int maxThreads = std::max(1, int(std::thread::hardware_concurrency()));
+	std::vector<int> threadCounts;
+	for (int n = 1; n < maxThreads; n *= 2)
+		threadCounts.push_back(n);
+	threadCounts.push_back(maxThreads);
+
+	// first run touches all pages of the destination and source (e.g. file mapping) outside of the measurements
+	volume->getNormalizedValues(&values.front(), 0, size);
+
+	std::cout << "BENCHMARK normalization of " << size << " " << volume->getBitsPerVoxel() << "-bit voxels to float" << std::endl;
+
+	const int previousThreads = parallelThreadsSetting();
+	const int numRuns = 5;
+	double singleThreadMs = 0.0;
+
+	for (size_t t = 0; t < threadCounts.size(); ++t) {
+		setNumThreads(threadCounts[t]);
+
+		// report the best of several runs
+		double bestMs = 0.0;
+		for (int run = 0; run < numRuns; ++run) {
+			QElapsedTimer timer;
+			timer.start();
+			volume->getNormalizedValues(&values.front(), 0, size);
+			double ms = timer.nsecsElapsed() / 1.0e6;
+			if (run == 0 || ms < bestMs)
+				bestMs = ms;
+		}
+
+		if (t == 0)
+			singleThreadMs = bestMs;
+
+		std::cout << "  " << threadCounts[t] << " threads: " << bestMs << " ms, "
+		          << (size * volume->getBytesPerVoxel() / 1.0e6) / (bestMs / 1000.0) << " MB/s, "
+		          << "speedup " << singleThreadMs / bestMs << std::endl;
+	}
+
+	setNumThreads(previousThreads);
+}
+
+static float trilinearLookup(const Volume &volume, float x, float y, float z)
+{
+	const int x0 = int(x), y0 = int(y), z0 = int(z);
+	const float fx = x - x0, fy = y - y0, fz = z - z0;
+
+	const float c00 = volume.valueAt(x0, y0,     z0    ) * (1 - fx) + volume.valueAt(x0 + 1, y0,     z0    ) * fx;
+	const float c10 = volume.valueAt(x0, y0 + 1, z0    ) * (1 - fx) + volume.valueAt(x0 + 1, y0 + 1, z0    ) * fx;
+	const float c01 = volume.valueAt(x0, y0,     z0 + 1) * (1 - fx) + volume.valueAt(x0 + 1, y0,     z0 + 1) * fx;
+	const float c11 = volume.valueAt(x0, y0 + 1, z0 + 1) * (1 - fx) + volume.valueAt(x0 + 1, y0 + 1, z0 + 1) * fx;
+
+	return ((c00 * (1 - fy) + c10 * fy) * (1 - fz)) + ((c01 * (1 - fy) + c11 * fy) * fz);
+}
+
+void benchmarkLayouts(const Volume *volume)
+{
+	if (!volume) { return; }
+
+	if (!volume->getRawVoxels() || volume->getWidth() < 2 || volume->getHeight() < 2 || volume->getDepth() < 2) {
+		std::cout << "BENCHMARK layouts needs a volume loaded with linear layout" << std::endl;
+		return;
+	}
+
+	// copies of the volume in all layouts
+	const size_t bytes = volume->getSize() * volume->getBytesPerVoxel();
+	const int w = volume->getWidth(), h = volume->getHeight(), d = volume->getDepth();
+	const char *names[3] = { "linear", "bricked", "morton" };
+	Volume layouts[3];
+	const unsigned char *source = static_cast<const unsigned char*>(volume->getRawVoxels());
+	for (int l = 0; l < 3; ++l) {
+		std::vector<unsigned char> voxels(source, source + bytes);
+		layouts[l].createFromVoxels(w, h, d, volume->getBitsPerVoxel(), voxels);
+	}
+	layouts[1].convertToBricks(32, 1);
+	layouts[2].convertToMorton();
+
+	// random sample positions and ray directions, the same for every layout
+	const int numLookups = 1 << 21;
+	const int numRays = 1 << 12;
+	const int stepsPerRay = 512;
+	std::mt19937 random(12345);
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+
+	std::vector<float> positions(numLookups * 3);
+	for (int i = 0; i < numLookups; ++i) {
+		positions[i * 3 + 0] = unit(random) * (w - 1.001f);
+		positions[i * 3 + 1] = unit(random) * (h - 1.001f);
+		positions[i * 3 + 2] = unit(random) * (d - 1.001f);
+	}
+
+	// rays start at random positions and march in random oblique directions, clamped to the volume
+	std::vector<float> rays(numRays * 6);
+	for (int i = 0; i < numRays; ++i) {
+		float dx = unit(random) - 0.5f, dy = unit(random) - 0.5f, dz = unit(random) - 0.5f;
+		const float length = std::max(1.0e-3f, std::sqrt(dx * dx + dy * dy + dz * dz));
+		rays[i * 6 + 0] = unit(random) * (w - 1.001f);
+		rays[i * 6 + 1] = unit(random) * (h - 1.001f);
+		rays[i * 6 + 2] = unit(random) * (d - 1.001f);
+		rays[i * 6 + 3] = dx / length;
+		rays[i * 6 + 4] = dy / length;
+		rays[i * 6 + 5] = dz / length;
+	}
+
+	std::cout << "BENCHMARK trilinear lookups on " << w << " x " << h << " x " << d << " " << volume->getBitsPerVoxel() << "-bit voxels" << std::endl;
+
+	for (int l = 0; l < 3; ++l) {
+		const Volume &target = layouts[l];
+
+		// the sum keeps the lookups from being optimized away
+		float sum = 0.f;
+		QElapsedTimer timer;
+		timer.start();
+		for (int i = 0; i < numLookups; ++i)
+			sum += trilinearLookup(target, positions[i * 3 + 0], positions[i * 3 + 1], positions[i * 3 + 2]);
+		const double randomNs = double(timer.nsecsElapsed()) / numLookups;
+
+		timer.start();
+		for (int i = 0; i < numRays; ++i) {
+			float x = rays[i * 6 + 0], y = rays[i * 6 + 1], z = rays[i * 6 + 2];
+			for (int s = 0; s < stepsPerRay; ++s) {
+				sum += trilinearLookup(target, x, y, z);
+				x = std::min(std::max(x + rays[i * 6 + 3], 0.f), w - 1.001f);
+				y = std::min(std::max(y + rays[i * 6 + 4], 0.f), h - 1.001f);
+				z = std::min(std::max(z + rays[i * 6 + 5], 0.f), d - 1.001f);
+			}
+		}
+		const double rayNs = double(timer.nsecsElapsed()) / (double(numRays) * stepsPerRay);
+
+		std::cout << "  " << names[l] << ": random " << randomNs << " ns, ray march " << rayNs << " ns per lookup"
+		          << " (checksum " << sum << ")" << std::endl;
+	}
+}
+
+void benchmarkGradients(const Volume *volume)
+{
+	if (!volume) { return; }
+
+	const int w = volume->getWidth(), h = volume->getHeight(), d = volume->getDepth();
+	const size_t size = volume->getSize();
+	std::vector<float> gradients(size * 3);
+
+	int maxThreads = std::max(1, int(std::thread::hardware_concurrency()));
+	std::vector<int> threadCounts;
+	for (int n = 1; n < maxThreads; n *= 2)
+		threadCounts.push_back(n);
+	threadCounts.push_back(maxThreads);
+
+	std::cout << "BENCHMARK sobel gradients of " << w << " x " << h << " x " << d << " " << volume->getBitsPerVoxel() << "-bit voxels" << std::endl;
+
+	const int previousThreads = parallelThreadsSetting();
+	double singleThreadMs = 0.0;
+
+	for (size_t t = 0; t < threadCounts.size(); ++t) {
+		setNumThreads(threadCounts[t]);
+
+		double bestMs = 0.0;
+		for (int run = 0; run < 3; ++run) {
+			QElapsedTimer timer;
+			timer.start();
+			computeGradients(*volume, 0, 0, 0, w, h, d, &gradients.front());
+			double ms = timer.nsecsElapsed() / 1.0e6;
+			if (run == 0 || ms < bestMs)
+				bestMs = ms;
+		}
+
+		if (t == 0)
+			singleThreadMs = bestMs;
+
+		std::cout << "  " << threadCounts[t] << " threads: " << bestMs << " ms, "
+		          << (size / 1.0e6) / (bestMs / 1000.0) << " Mvoxels/s, "
+		          << "speedup " << singleThreadMs / bestMs << std::endl;
+	}
+
+	setNumThreads(previousThreads);
+
+	// the direct filter is slow, compare a block at the volume corner that includes the zero border
+	const int bx = std::min(w, 64), by = std::min(h, 64), bz = std::min(d, 64);
+	std::vector<float> reference(size_t(bx) * by * bz * 3);
+	QElapsedTimer timer;
+	timer.start();
+	computeGradientsReference(*volume, 0, 0, 0, bx, by, bz, &reference.front());
+	const double referenceNs = double(timer.nsecsElapsed()) / (size_t(bx) * by * bz);
+
+	float maxError = 0.f;
+	const float *r = &reference.front();
+	for (int z = 0; z < bz; ++z) {
+		for (int y = 0; y < by; ++y) {
+			const float *g = &gradients[((size_t(z) * h + y) * w) * 3];
+			for (int i = 0; i < bx * 3; ++i, ++r)
+				maxError = std::max(maxError, std::fabs(g[i] - *r));
+		}
+	}
+
+	std::cout << "  direct filter: " << referenceNs << " ns per voxel, max difference " << maxError << std::endl;
+
+	// error of the compact encoding uploaded for shading, directions are only compared for gradients that
+	// are strong enough to weight the shading noticeably
+	QElapsedTimer encodeTimer;
+	encodeTimer.start();
+	std::vector<unsigned char> encoded(size * 3);
+	computeEncodedGradients(*volume, 0, 0, 0, w, h, d, &encoded.front());
+	const double encodeMs = encodeTimer.nsecsElapsed() / 1.0e6;
+
+	// decoded in chunks to keep a second full set of float gradients out of memory
+	const size_t chunk = size_t(1) << 20;
+	std::vector<float> decoded(std::min(size, chunk) * 3);
+
+	const float minMagnitude = 1.0e-3f;
+	const double degrees = 45.0 / std::atan(1.0);
+	double angleSum = 0.0, maxAngle = 0.0, maxMagnitudeError = 0.0;
+	size_t compared = 0;
+	for (size_t first = 0; first < size; first += chunk) {
+		const size_t count = std::min(chunk, size - first);
+		decodeGradients(&encoded[first * 3], count, &decoded.front());
+		for (size_t i = 0; i < count; ++i) {
+			const float *g = &gradients[(first + i) * 3], *e = &decoded[i * 3];
+			const double magnitude = std::sqrt(g[0] * g[0] + g[1] * g[1] + g[2] * g[2]);
+			const double decodedMagnitude = std::sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+			maxMagnitudeError = std::max(maxMagnitudeError, std::fabs(std::min(magnitude, 1.0) - decodedMagnitude));
+			if (magnitude < minMagnitude || decodedMagnitude <= 0.0)
+				continue;
+			const double cosine = (g[0] * e[0] + g[1] * e[1] + g[2] * e[2]) / (magnitude * decodedMagnitude);
+			const double angle = std::acos(std::max(-1.0, std::min(1.0, cosine))) * degrees;
+			angleSum += angle;
+			maxAngle = std::max(maxAngle, angle);
+			++compared;
+		}
+	}
+
+	std::cout << "  encoded: " << encodeMs << " ms, " << (size * 3) / (1024 * 1024) << " MB instead of "
+	          << (size * 12) / (1024 * 1024) << " MB as floats, angle error mean " << (compared ? angleSum / compared : 0.0)
+	          << " max " << maxAngle << " degrees over " << compared << " gradients, max magnitude error " << maxMagnitudeError << std::endl;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "volume.h"
+
+
+//-------------------------------------------------------------------------------------------------
+// Benchmarks
+//-------------------------------------------------------------------------------------------------
+
+// simple timing runs on the currently loaded volume, results are printed to the console.
+// they are triggered from GLWidget via keyboard shortcuts.
+
+// convert the whole volume to normalized floats with 1, 2, 4, ... up to all hardware threads
+// and report the time per run and the speedup over a single thread
+void benchmarkNormalization(const Volume *volume);
+
+// compare random trilinear lookups and oblique ray marches on copies of a linear volume in the
+// linear, bricked and morton layouts and report the time per lookup
+void benchmarkLayouts(const Volume *volume);
+
+// compute the sobel gradients of the whole volume with 1, 2, 4, ... up to all hardware threads and report
+// the time per run, then check a block of the result against the direct 54 lookup filter and report the
+// angular and magnitude error of the compact encoding used for the gradient texture
+void benchmarkGradients(const Volume *volume);
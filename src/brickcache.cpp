@@ -0,0 +1,194 @@
+#include "brickcache.h"
+
+
+//-------------------------------------------------------------------------------------------------
+// BrickCache
+//-------------------------------------------------------------------------------------------------
+
+BrickCache::BrickCache(LoadFunction load, const int numBricks, const size_t budgetBytes)
+	: load(load), numBricks(numBricks), budget(budgetBytes), readahead(4), residentBytes(0)
+	, lastRequest(-1), lastStride(0), stopPrefetch(false)
+	, hits(0), misses(0), prefetches(0), evictions(0)
+{
+	prefetchThread = std::thread(&BrickCache::prefetchLoop, this);
+}
+
+BrickCache::~BrickCache()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopPrefetch = true;
+		prefetchQueue.clear();
+	}
+	prefetchCondition.notify_all();
+	prefetchThread.join();
+}
+
+std::shared_ptr<const VolumeBrick> BrickCache::getBrick(const int i)
+{
+	if (i < 0 || i >= numBricks)
+		return nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		detectStride(i);
+
+		std::unordered_map<int, Entry>::iterator entry = entries.find(i);
+		if (entry != entries.end()) {
+			// move to the front of the LRU list
+			lru.splice(lru.begin(), lru, entry->second.position);
+			++hits;
+			return entry->second.brick;
+		}
+	}
+
+	// load outside of the lock so other threads keep being served. if two threads miss
+	// the same brick both load it, the first one inserted is kept.
+	++misses;
+	std::shared_ptr<const VolumeBrick> brick = load(i);
+	if (!brick)
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::unordered_map<int, Entry>::iterator entry = entries.find(i);
+	if (entry != entries.end())
+		return entry->second.brick;
+
+	insert(i, brick);
+	return brick;
+}
+
+void BrickCache::setBudget(const size_t budgetBytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	budget = budgetBytes;
+	evict();
+}
+
+const size_t BrickCache::getBudget() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return budget;
+}
+
+void BrickCache::setReadahead(const int numBricks)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	readahead = std::max(0, numBricks);
+	if (readahead == 0)
+		prefetchQueue.clear();
+}
+
+const int BrickCache::getReadahead() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return readahead;
+}
+
+BrickCache::Statistics BrickCache::getStatistics() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	Statistics statistics;
+	statistics.hits = hits;
+	statistics.misses = misses;
+	statistics.prefetches = prefetches;
+	statistics.evictions = evictions;
+	statistics.residentBytes = residentBytes;
+	statistics.residentBricks = int(entries.size());
+	return statistics;
+}
+
+void BrickCache::resetStatistics()
+{
+	hits = 0;
+	misses = 0;
+	prefetches = 0;
+	evictions = 0;
+}
+
+void BrickCache::insert(const int i, std::shared_ptr<const VolumeBrick> brick)
+{
+	lru.push_front(i);
+
+	Entry entry;
+	entry.brick = brick;
+	entry.position = lru.begin();
+	entry.bytes = brick->getStrideZ() * (brick->getSizeZ() + 2 * brick->getGhost()) * brick->getBytesPerVoxel();
+	entries[i] = entry;
+
+	residentBytes += entry.bytes;
+	evict();
+}
+
+void BrickCache::evict()
+{
+	// the most recently used brick always stays resident, even if it alone exceeds the budget
+	while (residentBytes > budget && lru.size() > 1) {
+		std::unordered_map<int, Entry>::iterator entry = entries.find(lru.back());
+		residentBytes -= entry->second.bytes;
+		entries.erase(entry);
+		lru.pop_back();
+		++evictions;
+	}
+}
+
+void BrickCache::detectStride(const int i)
+{
+	// repeated requests for the same brick (e.g. voxel by voxel access) do not change the pattern
+	if (i == lastRequest)
+		return;
+
+	const int stride = i - lastRequest;
+	const bool sequential = (lastRequest >= 0 && stride == lastStride);
+	lastStride = stride;
+	lastRequest = i;
+
+	if (!sequential || readahead == 0)
+		return;
+
+	// queue the next bricks along the stride that are not resident yet
+	bool queued = false;
+	for (int n = 1; n <= readahead; ++n) {
+		const int next = i + n * stride;
+		if (next < 0 || next >= numBricks)
+			break;
+		if (entries.count(next) || std::find(prefetchQueue.begin(), prefetchQueue.end(), next) != prefetchQueue.end())
+			continue;
+		prefetchQueue.push_back(next);
+		queued = true;
+	}
+
+	// drop stale predictions of earlier patterns
+	while (prefetchQueue.size() > size_t(2 * readahead))
+		prefetchQueue.pop_front();
+
+	if (queued)
+		prefetchCondition.notify_one();
+}
+
+void BrickCache::prefetchLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		prefetchCondition.wait(lock, [this]() { return stopPrefetch || !prefetchQueue.empty(); });
+		if (stopPrefetch)
+			return;
+
+		const int i = prefetchQueue.front();
+		prefetchQueue.pop_front();
+		if (entries.count(i))
+			continue;
+
+		lock.unlock();
+		std::shared_ptr<const VolumeBrick> brick = load(i);
+		lock.lock();
+
+		if (brick && !stopPrefetch && !entries.count(i)) {
+			insert(i, brick);
+			++prefetches;
+		}
+	}
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "volume.h"
+
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+
+//-------------------------------------------------------------------------------------------------
+// BrickCache
+//-------------------------------------------------------------------------------------------------
+
+// bounded LRU cache of volume bricks, loaded on demand through a load function (e.g. from disk).
+// getBrick may be called from several threads at once. when consecutive requests walk the brick grid
+// with a constant stride (slices, rows, brick-by-brick traversals), the next bricks along that stride
+// are loaded ahead of time on a background thread.
+class BrickCache
+{
+
+public:
+
+	// loads brick i, must be thread-safe. returns null on failure.
+	typedef std::function<std::shared_ptr<VolumeBrick>(int i)> LoadFunction;
+
+	BrickCache(LoadFunction load, const int numBricks, const size_t budgetBytes);
+	~BrickCache();
+
+	// brick i from the cache, loading it on a miss. evicted bricks stay valid while they are referenced,
+	// so the memory in use can briefly exceed the budget by the bricks held by callers.
+	std::shared_ptr<const VolumeBrick> getBrick(const int i);
+
+	// memory budget for resident bricks, the least recently used bricks are evicted beyond it
+	void setBudget(const size_t budgetBytes);
+	const size_t getBudget() const;
+
+	// number of bricks loaded ahead along a detected access stride, 0 disables readahead
+	void setReadahead(const int numBricks);
+	const int getReadahead() const;
+
+	// counters for sizing the budget. hits and misses are counted per getBrick request,
+	// prefetched bricks that are requested later count as hits.
+	struct Statistics
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t prefetches;
+		uint64_t evictions;
+		size_t residentBytes;
+		int residentBricks;
+	};
+
+	Statistics getStatistics() const;
+	void resetStatistics();
+
+private:
+
+	struct Entry
+	{
+		std::shared_ptr<const VolumeBrick> brick;
+		std::list<int>::iterator position;
+		size_t bytes;
+	};
+
+	// both expect the mutex to be held
+	void insert(const int i, std::shared_ptr<const VolumeBrick> brick);
+	void evict();
+
+	void detectStride(const int i);
+	void prefetchLoop();
+
+	LoadFunction load;
+	int numBricks;
+	size_t budget;
+	int readahead;
+
+	// most recently used bricks at the front
+	std::list<int> lru;
+	std::unordered_map<int, Entry> entries;
+	size_t residentBytes;
+
+	mutable std::mutex mutex;
+
+	// access pattern of the last requests, used to predict the next bricks
+	int lastRequest;
+	int lastStride;
+
+	std::deque<int> prefetchQueue;
+	std::condition_variable prefetchCondition;
+	std::thread prefetchThread;
+	bool stopPrefetch;
+
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> prefetches;
+	std::atomic<uint64_t> evictions;
+
+};
@@ -0,0 +1,185 @@
+#include "brickcodec.h"
+
+#include <algorithm>
+#include <cstdint>
+
+
+//-------------------------------------------------------------------------------------------------
+// Brick Codec
+//-------------------------------------------------------------------------------------------------
+
+static const int GROUP_SIZE = 32;
+
+// prediction from the left (a), upper (b) and upper left (c) neighbour in the slice
+static inline int predictMED(const int a, const int b, const int c)
+{
+	if (c >= std::max(a, b))
+		return std::min(a, b);
+	if (c <= std::min(a, b))
+		return std::max(a, b);
+	return a + b - c;
+}
+
+// prediction for voxel (x,y,z) at index i from the voxels before it
+template<typename T>
+static inline int predict(const T *voxels, const size_t i, const int x, const int y, const int z, const size_t strideY, const size_t strideZ)
+{
+	if (x > 0 && y > 0)
+		return predictMED(voxels[i - 1], voxels[i - strideY], voxels[i - strideY - 1]);
+	if (x > 0)
+		return voxels[i - 1];
+	if (y > 0)
+		return voxels[i - strideY];
+	if (z > 0)
+		return voxels[i - strideZ];
+	return 0;
+}
+
+static inline uint32_t zigzag(const int residual)
+{
+	return (uint32_t(residual) << 1) ^ uint32_t(residual >> 31);
+}
+
+static inline int unzigzag(const uint32_t value)
+{
+	return int(value >> 1) ^ -int(value & 1);
+}
+
+static inline int bitWidth(uint32_t value)
+{
+	int bits = 0;
+	while (value) {
+		++bits;
+		value >>= 1;
+	}
+	return bits;
+}
+
+// bit pack a group of residuals with the given width, little endian bit order
+static void packGroup(const uint32_t *values, const int count, const int bits, std::vector<unsigned char> &out)
+{
+	uint64_t buffer = 0;
+	int buffered = 0;
+	for (int i = 0; i < count; ++i) {
+		buffer |= uint64_t(values[i]) << buffered;
+		buffered += bits;
+		while (buffered >= 8) {
+			out.push_back((unsigned char)(buffer & 0xff));
+			buffer >>= 8;
+			buffered -= 8;
+		}
+	}
+	if (buffered > 0)
+		out.push_back((unsigned char)(buffer & 0xff));
+}
+
+static size_t packedBytes(const int count, const int bits)
+{
+	return (size_t(count) * bits + 7) / 8;
+}
+
+static void unpackGroup(const unsigned char *in, const int count, const int bits, uint32_t *values)
+{
+	const uint64_t mask = (uint64_t(1) << bits) - 1;
+	uint64_t buffer = 0;
+	int buffered = 0;
+	for (int i = 0; i < count; ++i) {
+		while (buffered < bits) {
+			buffer |= uint64_t(*in++) << buffered;
+			buffered += 8;
+		}
+		values[i] = uint32_t(buffer & mask);
+		buffer >>= bits;
+		buffered -= bits;
+	}
+}
+
+template<typename T>
+static void compressVoxels(const T *voxels, const int dimX, const int dimY, const int dimZ, std::vector<unsigned char> &out)
+{
+	const size_t strideY = size_t(dimX);
+	const size_t strideZ = strideY * dimY;
+	const size_t count = strideZ * dimZ;
+
+	uint32_t group[GROUP_SIZE];
+	int grouped = 0;
+	uint32_t combined = 0;
+
+	size_t i = 0;
+	for (int z = 0; z < dimZ; ++z) {
+		for (int y = 0; y < dimY; ++y) {
+			for (int x = 0; x < dimX; ++x, ++i) {
+				const uint32_t value = zigzag(int(voxels[i]) - predict(voxels, i, x, y, z, strideY, strideZ));
+				group[grouped++] = value;
+				combined |= value;
+
+				if (grouped == GROUP_SIZE || i + 1 == count) {
+					const int bits = bitWidth(combined);
+					out.push_back((unsigned char)bits);
+					if (bits > 0)
+						packGroup(group, grouped, bits, out);
+					grouped = 0;
+					combined = 0;
+				}
+			}
+		}
+	}
+}
+
+template<typename T>
+static bool decompressVoxels(const unsigned char *in, const unsigned char *end, T *voxels, const int dimX, const int dimY, const int dimZ)
+{
+	const size_t strideY = size_t(dimX);
+	const size_t strideZ = strideY * dimY;
+	const size_t count = strideZ * dimZ;
+
+	uint32_t group[GROUP_SIZE];
+	int grouped = 0, groupSize = 0;
+
+	size_t i = 0;
+	for (int z = 0; z < dimZ; ++z) {
+		for (int y = 0; y < dimY; ++y) {
+			for (int x = 0; x < dimX; ++x, ++i) {
+				if (grouped == groupSize) {
+					if (in >= end)
+						return false;
+					const int bits = *in++;
+					groupSize = int(std::min(size_t(GROUP_SIZE), count - i));
+					grouped = 0;
+					if (bits == 0) {
+						std::fill(group, group + groupSize, 0);
+					}
+					else {
+						if (bits > 32 || size_t(end - in) < packedBytes(groupSize, bits))
+							return false;
+						unpackGroup(in, groupSize, bits, group);
+						in += packedBytes(groupSize, bits);
+					}
+				}
+
+				const int value = predict(voxels, i, x, y, z, strideY, strideZ) + unzigzag(group[grouped++]);
+				voxels[i] = T(value);
+			}
+		}
+	}
+
+	return in == end;
+}
+
+void compressVoxels(const void *voxels, const int bytesPerVoxel, const int dimX, const int dimY, const int dimZ,
+                    std::vector<unsigned char> &compressed)
+{
+	if (bytesPerVoxel == 1)
+		compressVoxels(static_cast<const unsigned char*>(voxels), dimX, dimY, dimZ, compressed);
+	else
+		compressVoxels(static_cast<const unsigned short*>(voxels), dimX, dimY, dimZ, compressed);
+}
+
+bool decompressVoxels(const unsigned char *compressed, const size_t compressedBytes,
+                      void *voxels, const int bytesPerVoxel, const int dimX, const int dimY, const int dimZ)
+{
+	if (bytesPerVoxel == 1)
+		return decompressVoxels(compressed, compressed + compressedBytes, static_cast<unsigned char*>(voxels), dimX, dimY, dimZ);
+	else
+		return decompressVoxels(compressed, compressed + compressedBytes, static_cast<unsigned short*>(voxels), dimX, dimY, dimZ);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+
+//-------------------------------------------------------------------------------------------------
+// Brick Codec
+//-------------------------------------------------------------------------------------------------
+
+// lossless codec for blocks of 8 or 16 bit voxels, fast enough to decompress bricks on every cache miss.
+// each voxel is predicted from its decoded neighbours in the same slice (median edge detector as in
+// JPEG-LS, previous slice for the first voxel of a slice). the zigzag coded residuals are bit packed
+// in groups of 32, each group with the bit width of its largest residual, so homogeneous regions like
+// air shrink to one byte per group and noisy tissue to a few bits per voxel.
+
+// append the compressed voxels of a dimX * dimY * dimZ block (x-fastest) to compressed
+void compressVoxels(const void *voxels, const int bytesPerVoxel, const int dimX, const int dimY, const int dimZ,
+                    std::vector<unsigned char> &compressed);
+
+// decompress a block written by compressVoxels into voxels, returns false if the data is corrupt
+bool decompressVoxels(const unsigned char *compressed, const size_t compressedBytes,
+                      void *voxels, const int bytesPerVoxel, const int dimX, const int dimY, const int dimZ);
@@ -1,9 +1,15 @@
 #include "glwidget.h"
 
 #include "mainwindow.h"
+#include "benchmark.h"
+#include "brickcache.h"
+
+#include <QFile>
 
 GLWidget::GLWidget(QWidget *parent)
     : QOpenGLWidget(parent)
+    , gradients3DTex(nullptr)
+    , gradientBricks3DTex(nullptr)
     , volume(nullptr)
 {
 	mainWindow = qobject_cast<MainWindow *>(this->parent()->parent()->parent());
@@ -18,15 +24,23 @@ GLWidget::GLWidget(QWidget *parent)
 
 GLWidget::~GLWidget()
 {
+	gradientCache.reset();
+
 	delete logger;
 
-	delete raycastShader;
+	delete raycastUberShader;
+	for (size_t i = 0; i < raycastShaderVariants.size(); ++i)
+		delete raycastShaderVariants[i];
 	delete rayVolumeExitPosMapShader;
 
 	delete transferFunction1DTex;
 	delete rayVolumeExitPosMapFramebuffer;
-	delete volume3DTex;
+	for (size_t level = 0; level < volume3DTex.size(); ++level)
+		delete volume3DTex[level];
+	for (size_t level = 0; level < macrocell3DTex.size(); ++level)
+		delete macrocell3DTex[level];
 	delete gradients3DTex;
+	delete gradientBricks3DTex;
 }
 
 void GLWidget::initializeGL()
@@ -83,10 +97,30 @@ void GLWidget::initCamera()
 
 void GLWidget::initShaders()
 {
-	raycastShader = new QOpenGLShaderProgram(QOpenGLContext::currentContext());
-	raycastShader->addShaderFromSourceFile(QOpenGLShader::Vertex, "../src/shaders/raycast_shader.vert");
-	raycastShader->addShaderFromSourceFile(QOpenGLShader::Fragment, "../src/shaders/raycast_shader.frag");
-	raycastShader->link();
+	QFile vertexFile("../src/shaders/raycast_shader.vert");
+	QFile fragmentFile("../src/shaders/raycast_shader.frag");
+	if (!vertexFile.open(QIODevice::ReadOnly) || !fragmentFile.open(QIODevice::ReadOnly))
+		qWarning() << "Could not read raycast shader sources";
+	const QByteArray vertexSource = vertexFile.readAll();
+	const QByteArray fragmentSource = fragmentFile.readAll();
+
+	raycastUberShader = compileRaycastShader(vertexSource, fragmentSource, QByteArray());
+	raycastShader = raycastUberShader;
+
+	// the per-sample loop of the uber shader branches on the compositing method and shading, so each combination
+	// is also compiled on its own with the other methods left out. paintGL switches between the linked programs.
+	raycastShaderVariants.assign(10, nullptr);
+	for (int method = ALPHA; method <= MINIP; ++method) {
+		for (int shading = 0; shading < 2; ++shading) {
+			const QByteArray defines = "#define COMPOSITING_METHOD " + QByteArray::number(method) + "\n"
+			                         + "#define SHADING " + QByteArray::number(shading) + "\n";
+			QOpenGLShaderProgram *program = compileRaycastShader(vertexSource, fragmentSource, defines);
+			if (program->isLinked())
+				raycastShaderVariants[method * 2 + shading] = program;
+			else
+				delete program;
+		}
+	}
 
 	rayVolumeExitPosMapShader = new QOpenGLShaderProgram(QOpenGLContext::currentContext());
 	rayVolumeExitPosMapShader->addShaderFromSourceFile(QOpenGLShader::Vertex, "../src/shaders/rayvolumeexitposmap_shader.vert");
@@ -95,6 +129,28 @@ void GLWidget::initShaders()
 
 }
 
+QOpenGLShaderProgram* GLWidget::compileRaycastShader(const QByteArray &vertexSource, const QByteArray &fragmentSource, const QByteArray &defines)
+{
+	// defines have to follow the #version line
+	QByteArray source = fragmentSource;
+	const int versionEnd = source.startsWith("#version") ? source.indexOf('\n') + 1 : 0;
+	source.insert(versionEnd, defines);
+
+	QOpenGLShaderProgram *program = new QOpenGLShaderProgram(QOpenGLContext::currentContext());
+	program->addShaderFromSourceCode(QOpenGLShader::Vertex, vertexSource);
+	program->addShaderFromSourceCode(QOpenGLShader::Fragment, source);
+	program->link();
+	return program;
+}
+
+QOpenGLShaderProgram* GLWidget::currentRaycastShader() const
+{
+	const size_t variant = size_t(compositingMethod) * 2 + (enableShading ? 1 : 0);
+	if (useRaycastShaderVariants && variant < raycastShaderVariants.size() && raycastShaderVariants[variant])
+		return raycastShaderVariants[variant];
+	return raycastUberShader;
+}
+
 void GLWidget::initVolumeBBoxCubeVBO()
 {
 	// generate vertex array object (vao).
@@ -161,110 +217,351 @@ void GLWidget::loadVolume3DTex()
 {
 	if (!volume) { return; }
 
-	// fill volumeData into a 3D texture
-	if (volume3DTex) {
-		volume3DTex->destroy(); delete volume3DTex; volume3DTex = nullptr;
+	// fill volumeData into 3D textures, one per pyramid level.
+	// all levels stay resident so that switching levels during interaction is free.
+	for (size_t level = 0; level < volume3DTex.size(); ++level) {
+		if (volume3DTex[level]) {
+			volume3DTex[level]->destroy(); delete volume3DTex[level];
+		}
+	}
+	volume3DTex.assign(size_t(volume->getNumLevels()), nullptr);
+
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxTextureSize);
+
+	// voxels are uploaded at their native bit depth as normalized 8 or 16 bit texture, straight from the
+	// volume storage (or its file mapping). the shader rescales sampled values by intensityScale
+	// to the [0, 2^bitsPerVoxel] -> [0.0, 1.0] mapping of Volume::valueAt.
+	GLenum internalFormat = GL_R8;
+	GLenum type = GL_UNSIGNED_BYTE;
+	float maxValue = 255.f;
+	if (volume->getBytesPerVoxel() == 2) {
+		internalFormat = GL_R16;
+		type = GL_UNSIGNED_SHORT;
+		maxValue = 65535.f;
+	}
+	intensityScale = maxValue / (1 << volume->getBitsPerVoxel());
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	for (int level = 0; level < volume->getNumLevels(); ++level) {
+
+		const Volume *levelVolume = volume->getLevel(level);
+
+		// levels too large for a texture are skipped, rendering falls back to the next coarser level
+		if (levelVolume->getWidth() > maxTextureSize || levelVolume->getHeight() > maxTextureSize || levelVolume->getDepth() > maxTextureSize) {
+			qWarning() << "Volume level" << level << "exceeds the maximum 3D texture size of" << maxTextureSize;
+			continue;
+		}
+
+		QOpenGLTexture *texture = new QOpenGLTexture(QOpenGLTexture::Target3D);
+		texture->create();
+		texture->setWrapMode(QOpenGLTexture::Repeat);
+		texture->setMinificationFilter(QOpenGLTexture::Linear); // this is trilinear interpolation
+		texture->setMagnificationFilter(QOpenGLTexture::Linear);
+		texture->bind();
+		volume3DTex[level] = texture;
+
+		if (levelVolume->getLayout() != Volume::LINEAR) {
+			// allocate the texture, then upload brick interiors one by one skipping their ghost borders.
+			// bricks of the morton layout are copied out on the fly.
+			glTexImage3D(GL_TEXTURE_3D, 0, internalFormat, levelVolume->getWidth(), levelVolume->getHeight(), levelVolume->getDepth(), 0, GL_RED, type, nullptr);
+
+			for (int i = 0; i < levelVolume->getNumBricks(); ++i) {
+				std::shared_ptr<const VolumeBrick> brick = levelVolume->getBrick(i);
+				if (!brick)
+					continue;
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, int(brick->getStrideY()));
+				glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, int(brick->getStrideZ() / brick->getStrideY()));
+				glPixelStorei(GL_UNPACK_SKIP_PIXELS, brick->getGhost());
+				glPixelStorei(GL_UNPACK_SKIP_ROWS, brick->getGhost());
+				glPixelStorei(GL_UNPACK_SKIP_IMAGES, brick->getGhost());
+				glTexSubImage3D(GL_TEXTURE_3D, 0, brick->getOriginX(), brick->getOriginY(), brick->getOriginZ(),
+				                brick->getSizeX(), brick->getSizeY(), brick->getSizeZ(), GL_RED, type, brick->getRawVoxels());
+			}
+
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+			glPixelStorei(GL_UNPACK_SKIP_IMAGES, 0);
+		}
+		else {
+			glTexImage3D(GL_TEXTURE_3D, 0, internalFormat, levelVolume->getWidth(), levelVolume->getHeight(), levelVolume->getDepth(), 0, GL_RED, type, levelVolume->getRawVoxels());
+		}
 	}
-	volume3DTex = new QOpenGLTexture(QOpenGLTexture::Target3D);
-	volume3DTex->create();
-	volume3DTex->setFormat(QOpenGLTexture::R32F);
-	volume3DTex->setWrapMode(QOpenGLTexture::Repeat);
-	volume3DTex->setMinificationFilter(QOpenGLTexture::Linear); // this is trilinear interpolation
-	volume3DTex->setMagnificationFilter(QOpenGLTexture::Linear);
-	volume3DTex->bind();
 
-	// we can simply pass a pointer to the voxel vector since voxels only have a float member each it is same as a float array
-	// note that for some reason we need to use internalformat GL_RGB (i.e. 3 channels) since GL_INTENSITY doesnt work.
-	// yet the pixel data is still interpreted as a single intensity value due to GL_INTENSITY.
-	glTexImage3D(GL_TEXTURE_3D, 0,  GL_R32F, volume->getWidth(), volume->getHeight(), volume->getDepth(), 0,  GL_RED, GL_FLOAT, volume->getVoxels());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
 }
 
-void GLWidget::precomputeGradients3DTex()
+void GLWidget::loadMacrocells3DTex()
 {
-	if (!volume) { return; }
-
-	gradients.clear();
+	for (size_t level = 0; level < macrocell3DTex.size(); ++level) {
+		if (macrocell3DTex[level]) {
+			macrocell3DTex[level]->destroy(); delete macrocell3DTex[level];
+		}
+	}
+	macrocell3DTex.assign(size_t(volume ? volume->getNumLevels() : 0), nullptr);
+	macrocellVisibility.assign(macrocell3DTex.size(), std::vector<unsigned char>());
+	macrocellParameters.resize(macrocell3DTex.size());
 
-	// gradients at each voxel are calculated using the sobel filter.
-	// sobel filter kernels consist of an averaging and a difference kernel, i.e. compute the gradient with smoothing.
-	// for each direction d, the smoothingKernel is applied to d+1 and d-1 to average the values along the other directions,
-	// then difference of the two values is taken. here we do this for all 3 directions to build the gradient vector.
+	if (!volume) { return; }
 
-	float smoothingKernel[9] = {  1, 2, 1, 2, 4, 2, 1, 2, 1 };
-	float offsets1[9]        = { -1,-1,-1, 0, 0, 0, 1, 1, 1 };
-	float offsets2[9]        = { -1, 0, 1,-1, 0, 1,-1, 0, 1 };
+	// one visibility texel per macrocell, fetched without filtering. contents are filled on first use in paintGL.
+	for (int level = 0; level < volume->getNumLevels(); ++level) {
+
+		const MacrocellGrid *grid = volume->getLevel(level)->getMacrocells();
+		if (!grid)
+			continue;
+
+		QOpenGLTexture *texture = new QOpenGLTexture(QOpenGLTexture::Target3D);
+		texture->create();
+		texture->setWrapMode(QOpenGLTexture::ClampToEdge);
+		texture->setMinificationFilter(QOpenGLTexture::Nearest);
+		texture->setMagnificationFilter(QOpenGLTexture::Nearest);
+		texture->bind();
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, grid->getNumCellsX(), grid->getNumCellsY(), grid->getNumCellsZ(), 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+		macrocell3DTex[level] = texture;
+	}
+}
 
-	for (int x = 0; x < volume->getWidth(); ++x) {
-		for (int y = 0; y < volume->getHeight(); ++y) {
-			for (int z = 0; z < volume->getDepth(); ++z) {
+void GLWidget::updateMacrocells3DTex(const int level)
+{
+	const MacrocellGrid *grid = volume->getLevel(level)->getMacrocells();
+	if (!grid || !macrocell3DTex[level]) { return; }
 
-				float gradientX, gradientY, gradientZ;
+	// samples outside the clamp range become intensity 0. those add nothing to the projections,
+	// and nothing to alpha compositing and MIDA as long as intensity 0 maps to opacity 0.
+	MacrocellGrid::VisibilityParameters parameters;
+	parameters.clampMin = intensityClampMin;
+	parameters.clampMax = intensityClampMax;
+	parameters.skipEmpty = compositingMethod == MIP || compositingMethod == AVERAGE || compositingMethod == MINIP || opacityOffset == 0.f;
 
-				for (int i = 0; i < 9; ++i) {
-					gradientX += volume->valueAt(x-1, y+offsets1[i], z+offsets2[i]) * smoothingKernel[i];
-					gradientX -= volume->valueAt(x+1, y+offsets1[i], z+offsets2[i]) * smoothingKernel[i];
+	std::vector<unsigned char> &visibility = macrocellVisibility[level];
+	if (!visibility.empty() && parameters == macrocellParameters[level]) { return; }
 
-					gradientY += volume->valueAt(x+offsets1[i], y-1, z+offsets2[i]) * smoothingKernel[i];
-					gradientY -= volume->valueAt(x+offsets1[i], y+1, z+offsets2[i]) * smoothingKernel[i];
+	// only the cell slices whose flags changed are uploaded again
+	int dirtyBegin, dirtyEnd;
+	grid->updateVisibility(visibility, visibility.empty() ? nullptr : &macrocellParameters[level], parameters, dirtyBegin, dirtyEnd);
+	macrocellParameters[level] = parameters;
 
-					gradientZ += volume->valueAt(x+offsets1[i], y+offsets2[i], z-1) * smoothingKernel[i];
-					gradientZ -= volume->valueAt(x+offsets1[i], y+offsets2[i], z+1) * smoothingKernel[i];
-				}
+	if (dirtyBegin < dirtyEnd) {
+		const size_t cellsPerSlice = size_t(grid->getNumCellsX()) * grid->getNumCellsY();
+		macrocell3DTex[level]->bind();
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, dirtyBegin, grid->getNumCellsX(), grid->getNumCellsY(), dirtyEnd - dirtyBegin,
+		                GL_RED, GL_UNSIGNED_BYTE, &visibility[dirtyBegin * cellsPerSlice]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
+}
 
-				gradients.push_back(QVector3D(gradientX, gradientY, gradientZ));
+int GLWidget::currentLevel() const
+{
+	if (!volume) { return -1; }
 
-			}
+	// while interacting, render the finest pyramid level that fits into INTERACTIVE_LEVEL_SIZE^3
+	size_t level = 0;
+	if (interacting) {
+		while (int(level) + 1 < volume->getNumLevels()) {
+			const Volume *levelVolume = volume->getLevel(int(level));
+			if (std::max(levelVolume->getWidth(), std::max(levelVolume->getHeight(), levelVolume->getDepth())) <= INTERACTIVE_LEVEL_SIZE)
+				break;
+			++level;
 		}
 	}
 
-	// fill gradients into a 3D texture
+	for (; level < volume3DTex.size(); ++level) {
+		if (volume3DTex[level])
+			return int(level);
+	}
+	return -1;
+}
+
+void GLWidget::loadGradients3DTex()
+{
+	// the worker of the previous cache may still be reading the previous volume
+	gradientCache.reset();
+	gradientSlots.clear();
+	gradientAtlasSlots = 0;
+	gradientUsedSlots = 0;
+	gradientThreshold = -1.f;
 	if (gradients3DTex) {
 		gradients3DTex->destroy(); delete gradients3DTex; gradients3DTex = nullptr;
 	}
+	if (gradientBricks3DTex) {
+		gradientBricks3DTex->destroy(); delete gradientBricks3DTex; gradientBricks3DTex = nullptr;
+	}
+
+	// gradients are computed at full resolution and sampled at the same texture coordinates for every pyramid level,
+	// without a full resolution volume texture shading falls back to differences of volume samples
+	if (!volume || volume3DTex.empty() || !volume3DTex[0]) { return; }
+
+	// nothing is computed until shading asks for the bricks above its threshold in paintGL
+	gradientCache.reset(new GradientCache(*volume, GRADIENT_BRICK_SIZE));
+	gradientCache->setFinishedCallback([this]() { QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection); });
+	gradientSlots.assign(size_t(gradientCache->getNumBricks()), -1);
+
+	// one atlas slot index per brick, fetched without filtering
+	gradientBricks3DTex = new QOpenGLTexture(QOpenGLTexture::Target3D);
+	gradientBricks3DTex->create();
+	gradientBricks3DTex->setWrapMode(QOpenGLTexture::ClampToEdge);
+	gradientBricks3DTex->setMinificationFilter(QOpenGLTexture::Nearest);
+	gradientBricks3DTex->setMagnificationFilter(QOpenGLTexture::Nearest);
+	gradientBricks3DTex->bind();
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32I, gradientCache->getNumBricksX(), gradientCache->getNumBricksY(), gradientCache->getNumBricksZ(),
+	             0, GL_RED_INTEGER, GL_INT, &gradientSlots.front());
+}
+
+bool GLWidget::growGradientAtlas(const int numSlots)
+{
+	// slots are numbered x-fastest through slices of GRADIENT_ATLAS_SLOTS_XY^2 bricks, so adding slices keeps
+	// the position of every slot. capacity doubles to keep the number of reallocations small.
+	const int slotsPerSlice = GRADIENT_ATLAS_SLOTS_XY * GRADIENT_ATLAS_SLOTS_XY;
+	const int capacity = std::max(numSlots, 2 * gradientAtlasSlots);
+	const int slices = (capacity + slotsPerSlice - 1) / slotsPerSlice;
+	const int brickSize = gradientCache->getBrickSize();
+
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxTextureSize);
+	if (slices * brickSize > maxTextureSize || GRADIENT_ATLAS_SLOTS_XY * brickSize > maxTextureSize) {
+		qWarning() << "Gradient bricks exceed the maximum 3D texture size of" << maxTextureSize;
+		return false;
+	}
+
+	// texels are fetched one by one and the decoded gradients interpolated in the shader, interpolating
+	// the octahedral coordinates of encodeGradients across the folds of the octahedron would bend the normals
+	if (gradients3DTex) {
+		gradients3DTex->destroy(); delete gradients3DTex;
+	}
 	gradients3DTex = new QOpenGLTexture(QOpenGLTexture::Target3D);
 	gradients3DTex->create();
-	gradients3DTex->setWrapMode(QOpenGLTexture::Repeat);
-	gradients3DTex->setMinificationFilter(QOpenGLTexture::Linear); // trilinear interpolation
-	gradients3DTex->setMagnificationFilter(QOpenGLTexture::Linear);
+	gradients3DTex->setWrapMode(QOpenGLTexture::ClampToEdge);
+	gradients3DTex->setMinificationFilter(QOpenGLTexture::Nearest);
+	gradients3DTex->setMagnificationFilter(QOpenGLTexture::Nearest);
+	gradients3DTex->bind();
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB8, GRADIENT_ATLAS_SLOTS_XY * brickSize, GRADIENT_ATLAS_SLOTS_XY * brickSize, slices * brickSize,
+	             0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+	gradientAtlasSlots = slices * slotsPerSlice;
+
+	// bricks of the previous atlas are uploaded again from the cache
+	for (size_t i = 0; i < gradientSlots.size(); ++i) {
+		if (gradientSlots[i] >= 0)
+			uploadGradientBrick(int(i));
+	}
+	return true;
+}
+
+void GLWidget::uploadGradientBrick(const int i)
+{
+	int x0, y0, z0, sizeX, sizeY, sizeZ;
+	gradientCache->getBrickBox(i, x0, y0, z0, sizeX, sizeY, sizeZ);
+
+	const int slot = gradientSlots[i];
+	const int brickSize = gradientCache->getBrickSize();
+	glTexSubImage3D(GL_TEXTURE_3D, 0, (slot % GRADIENT_ATLAS_SLOTS_XY) * brickSize, ((slot / GRADIENT_ATLAS_SLOTS_XY) % GRADIENT_ATLAS_SLOTS_XY) * brickSize,
+	                (slot / (GRADIENT_ATLAS_SLOTS_XY * GRADIENT_ATLAS_SLOTS_XY)) * brickSize, sizeX, sizeY, sizeZ,
+	                GL_RGB, GL_UNSIGNED_BYTE, gradientCache->getBrick(i));
+}
+
+void GLWidget::updateGradients3DTex()
+{
+	if (!gradientCache) { return; }
+
+	// a changed threshold replaces the bricks still queued, bricks computed before are kept
+	if (shadingThreshold != gradientThreshold) {
+		gradientCache->request(shadingThreshold);
+		gradientThreshold = shadingThreshold;
+		gradientTimer.start();
+	}
+
+	std::vector<int> finished = gradientCache->takeFinished();
+	if (finished.empty()) { return; }
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	const int numSlots = gradientUsedSlots + int(finished.size());
+	if (numSlots > gradientAtlasSlots && !growGradientAtlas(numSlots)) {
+		// shading keeps falling back to differences of volume samples for the bricks left out
+		gradientCache.reset();
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		return;
+	}
+
+	// finished bricks go to the next free slots, then the slot of every brick is uploaded again
 	gradients3DTex->bind();
+	for (size_t f = 0; f < finished.size(); ++f) {
+		gradientSlots[finished[f]] = gradientUsedSlots++;
+		uploadGradientBrick(finished[f]);
+	}
+
+	gradientBricks3DTex->bind();
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, gradientCache->getNumBricksX(), gradientCache->getNumBricksY(), gradientCache->getNumBricksZ(),
+	                GL_RED_INTEGER, GL_INT, &gradientSlots.front());
 
-	// TODO TEXTURE FORMAT IS BROKEN
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB32F, volume->getWidth(), volume->getHeight(), volume->getDepth(), 0, GL_RGB, GL_FLOAT, &gradients[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
+	if (!gradientCache->isBusy()) {
+		qDebug() << "Gradients of" << gradientCache->getNumComputed() << "of" << gradientCache->getNumBricks() << "bricks,"
+		         << gradientCache->getComputedBytes() / (1024 * 1024) << "MB, computed in" << gradientTimer.elapsed() << "ms";
+	}
 }
 
 void GLWidget::dataLoaded(Volume *volumeData)
 {
 	volume = volumeData;
 
+	// volumes arrive asynchronously from the loader, so the context is not necessarily current
+	makeCurrent();
 	loadVolume3DTex();
+	loadMacrocells3DTex();
+	loadGradients3DTex();
+	doneCurrent();
     repaint();
-	//precomputeGradients3DTex();
 
 }
 
+void GLWidget::releaseVolume()
+{
+	gradientCache.reset();
+	volume = nullptr;
+}
+
 void GLWidget::paintGL()
 {
 	glClearColor(backgroundColor.red()/256.0f, backgroundColor.green()/256.0f, backgroundColor.blue()/256.0f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	if (!volume) { return; }
+	const int level = currentLevel();
+	if (level < 0) { return; }
+
+	const MacrocellGrid *macrocells = volume->getLevel(level)->getMacrocells();
+	const bool skipping = enableEmptySpaceSkipping && macrocells && macrocell3DTex[level];
+	if (skipping)
+		updateMacrocells3DTex(level);
+
+	// gradients are only computed once shading needs them
+	if (enableShading)
+		updateGradients3DTex();
+	const bool shadingGradients = enableShading && gradients3DTex;
 
 	glEnable(GL_DEPTH_TEST);
 
 	///////////////////////////////////////////////////////////////////////////////
 	// FIRST PASS
 	// generate ray volume exit position map later used to construct rays
+	// (skipped in single pass mode, where the raycast shader intersects the rays with the volume)
 	///////////////////////////////////////////////////////////////////////////////
 
-	rayVolumeExitPosMapFramebuffer->bind();
+	if (!enableSinglePass) {
+		rayVolumeExitPosMapFramebuffer->bind();
 
-	rayVolumeExitPosMapShader->bind();
+		rayVolumeExitPosMapShader->bind();
 
-	// draw volume cube back faces (front face culling enabled)
-	// rayVolumeExitPosMapShader stores interpolated back face (ray exit) positions in framebuffer texture
-	drawVolumeBBoxCube(GL_FRONT, rayVolumeExitPosMapShader);
+		// draw volume cube back faces (front face culling enabled)
+		// rayVolumeExitPosMapShader stores interpolated back face (ray exit) positions in framebuffer texture
+		drawVolumeBBoxCube(GL_FRONT, rayVolumeExitPosMapShader);
+	}
 
 	///////////////////////////////////////////////////////////////////////////////
 	// SECOND PASS
@@ -274,6 +571,7 @@ void GLWidget::paintGL()
 
 	QOpenGLFramebufferObject::bindDefault();
 
+	raycastShader = currentRaycastShader();
 	raycastShader->bind();
 	raycastShader->setUniformValue("screenDimensions", QVector2D(this->width(), this->height()));
 	raycastShader->setUniformValue("numSamples", numSamples);
@@ -289,23 +587,43 @@ void GLWidget::paintGL()
 	raycastShader->setUniformValue("ttfSampleFactor", ttfSampleFactor);
 	raycastShader->setUniformValue("ttfSampleOffset", ttfSampleOffset);
 	raycastShader->setUniformValue("midaParam", midaParam);
+	raycastShader->setUniformValue("intensityScale", intensityScale);
 
 	raycastShader->setUniformValue("transferFunction", 0); // bind shader uniform to texture unit 0
     transferFunction1DTex->bind(0); // bind texture to texture unit 0
+	raycastShader->setUniformValue("singlePass", enableSinglePass);
 	raycastShader->setUniformValue("exitPositions", 1);
 	glActiveTexture(GL_TEXTURE0 + 1);
-	glBindTexture(GL_TEXTURE_2D, rayVolumeExitPosMapFramebuffer->texture());
+	glBindTexture(GL_TEXTURE_2D, enableSinglePass ? 0 : rayVolumeExitPosMapFramebuffer->texture());
 	raycastShader->setUniformValue("volume", 2);
-	volume3DTex->bind(2);
-	//raycastShader->setUniformValue("gradients", 3);
-	//gradients3DTex->bind(3);
+	volume3DTex[level]->bind(2);
+	raycastShader->setUniformValue("enableSkipping", skipping);
+	raycastShader->setUniformValue("macrocells", 4);
+	if (skipping) {
+		const Volume *levelVolume = volume->getLevel(level);
+		raycastShader->setUniformValue("macrocellExtent", QVector3D(float(macrocells->getCellSize()) / levelVolume->getWidth(),
+		                                                            float(macrocells->getCellSize()) / levelVolume->getHeight(),
+		                                                            float(macrocells->getCellSize()) / levelVolume->getDepth()));
+		macrocell3DTex[level]->bind(4);
+	}
+	raycastShader->setUniformValue("precomputedGradients", shadingGradients);
+	raycastShader->setUniformValue("gradients", 3);
+	raycastShader->setUniformValue("gradientBricks", 5);
+	if (shadingGradients) {
+		raycastShader->setUniformValue("gradientBrickSize", gradientCache ? gradientCache->getBrickSize() : GRADIENT_BRICK_SIZE);
+		raycastShader->setUniformValue("gradientAtlasSlots", GRADIENT_ATLAS_SLOTS_XY);
+		raycastShader->setUniformValue("gradientVolumeSize", QVector3D(volume->getWidth(), volume->getHeight(), volume->getDepth()));
+		gradients3DTex->bind(3);
+		gradientBricks3DTex->bind(5);
+	}
 
 	// draw volume cube front faces (back face culling enabled)
 	// raycastShader then uses interpolated front face (ray entry) positions with exit positions from first pass
 	// to cast rays through the volume texture.
 	// raycasting determines pixel intensity by sampling the volume voxel intensities
 	// and mapping desired values to colors via the transfer function
-	drawVolumeBBoxCube(GL_BACK, raycastShader);
+	// in single pass mode the back faces are drawn instead, they cover the volume also with the camera inside it
+	drawVolumeBBoxCube(enableSinglePass ? GL_FRONT : GL_BACK, raycastShader);
 
 	/*/ DEBUG VIEW FIRST PASS TEXTURE
 	// blit framebuffer from first pass to default framebuffer
@@ -324,8 +642,10 @@ void GLWidget::drawVolumeBBoxCube(GLenum glFaceCullMode, QOpenGLShaderProgram *s
 	modelMat.translate(QVector3D(-0.5, -0.5, -0.5)); // move volume bounding box cube to center
 
 	shader->bind();
+	const QMatrix4x4 modelViewProjMat = camera.projectionMatrix() * camera.viewMatrix() * modelMat;
 	int mvpMatUniformIndex = shader->uniformLocation("modelViewProjMat");
-	shader->setUniformValue(mvpMatUniformIndex, camera.projectionMatrix() * camera.viewMatrix() * modelMat);
+	shader->setUniformValue(mvpMatUniformIndex, modelViewProjMat);
+	shader->setUniformValue("invModelViewProjMat", modelViewProjMat.inverted());
 
 	glEnable(GL_CULL_FACE);
 	glCullFace(glFaceCullMode);
@@ -345,6 +665,12 @@ void GLWidget::setPerspective(bool enabled)
 	repaint();
 }
 
+void GLWidget::setSinglePass(bool enabled)
+{
+	this->enableSinglePass = enabled;
+	repaint();
+}
+
 void GLWidget::setNumSamples(int numSamples)
 {
 	this->numSamples = numSamples;
@@ -441,7 +767,9 @@ void GLWidget::resizeGL(int w, int h)
 
 void GLWidget::mousePressEvent(QMouseEvent *event)
 {
-	setNumSamples(this->NUM_SAMPLES_INTERACTIVE);
+	// coarse pyramid levels are cheap enough to keep more samples while interacting
+	interacting = true;
+	setNumSamples(volume3DTex.size() > 1 ? this->NUM_SAMPLES_INTERACTIVE_PYRAMID : this->NUM_SAMPLES_INTERACTIVE);
 	lastMousePos = event->pos();
 }
 
@@ -455,7 +783,8 @@ void GLWidget::wheelEvent(QWheelEvent *event)
 
 void GLWidget::mouseMoveEvent(QMouseEvent *event)
 {
-	setNumSamples(this->NUM_SAMPLES_INTERACTIVE);
+	interacting = true;
+	setNumSamples(volume3DTex.size() > 1 ? this->NUM_SAMPLES_INTERACTIVE_PYRAMID : this->NUM_SAMPLES_INTERACTIVE);
 
 	int dx = event->x() - lastMousePos.x();
 	int dy = event->y() - lastMousePos.y();
@@ -484,6 +813,7 @@ void GLWidget::mouseMoveEvent(QMouseEvent *event)
 
 void GLWidget::mouseReleaseEvent(QMouseEvent *)
 {
+	interacting = false;
 	setNumSamples(this->NUM_SAMPLES_STATIC);
 	repaint();
 }
@@ -493,12 +823,93 @@ void GLWidget::keyPressEvent(QKeyEvent *event)
 	switch (event->key()) {
 		case Qt::Key_Space:
 			break;
+		case Qt::Key_B: // print timings of volume normalization with increasing thread counts
+			benchmarkNormalization(volume);
+			break;
+		case Qt::Key_L: // print timings of random trilinear lookups for the linear, bricked and morton layouts
+			benchmarkLayouts(volume);
+			break;
+		case Qt::Key_G: // print timings of the gradient computation and its error against the direct sobel filter
+			benchmarkGradients(volume);
+			break;
+		case Qt::Key_V: // toggle the specialized raycast shaders to compare frame times and images with the uber shader
+			useRaycastShaderVariants = !useRaycastShaderVariants;
+			std::cout << "Raycast shader " << (useRaycastShaderVariants ? "variants" : "uber shader") << std::endl;
+			update();
+			break;
+		case Qt::Key_F: // print frame times of the uber shader and the specialized shaders for each compositing method
+			benchmarkRaycastShaders();
+			break;
+		case Qt::Key_E: // toggle empty-space skipping to compare frame times and images
+			enableEmptySpaceSkipping = !enableEmptySpaceSkipping;
+			std::cout << "Empty-space skipping " << (enableEmptySpaceSkipping ? "enabled" : "disabled") << std::endl;
+			update();
+			break;
+		case Qt::Key_C: // print brick cache counters of a paged or compressed volume
+			if (volume && volume->getBrickCache()) {
+				BrickCache::Statistics statistics = volume->getBrickCache()->getStatistics();
+				std::cout << "BRICK CACHE " << statistics.hits << " hits, " << statistics.misses << " misses, "
+				          << statistics.prefetches << " prefetched, " << statistics.evictions << " evicted, "
+				          << statistics.residentBricks << " bricks resident in " << statistics.residentBytes / (1024 * 1024) << " MB" << std::endl;
+				if (volume->getLayout() == Volume::COMPRESSED)
+					std::cout << "COMPRESSED BRICKS " << volume->getCompressedBytes() / (1024 * 1024) << " MB" << std::endl;
+			}
+			break;
 		default:
 			event->ignore();
 			break;
 	}
 }
 
+void GLWidget::benchmarkRaycastShaders()
+{
+	if (currentLevel() < 0)
+		return;
+
+	const int NUM_FRAMES = 20;
+	const char *names[] = { "alpha", "mida", "mip", "average", "minip" };
+	const CompositingMethod previousMethod = compositingMethod;
+	const bool previousShading = enableShading;
+	const bool previousVariants = useRaycastShaderVariants;
+
+	std::cout << "BENCHMARK raycast shaders, " << NUM_FRAMES << " frames of " << width() << " x " << height()
+	          << " pixels with " << numSamples << " samples" << std::endl;
+
+	makeCurrent();
+
+	// mean time of the frames after a warm-up frame, glFinish waits until the gpu is done with each frame
+	auto frameMs = [&]() {
+		paintGL();
+		glFinish();
+		QElapsedTimer timer;
+		timer.start();
+		for (int f = 0; f < NUM_FRAMES; ++f) {
+			paintGL();
+			glFinish();
+		}
+		return timer.nsecsElapsed() * 1e-6 / NUM_FRAMES;
+	};
+
+	for (int method = ALPHA; method <= MINIP; ++method) {
+		compositingMethod = CompositingMethod(method);
+		for (int shading = 0; shading < 2; ++shading) {
+			enableShading = shading != 0;
+			useRaycastShaderVariants = false;
+			const double uberMs = frameMs();
+			useRaycastShaderVariants = true;
+			const double variantMs = frameMs();
+			std::cout << "  " << names[method] << (enableShading ? " shaded" : "") << ": uber shader " << uberMs
+			          << " ms, specialized " << variantMs << " ms per frame" << std::endl;
+		}
+	}
+
+	compositingMethod = previousMethod;
+	enableShading = previousShading;
+	useRaycastShaderVariants = previousVariants;
+	doneCurrent();
+	update();
+}
+
 void GLWidget::keyReleaseEvent(QKeyEvent *event)
 {
 
@@ -12,9 +12,14 @@
 #include <QOpenGLTexture>
 #include <QOpenGLBuffer>
 #include <QOpenGLVertexArrayObject>
+#include <QElapsedTimer>
 #include <Qt3DRender/QCamera>
 
 #include "volume.h"
+#include "macrocells.h"
+#include "gradientcache.h"
+
+#include <memory>
 
 class MainWindow;
 
@@ -38,6 +43,9 @@ public slots:
 
 	void dataLoaded(Volume *volume);
 
+	// stop background work on the current volume and stop rendering it, before the volume is deleted
+	void releaseVolume();
+
 	// set total number of samples along the ray
     void setNumSamples(int numSamples);
 
@@ -90,6 +98,10 @@ public slots:
 	// switch between perspective and orthographic camera projection mode
 	void setPerspective(bool enabled);
 
+	// compute ray entry and exit positions by intersecting each ray with the volume box in the raycast shader,
+	// instead of rendering the exit positions of the back faces into a framebuffer in a first pass
+	void setSinglePass(bool enabled);
+
 protected:
 
 	void mousePressEvent(QMouseEvent *event) Q_DECL_OVERRIDE;
@@ -112,25 +124,52 @@ private:
 	// SHADERS AND DATA
 
 	void initShaders();
+	QOpenGLShaderProgram* compileRaycastShader(const QByteArray &vertexSource, const QByteArray &fragmentSource, const QByteArray &defines);
+	QOpenGLShaderProgram* currentRaycastShader() const;
+	void benchmarkRaycastShaders();
 
     void loadTransferFunction1DTex(const QString &fileName);
     void initRayVolumeExitPosMapFramebuffer();
     void loadVolume3DTex();
-    void precomputeGradients3DTex();
+    void loadMacrocells3DTex();
+    void updateMacrocells3DTex(const int level);
+    int currentLevel() const;
+    void loadGradients3DTex();
+    void updateGradients3DTex();
+    bool growGradientAtlas(const int numSlots);
+    void uploadGradientBrick(const int i);
 
     void initVolumeBBoxCubeVBO();
     void drawVolumeBBoxCube(GLenum glFaceCullingMode, QOpenGLShaderProgram *shader);
 
     QOpenGLShaderProgram *rayVolumeExitPosMapShader;
-    QOpenGLShaderProgram *raycastShader;
+    QOpenGLShaderProgram *raycastShader; // program of the current frame, one of the below
+    QOpenGLShaderProgram *raycastUberShader; // selects compositing method and shading by uniforms
+    std::vector<QOpenGLShaderProgram*> raycastShaderVariants; // specialized for method * 2 + shading, null if not linked
+    bool useRaycastShaderVariants = true;
 
     QOpenGLTexture *transferFunction1DTex;
     QOpenGLFramebufferObject *rayVolumeExitPosMapFramebuffer;
-    QOpenGLTexture *volume3DTex;
-    QOpenGLTexture *gradients3DTex;
+    std::vector<QOpenGLTexture*> volume3DTex; // one per pyramid level, null if the level is too large
+    std::vector<QOpenGLTexture*> macrocell3DTex; // visibility of the macrocells of each pyramid level
+    QOpenGLTexture *gradients3DTex; // atlas of the computed gradient bricks
+    QOpenGLTexture *gradientBricks3DTex; // atlas slot of each gradient brick, -1 if not computed yet
 
 	Volume *volume;
-    std::vector<QVector3D> gradients;
+
+	// gradients for shading, computed in the background for the bricks above the shading threshold
+	std::unique_ptr<GradientCache> gradientCache;
+	std::vector<int> gradientSlots;
+	int gradientAtlasSlots = 0; // capacity of the atlas in bricks
+	int gradientUsedSlots = 0;
+	float gradientThreshold = -1.f; // threshold last requested from the cache, -1 if none
+	QElapsedTimer gradientTimer; // time since the last request, reported when the cache is done
+	const int GRADIENT_BRICK_SIZE = 32;
+	const int GRADIENT_ATLAS_SLOTS_XY = 8; // bricks per row and column of the atlas, slices are added as needed
+
+	// macrocell visibility of each level and the parameters it was computed for, updated incrementally
+	std::vector<std::vector<unsigned char> > macrocellVisibility;
+	std::vector<MacrocellGrid::VisibilityParameters> macrocellParameters;
 
     QOpenGLVertexArrayObject volumeBBoxCubeVAO;
 
@@ -177,6 +216,9 @@ private:
 	int numSamples = 500;
 	const int NUM_SAMPLES_STATIC = 500;
 	const int NUM_SAMPLES_INTERACTIVE = 20;
+	const int NUM_SAMPLES_INTERACTIVE_PYRAMID = 250;
+	const int INTERACTIVE_LEVEL_SIZE = 256; // largest pyramid level dimension rendered while interacting
+	bool interacting = false;
     float sampleRangeStart = 0.000f;
     float sampleRangeEnd = 1.000f;
 	float shadingThreshold = 0.15f;
@@ -189,6 +231,9 @@ private:
 	float ttfSampleFactor = 1.f;
 	float ttfSampleOffset = 0.f;
 	float midaParam = 0.f;
+	float intensityScale = 1.f; // rescales normalized integer volume textures to intensity range [0,1]
+	bool enableEmptySpaceSkipping = true;
+	bool enableSinglePass = false;
 
 	// UI AND INTERACTION
 
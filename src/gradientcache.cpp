@@ -0,0 +1,196 @@
+#include "gradientcache.h"
+#include "gradients.h"
+#include "macrocells.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+
+//-------------------------------------------------------------------------------------------------
+// GradientCache
+//-------------------------------------------------------------------------------------------------
+
+GradientCache::GradientCache(const Volume &volume, const int brickSize)
+	: volume(volume), brickSize(std::max(1, brickSize)), numComputed(0), computedBytes(0), computing(0), stopCompute(false)
+{
+	numBricksX = (volume.getWidth() + this->brickSize - 1) / this->brickSize;
+	numBricksY = (volume.getHeight() + this->brickSize - 1) / this->brickSize;
+	numBricksZ = (volume.getDepth() + this->brickSize - 1) / this->brickSize;
+
+	const size_t numBricks = size_t(numBricksX) * numBricksY * numBricksZ;
+	bricks.resize(numBricks);
+	queued.assign(numBricks, false);
+
+	// the range of a macrocell covers its voxels and their one voxel border, so the maximum over the cells
+	// overlapping a brick bounds every voxel within one voxel of the brick
+	const MacrocellGrid *grid = volume.getMacrocells();
+	if (!grid) {
+		brickMax.assign(numBricks, 1.0f);
+	}
+	else {
+		brickMax.assign(numBricks, 0.0f);
+		const int cellSize = grid->getCellSize();
+		const int dims[3] = { volume.getWidth(), volume.getHeight(), volume.getDepth() };
+
+		// bricks overlapped by cell c along an axis
+		auto bricksOfCell = [&](const int c, const int axis, int &first, int &last) {
+			first = c * cellSize / this->brickSize;
+			last = std::min((c + 1) * cellSize, dims[axis]) - 1;
+			last = last / this->brickSize;
+		};
+
+		int i = 0;
+		for (int cz = 0; cz < grid->getNumCellsZ(); ++cz) {
+			int bz0, bz1;
+			bricksOfCell(cz, 2, bz0, bz1);
+			for (int cy = 0; cy < grid->getNumCellsY(); ++cy) {
+				int by0, by1;
+				bricksOfCell(cy, 1, by0, by1);
+				for (int cx = 0; cx < grid->getNumCellsX(); ++cx, ++i) {
+					int bx0, bx1;
+					bricksOfCell(cx, 0, bx0, bx1);
+					const float cellMax = grid->getMax(i);
+					for (int bz = bz0; bz <= bz1; ++bz)
+						for (int by = by0; by <= by1; ++by)
+							for (int bx = bx0; bx <= bx1; ++bx) {
+								float &value = brickMax[(size_t(bz) * numBricksY + by) * numBricksX + bx];
+								value = std::max(value, cellMax);
+							}
+				}
+			}
+		}
+	}
+
+	computeThread = std::thread(&GradientCache::computeLoop, this);
+}
+
+GradientCache::~GradientCache()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopCompute = true;
+		queue.clear();
+	}
+	queueCondition.notify_all();
+	computeThread.join();
+}
+
+void GradientCache::request(const float threshold)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// bricks already taken by the worker stay marked until they are stored
+		for (size_t q = 0; q < queue.size(); ++q)
+			queued[queue[q]] = false;
+		queue.clear();
+
+		for (int i = 0; i < getNumBricks(); ++i) {
+			if (brickMax[i] > threshold && bricks[i].empty() && !queued[i]) {
+				queue.push_back(i);
+				queued[i] = true;
+			}
+		}
+	}
+	queueCondition.notify_one();
+}
+
+std::vector<int> GradientCache::takeFinished()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<int> result;
+	result.swap(finished);
+	return result;
+}
+
+const unsigned char* GradientCache::getBrick(const int i) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (i < 0 || i >= getNumBricks() || bricks[i].empty())
+		return nullptr;
+	return &bricks[i].front();
+}
+
+void GradientCache::getBrickBox(const int i, int &x0, int &y0, int &z0, int &sizeX, int &sizeY, int &sizeZ) const
+{
+	x0 = (i % numBricksX) * brickSize;
+	y0 = ((i / numBricksX) % numBricksY) * brickSize;
+	z0 = (i / (numBricksX * numBricksY)) * brickSize;
+	sizeX = std::min(brickSize, volume.getWidth() - x0);
+	sizeY = std::min(brickSize, volume.getHeight() - y0);
+	sizeZ = std::min(brickSize, volume.getDepth() - z0);
+}
+
+bool GradientCache::isBusy() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return !queue.empty() || computing > 0;
+}
+
+int GradientCache::getNumComputed() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return numComputed;
+}
+
+size_t GradientCache::getComputedBytes() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return computedBytes;
+}
+
+void GradientCache::setFinishedCallback(std::function<void()> callback)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	finishedCallback = callback;
+}
+
+void GradientCache::computeLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		queueCondition.wait(lock, [this]() { return stopCompute || !queue.empty(); });
+		if (stopCompute)
+			return;
+
+		// a batch of bricks is computed in parallel, each brick on one thread. batches are small,
+		// so that a new request replaces the queue without waiting for a long run of stale bricks.
+		std::vector<int> batch;
+		const size_t batchSize = size_t(getNumThreads()) * 2;
+		while (!queue.empty() && batch.size() < batchSize) {
+			batch.push_back(queue.front());
+			queue.pop_front();
+		}
+		computing = int(batch.size());
+
+		lock.unlock();
+		std::vector<std::vector<unsigned char> > results(batch.size());
+		parallelFor(0, batch.size(), [&](size_t begin, size_t end) {
+			for (size_t b = begin; b < end; ++b) {
+				int x0, y0, z0, sizeX, sizeY, sizeZ;
+				getBrickBox(batch[b], x0, y0, z0, sizeX, sizeY, sizeZ);
+				results[b].resize(size_t(sizeX) * sizeY * sizeZ * 3);
+				computeEncodedGradients(volume, x0, y0, z0, sizeX, sizeY, sizeZ, &results[b].front());
+			}
+		});
+		lock.lock();
+
+		for (size_t b = 0; b < batch.size(); ++b) {
+			const int i = batch[b];
+			computedBytes += results[b].size();
+			bricks[i].swap(results[b]);
+			queued[i] = false;
+			finished.push_back(i);
+			++numComputed;
+		}
+		computing = 0;
+
+		if (finishedCallback) {
+			std::function<void()> callback = finishedCallback;
+			lock.unlock();
+			callback();
+			lock.lock();
+		}
+	}
+}
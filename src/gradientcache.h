@@ -0,0 +1,86 @@
+#pragma once
+
+#include "volume.h"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+
+//-------------------------------------------------------------------------------------------------
+// GradientCache
+//-------------------------------------------------------------------------------------------------
+
+// encoded gradients of a volume (see encodeGradients), computed brick by brick on a background thread and
+// only for the bricks that can be shaded. the raycaster shades at the first sample above the shading threshold,
+// and the gradient there interpolates the voxels around the sample, so a brick is needed if a voxel within one
+// voxel of it is above the threshold. the maximum of that neighbourhood comes from the macrocell grid of the
+// volume, whose cell ranges include the same border. without macrocells every brick is needed.
+// computed bricks are kept, so time and memory follow the tissue above the lowest threshold requested.
+class GradientCache
+{
+
+public:
+
+	GradientCache(const Volume &volume, const int brickSize = 32);
+	~GradientCache();
+
+	const int getBrickSize() const { return brickSize; }
+	const int getNumBricksX() const { return numBricksX; }
+	const int getNumBricksY() const { return numBricksY; }
+	const int getNumBricksZ() const { return numBricksZ; }
+	const int getNumBricks() const { return int(bricks.size()); }
+
+	// queue the bricks needed at threshold that are not computed yet, in place of those queued for an earlier threshold
+	void request(const float threshold);
+
+	// indices of the bricks computed since the last call
+	std::vector<int> takeFinished();
+
+	// encoded gradients of brick i clipped to the volume (x-fastest, 3 bytes per voxel), null if not computed yet.
+	// computed bricks never change, so the data stays valid for the lifetime of the cache.
+	const unsigned char* getBrick(const int i) const;
+
+	// voxel origin and size of brick i clipped to the volume
+	void getBrickBox(const int i, int &x0, int &y0, int &z0, int &sizeX, int &sizeY, int &sizeZ) const;
+
+	// true while requested bricks are queued or being computed
+	bool isBusy() const;
+
+	int getNumComputed() const;
+	size_t getComputedBytes() const;
+
+	// called on the worker thread after a batch of bricks was computed, e.g. to schedule a repaint
+	void setFinishedCallback(std::function<void()> callback);
+
+private:
+
+	void computeLoop();
+
+	const Volume &volume;
+	int brickSize;
+	int numBricksX, numBricksY, numBricksZ;
+
+	// maximum normalized intensity within one voxel of each brick
+	std::vector<float> brickMax;
+
+	std::vector<std::vector<unsigned char> > bricks;
+	std::vector<bool> queued;
+	std::vector<int> finished;
+	int numComputed;
+	size_t computedBytes;
+	int computing; // bricks taken from the queue and not stored yet
+
+	std::function<void()> finishedCallback;
+
+	mutable std::mutex mutex;
+
+	std::deque<int> queue;
+	std::condition_variable queueCondition;
+	std::thread computeThread;
+	bool stopCompute;
+
+};
@@ -0,0 +1,415 @@
+#include "gradients.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define GRADIENTS_HAVE_SSE2_KERNELS
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GRADIENTS_HAVE_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+
+//-------------------------------------------------------------------------------------------------
+// Filter Kernels
+//-------------------------------------------------------------------------------------------------
+
+// the two 1D passes of the sobel filter over count floats. neighbours along an axis are passed as
+// offset pointers into the same slice, so one kernel serves all axes.
+// SSE2 is the x86-64 baseline, the AVX2 variants are selected at runtime if the cpu supports them.
+
+// dst[i] = a[i] + 2 * b[i] + c[i]
+static void smoothScalar(const float *a, const float *b, const float *c, float *dst, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		dst[i] = a[i] + 2.0f * b[i] + c[i];
+}
+
+// dst[i] = (c[i] - a[i]) * scale
+static void differenceScalar(const float *a, const float *c, float *dst, size_t count, float scale)
+{
+	for (size_t i = 0; i < count; ++i)
+		dst[i] = (c[i] - a[i]) * scale;
+}
+
+#ifdef GRADIENTS_HAVE_SSE2_KERNELS
+
+static void smoothSSE2(const float *a, const float *b, const float *c, float *dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 center = _mm_loadu_ps(b + i);
+		__m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(c + i)), _mm_add_ps(center, center));
+		_mm_storeu_ps(dst + i, sum);
+	}
+	smoothScalar(a + i, b + i, c + i, dst + i, count - i);
+}
+
+static void differenceSSE2(const float *a, const float *c, float *dst, size_t count, float scale)
+{
+	const __m128 factor = _mm_set1_ps(scale);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(c + i), _mm_loadu_ps(a + i)), factor));
+	differenceScalar(a + i, c + i, dst + i, count - i, scale);
+}
+
+#endif
+
+#ifdef GRADIENTS_HAVE_AVX2_KERNELS
+
+__attribute__((target("avx2")))
+static void smoothAVX2(const float *a, const float *b, const float *c, float *dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 center = _mm256_loadu_ps(b + i);
+		__m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(c + i)), _mm256_add_ps(center, center));
+		_mm256_storeu_ps(dst + i, sum);
+	}
+	smoothScalar(a + i, b + i, c + i, dst + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void differenceAVX2(const float *a, const float *c, float *dst, size_t count, float scale)
+{
+	const __m256 factor = _mm256_set1_ps(scale);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(c + i), _mm256_loadu_ps(a + i)), factor));
+	differenceScalar(a + i, c + i, dst + i, count - i, scale);
+}
+
+#endif
+
+static void smooth(const float *a, const float *b, const float *c, float *dst, size_t count)
+{
+#ifdef GRADIENTS_HAVE_AVX2_KERNELS
+	static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+	if (hasAVX2) {
+		smoothAVX2(a, b, c, dst, count);
+		return;
+	}
+#endif
+#ifdef GRADIENTS_HAVE_SSE2_KERNELS
+	smoothSSE2(a, b, c, dst, count);
+#else
+	smoothScalar(a, b, c, dst, count);
+#endif
+}
+
+static void difference(const float *a, const float *c, float *dst, size_t count, float scale)
+{
+#ifdef GRADIENTS_HAVE_AVX2_KERNELS
+	static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+	if (hasAVX2) {
+		differenceAVX2(a, c, dst, count, scale);
+		return;
+	}
+#endif
+#ifdef GRADIENTS_HAVE_SSE2_KERNELS
+	differenceSSE2(a, c, dst, count, scale);
+#else
+	differenceScalar(a, c, dst, count, scale);
+#endif
+}
+
+
+//-------------------------------------------------------------------------------------------------
+// Gradient Encoding
+//-------------------------------------------------------------------------------------------------
+
+// octahedral coordinates are quantized to 0..254 so that 0 is exact, 127 steps per unit
+static const float OCTAHEDRAL_STEPS = 127.0f;
+
+// sign of value as +-1, with the sign bit of zeros so that the SSE2 encoder folds the same way
+static inline float signNotZero(const float value)
+{
+	return std::copysign(1.0f, value);
+}
+
+static inline unsigned char quantize(const float value, const float steps)
+{
+	return (unsigned char)(int(value * steps + 0.5f));
+}
+
+static inline void encodeGradient(const float x, const float y, const float z, unsigned char *out)
+{
+	// project the direction onto the octahedron |x| + |y| + |z| = 1 and fold the lower half over the upper
+	const float inverseSum = 1.0f / std::max(std::fabs(x) + std::fabs(y) + std::fabs(z), 1.0e-30f);
+	float u = x * inverseSum, v = y * inverseSum;
+	if (z < 0.0f) {
+		const float foldedU = (1.0f - std::fabs(v)) * signNotZero(u);
+		v = (1.0f - std::fabs(u)) * signNotZero(v);
+		u = foldedU;
+	}
+	const float magnitude = std::min(1.0f, std::sqrt(x * x + y * y + z * z));
+
+	out[0] = quantize(u + 1.0f, OCTAHEDRAL_STEPS);
+	out[1] = quantize(v + 1.0f, OCTAHEDRAL_STEPS);
+	out[2] = quantize(std::sqrt(magnitude), 255.0f);
+}
+
+// encode count gradients given as separate x, y and z arrays
+static void encodeGradientsScalar(const float *x, const float *y, const float *z, unsigned char *out, size_t count)
+{
+	for (size_t i = 0; i < count; ++i, out += 3)
+		encodeGradient(x[i], y[i], z[i], out);
+}
+
+#ifdef GRADIENTS_HAVE_SSE2_KERNELS
+
+static void encodeGradientsSSE2(const float *x, const float *y, const float *z, unsigned char *out, size_t count)
+{
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(int(0x80000000)));
+	const __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+	const __m128 steps = _mm_set1_ps(OCTAHEDRAL_STEPS), magnitudeSteps = _mm_set1_ps(255.0f);
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4, out += 12) {
+		const __m128 gx = _mm_loadu_ps(x + i), gy = _mm_loadu_ps(y + i), gz = _mm_loadu_ps(z + i);
+
+		const __m128 sum = _mm_add_ps(_mm_add_ps(_mm_and_ps(gx, absMask), _mm_and_ps(gy, absMask)), _mm_and_ps(gz, absMask));
+		const __m128 inverseSum = _mm_div_ps(one, _mm_max_ps(sum, _mm_set1_ps(1.0e-30f)));
+		__m128 u = _mm_mul_ps(gx, inverseSum), v = _mm_mul_ps(gy, inverseSum);
+
+		const __m128 lower = _mm_cmplt_ps(gz, _mm_setzero_ps());
+		const __m128 foldedU = _mm_or_ps(_mm_sub_ps(one, _mm_and_ps(v, absMask)), _mm_and_ps(u, signMask));
+		const __m128 foldedV = _mm_or_ps(_mm_sub_ps(one, _mm_and_ps(u, absMask)), _mm_and_ps(v, signMask));
+		u = _mm_or_ps(_mm_and_ps(lower, foldedU), _mm_andnot_ps(lower, u));
+		v = _mm_or_ps(_mm_and_ps(lower, foldedV), _mm_andnot_ps(lower, v));
+
+		const __m128 squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(gx, gx), _mm_mul_ps(gy, gy)), _mm_mul_ps(gz, gz));
+		const __m128 root = _mm_sqrt_ps(_mm_min_ps(one, _mm_sqrt_ps(squared)));
+
+		int qu[4], qv[4], qm[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(qu), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_add_ps(u, one), steps), half)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(qv), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_add_ps(v, one), steps), half)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(qm), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(root, magnitudeSteps), half)));
+		for (int k = 0; k < 4; ++k) {
+			out[k * 3 + 0] = (unsigned char)qu[k];
+			out[k * 3 + 1] = (unsigned char)qv[k];
+			out[k * 3 + 2] = (unsigned char)qm[k];
+		}
+	}
+	encodeGradientsScalar(x + i, y + i, z + i, out, count - i);
+}
+
+#endif
+
+static void encodeGradients(const float *x, const float *y, const float *z, unsigned char *out, size_t count)
+{
+#ifdef GRADIENTS_HAVE_SSE2_KERNELS
+	encodeGradientsSSE2(x, y, z, out, count);
+#else
+	encodeGradientsScalar(x, y, z, out, count);
+#endif
+}
+
+static inline void decodeGradient(const unsigned char *in, float *out)
+{
+	const float u = in[0] / OCTAHEDRAL_STEPS - 1.0f;
+	const float v = in[1] / OCTAHEDRAL_STEPS - 1.0f;
+	float x = u, y = v;
+	const float z = 1.0f - std::fabs(u) - std::fabs(v);
+	if (z < 0.0f) {
+		x = (1.0f - std::fabs(v)) * signNotZero(u);
+		y = (1.0f - std::fabs(u)) * signNotZero(v);
+	}
+
+	const float root = in[2] / 255.0f;
+	const float scale = root * root / std::sqrt(x * x + y * y + z * z);
+	out[0] = x * scale;
+	out[1] = y * scale;
+	out[2] = z * scale;
+}
+
+void encodeGradients(const float *gradients, const size_t count, unsigned char *encoded)
+{
+	parallelFor(0, count, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			encodeGradient(gradients[i * 3], gradients[i * 3 + 1], gradients[i * 3 + 2], encoded + i * 3);
+	}, 1 << 16);
+}
+
+void decodeGradients(const unsigned char *encoded, const size_t count, float *gradients)
+{
+	parallelFor(0, count, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			decodeGradient(encoded + i * 3, gradients + i * 3);
+	}, 1 << 16);
+}
+
+
+//-------------------------------------------------------------------------------------------------
+// Gradients
+//-------------------------------------------------------------------------------------------------
+
+// the sobel kernel sums 16 voxels on either side of the center, each 2 voxels apart
+static const float SOBEL_SCALE = 1.0f / 32;
+
+// slices of the box padded by one voxel on each side, and the rows of the passes within a slice.
+// only the three slices are large, the passes run row by row on buffers that stay in the L1 cache.
+struct GradientBuffers
+{
+	int width, height; // padded slice size, rows are sizeX + 2 floats
+	std::vector<float> storage;
+	float *planes[3]; // rolling window of the slices z-1, z and z+1
+	float *smoothed[3], *differenced[3]; // [1,2,1] and central difference of the window along z, rows y-1, y and y+1
+	float *smoothedX[3]; // smoothed rows additionally smoothed along x
+	float *smoothedY, *differencedY; // smoothed and differenced rows smoothed along y
+	float *gradientX, *gradientY, *gradientZ;
+
+	GradientBuffers(const int sizeX, const int sizeY)
+		: width(sizeX + 2), height(sizeY + 2), storage(size_t(width) * (size_t(height) * 3 + 14))
+	{
+		const size_t slice = size_t(width) * height;
+		float *next = &storage.front();
+		for (int i = 0; i < 3; ++i, next += slice)
+			planes[i] = next;
+		float **rows[14] = { &smoothed[0], &smoothed[1], &smoothed[2], &differenced[0], &differenced[1], &differenced[2],
+		                     &smoothedX[0], &smoothedX[1], &smoothedX[2], &smoothedY, &differencedY, &gradientX, &gradientY, &gradientZ };
+		for (int i = 0; i < 14; ++i, next += width)
+			*rows[i] = next;
+	}
+
+	// passes along z and x for padded row r of the window, stored in the ring slot of the row
+	void filterRow(const int r)
+	{
+		const size_t offset = size_t(r) * width;
+		const int slot = r % 3;
+		smooth(planes[0] + offset, planes[1] + offset, planes[2] + offset, smoothed[slot], width);
+		difference(planes[0] + offset, planes[2] + offset, differenced[slot], width, SOBEL_SCALE);
+		smooth(smoothed[slot], smoothed[slot] + 1, smoothed[slot] + 2, smoothedX[slot] + 1, width - 2);
+	}
+};
+
+// load slice z of the volume into a padded plane, voxels outside the volume are 0
+static void loadSlice(const Volume &volume, const int x0, const int y0, const int z, float *plane, const int width, const int height)
+{
+	std::fill(plane, plane + size_t(width) * height, 0.0f);
+	if (z < 0 || z >= volume.getDepth())
+		return;
+
+	// columns of the padded rows that lie inside the volume
+	const int begin = std::max(0, x0 - 1);
+	const int end = std::min(volume.getWidth(), x0 - 1 + width);
+	if (begin >= end)
+		return;
+
+	const size_t slice = size_t(volume.getWidth()) * volume.getHeight();
+	for (int row = 0; row < height; ++row) {
+		const int y = y0 - 1 + row;
+		if (y < 0 || y >= volume.getHeight())
+			continue;
+		volume.getNormalizedValues(plane + size_t(row) * width + (begin - (x0 - 1)),
+		                           size_t(z) * slice + size_t(y) * volume.getWidth() + begin, size_t(end - begin));
+	}
+}
+
+// run the filter over the box and pass each row of gradients to storeRow(gradientX, gradientY, gradientZ, index)
+// with the index of the first voxel of the row in the box. rows of different slabs are stored concurrently.
+template<typename StoreRow>
+static void filterGradients(const Volume &volume, const int x0, const int y0, const int z0,
+                            const int sizeX, const int sizeY, const int sizeZ, StoreRow storeRow)
+{
+	if (sizeX <= 0 || sizeY <= 0 || sizeZ <= 0)
+		return;
+
+	// slabs are large enough that the two extra slices each thread loads stay cheap
+	const size_t sliceVoxels = size_t(sizeX) * sizeY;
+	const size_t minSlices = std::max(size_t(4), (size_t(1) << 18) / sliceVoxels);
+
+	parallelFor(0, size_t(sizeZ), [&](size_t slabBegin, size_t slabEnd) {
+
+		GradientBuffers b(sizeX, sizeY);
+
+		loadSlice(volume, x0, y0, z0 + int(slabBegin) - 1, b.planes[0], b.width, b.height);
+		loadSlice(volume, x0, y0, z0 + int(slabBegin), b.planes[1], b.width, b.height);
+
+		for (size_t z = slabBegin; z < slabEnd; ++z) {
+
+			loadSlice(volume, x0, y0, z0 + int(z) + 1, b.planes[2], b.width, b.height);
+
+			b.filterRow(0);
+			b.filterRow(1);
+
+			for (int y = 0; y < sizeY; ++y) {
+
+				// rows y-1, y and y+1 of the box are padded rows y, y+1 and y+2
+				b.filterRow(y + 2);
+				const int above = y % 3, center = (y + 1) % 3, below = (y + 2) % 3;
+
+				// x: difference along x of the rows smoothed along z and y
+				smooth(b.smoothed[above], b.smoothed[center], b.smoothed[below], b.smoothedY, b.width);
+				difference(b.smoothedY, b.smoothedY + 2, b.gradientX, sizeX, SOBEL_SCALE);
+
+				// y: difference of the rows above and below, smoothed along z and x
+				difference(b.smoothedX[above] + 1, b.smoothedX[below] + 1, b.gradientY, sizeX, SOBEL_SCALE);
+
+				// z: difference along z smoothed along y and x
+				smooth(b.differenced[above], b.differenced[center], b.differenced[below], b.differencedY, b.width);
+				smooth(b.differencedY, b.differencedY + 1, b.differencedY + 2, b.gradientZ, sizeX);
+
+				storeRow(b.gradientX, b.gradientY, b.gradientZ, z * sliceVoxels + size_t(y) * sizeX);
+			}
+
+			std::rotate(b.planes, b.planes + 1, b.planes + 3);
+		}
+
+	}, minSlices);
+}
+
+void computeGradients(const Volume &volume, const int x0, const int y0, const int z0,
+                      const int sizeX, const int sizeY, const int sizeZ, float *gradients)
+{
+	filterGradients(volume, x0, y0, z0, sizeX, sizeY, sizeZ,
+	                [&](const float *gradientX, const float *gradientY, const float *gradientZ, size_t index) {
+		float *out = gradients + index * 3;
+		for (int x = 0; x < sizeX; ++x, out += 3) {
+			out[0] = gradientX[x];
+			out[1] = gradientY[x];
+			out[2] = gradientZ[x];
+		}
+	});
+}
+
+void computeEncodedGradients(const Volume &volume, const int x0, const int y0, const int z0,
+                             const int sizeX, const int sizeY, const int sizeZ, unsigned char *encoded)
+{
+	filterGradients(volume, x0, y0, z0, sizeX, sizeY, sizeZ,
+	                [&](const float *gradientX, const float *gradientY, const float *gradientZ, size_t index) {
+		encodeGradients(gradientX, gradientY, gradientZ, encoded + index * 3, size_t(sizeX));
+	});
+}
+
+void computeGradientsReference(const Volume &volume, const int x0, const int y0, const int z0,
+                               const int sizeX, const int sizeY, const int sizeZ, float *gradients)
+{
+	static const float smoothingKernel[9] = { 1, 2, 1, 2, 4, 2, 1, 2, 1 };
+	static const int offsets1[9]          = { -1,-1,-1, 0, 0, 0, 1, 1, 1 };
+	static const int offsets2[9]          = { -1, 0, 1,-1, 0, 1,-1, 0, 1 };
+
+	float *out = gradients;
+	for (int z = z0; z < z0 + sizeZ; ++z) {
+		for (int y = y0; y < y0 + sizeY; ++y) {
+			for (int x = x0; x < x0 + sizeX; ++x, out += 3) {
+				float gradientX = 0, gradientY = 0, gradientZ = 0;
+				for (int i = 0; i < 9; ++i) {
+					gradientX += (volume.valueAt(x+1, y+offsets1[i], z+offsets2[i]) - volume.valueAt(x-1, y+offsets1[i], z+offsets2[i])) * smoothingKernel[i];
+					gradientY += (volume.valueAt(x+offsets1[i], y+1, z+offsets2[i]) - volume.valueAt(x+offsets1[i], y-1, z+offsets2[i])) * smoothingKernel[i];
+					gradientZ += (volume.valueAt(x+offsets1[i], y+offsets2[i], z+1) - volume.valueAt(x+offsets1[i], y+offsets2[i], z-1)) * smoothingKernel[i];
+				}
+				out[0] = gradientX * SOBEL_SCALE;
+				out[1] = gradientY * SOBEL_SCALE;
+				out[2] = gradientZ * SOBEL_SCALE;
+			}
+		}
+	}
+}
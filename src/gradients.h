@@ -0,0 +1,35 @@
+#pragma once
+
+#include "volume.h"
+
+
+//-------------------------------------------------------------------------------------------------
+// Gradients
+//-------------------------------------------------------------------------------------------------
+
+// 3x3x3 sobel gradients of the normalized voxel intensities, used as normals for shading.
+// the kernel is split into 1D passes: a [1,2,1] smoothing along the two other axes and a central
+// difference along the gradient axis, each pass a vectorized loop over a zero padded slice.
+// slabs of slices are processed in parallel, each thread keeps a rolling window of three slices.
+
+// gradients of the voxels in the box starting at (x0, y0, z0) with the given size, written as interleaved
+// x, y, z floats (x-fastest, sizeX * sizeY * sizeZ * 3 floats). gradients point towards increasing
+// intensity and are scaled to intensity change per voxel, voxels outside the volume count as 0 like
+// the ghost border of bricks.
+void computeGradients(const Volume &volume, const int x0, const int y0, const int z0,
+                      const int sizeX, const int sizeY, const int sizeZ, float *gradients);
+
+// gradients of the box in the compact encoding of encodeGradients, 3 bytes per voxel
+void computeEncodedGradients(const Volume &volume, const int x0, const int y0, const int z0,
+                             const int sizeX, const int sizeY, const int sizeZ, unsigned char *encoded);
+
+// the float gradients computed directly with 54 voxel lookups each, as reference for the separable version
+void computeGradientsReference(const Volume &volume, const int x0, const int y0, const int z0,
+                               const int sizeX, const int sizeY, const int sizeZ, float *gradients);
+
+// compact encoding of 3 bytes per gradient instead of 12 for floats. the first two bytes hold the direction as
+// octahedral normal (the unit octahedron folded onto a square, 127 steps per unit), the third byte the square
+// root of the magnitude clamped to 1, which keeps the weak gradients at surfaces of low contrast precise.
+// raycast_shader.frag decodes the same way.
+void encodeGradients(const float *gradients, const size_t count, unsigned char *encoded);
+void decodeGradients(const unsigned char *encoded, const size_t count, float *gradients);
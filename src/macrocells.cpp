@@ -0,0 +1,167 @@
+#include "macrocells.h"
+#include "volume.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <numeric>
+
+
+//-------------------------------------------------------------------------------------------------
+// MacrocellGrid
+//-------------------------------------------------------------------------------------------------
+
+// tolerance for comparing cell ranges with clamp values, covers the different rounding of
+// normalized texture samples in the shader. cells within the tolerance are kept visible.
+static const float CLAMP_TOLERANCE = 1.0e-4f;
+
+MacrocellGrid::MacrocellGrid()
+	: cellSize(8), numCellsX(0), numCellsY(0), numCellsZ(0)
+{
+}
+
+bool MacrocellGrid::build(const Volume &volume, const int cellSize)
+{
+	if (cellSize <= 0)
+		return false;
+
+	const int width = volume.getWidth();
+	const int height = volume.getHeight();
+	const int depth = volume.getDepth();
+
+	this->cellSize = cellSize;
+	numCellsX = (width + cellSize - 1) / cellSize;
+	numCellsY = (height + cellSize - 1) / cellSize;
+	numCellsZ = (depth + cellSize - 1) / cellSize;
+
+	const size_t cellsPerSlice = size_t(numCellsX) * numCellsY;
+	minValues.assign(cellsPerSlice * numCellsZ, 1.0f);
+	maxValues.assign(cellsPerSlice * numCellsZ, 0.0f);
+
+	// each slice of cells reads its voxel slices plus the border slices, rows are converted in bulk.
+	// a voxel on a cell boundary also extends the range of the neighbouring cell.
+	parallelFor(0, size_t(numCellsZ), [&](size_t begin, size_t end) {
+		std::vector<float> row(width);
+
+		for (size_t cz = begin; cz < end; ++cz) {
+			float *cellMin = &minValues[cz * cellsPerSlice];
+			float *cellMax = &maxValues[cz * cellsPerSlice];
+
+			const int zBegin = int(cz) * cellSize - 1;
+			const int zEnd = std::min(int(cz + 1) * cellSize, depth) + 1;
+
+			for (int vz = zBegin; vz < zEnd; ++vz) {
+				const int z = (vz + depth) % depth;
+
+				for (int y = 0; y < height; ++y) {
+					volume.getNormalizedValues(&row.front(), size_t(y) * width + size_t(z) * width * height, size_t(width));
+
+					// cell rows touched by voxel row y, including wrapped borders
+					int cellRows[3];
+					int numCellRows = 0;
+					cellRows[numCellRows++] = y / cellSize;
+					if (y % cellSize == cellSize - 1 || y == height - 1)
+						cellRows[numCellRows++] = ((y + 1) % height) / cellSize;
+					if (y % cellSize == 0)
+						cellRows[numCellRows++] = ((y - 1 + height) % height) / cellSize;
+
+					for (int x = 0; x < width; ++x) {
+						const float value = row[x];
+
+						int cellColumns[3];
+						int numCellColumns = 0;
+						cellColumns[numCellColumns++] = x / cellSize;
+						if (x % cellSize == cellSize - 1 || x == width - 1)
+							cellColumns[numCellColumns++] = ((x + 1) % width) / cellSize;
+						if (x % cellSize == 0)
+							cellColumns[numCellColumns++] = ((x - 1 + width) % width) / cellSize;
+
+						for (int r = 0; r < numCellRows; ++r) {
+							for (int c = 0; c < numCellColumns; ++c) {
+								const size_t i = size_t(cellColumns[c]) + size_t(cellRows[r]) * numCellsX;
+								cellMin[i] = std::min(cellMin[i], value);
+								cellMax[i] = std::max(cellMax[i], value);
+							}
+						}
+					}
+				}
+			}
+		}
+	});
+
+	// orderings for incremental visibility updates
+	cellsByMin.resize(minValues.size());
+	std::iota(cellsByMin.begin(), cellsByMin.end(), 0u);
+	cellsByMax = cellsByMin;
+	std::sort(cellsByMin.begin(), cellsByMin.end(), [this](unsigned int a, unsigned int b) { return minValues[a] < minValues[b]; });
+	std::sort(cellsByMax.begin(), cellsByMax.end(), [this](unsigned int a, unsigned int b) { return maxValues[a] < maxValues[b]; });
+
+	return true;
+}
+
+bool MacrocellGrid::isVisible(const int i, const VisibilityParameters &parameters) const
+{
+	if (!parameters.skipEmpty)
+		return true;
+
+	// some value in the cell range is inside the clamp range and above zero
+	const float low = std::max(minValues[i], parameters.clampMin - CLAMP_TOLERANCE);
+	const float high = std::min(maxValues[i], parameters.clampMax + CLAMP_TOLERANCE);
+	return low <= high && high > 0.0f;
+}
+
+void MacrocellGrid::updateVisibility(std::vector<unsigned char> &visibility, const VisibilityParameters *previous,
+                                     const VisibilityParameters &current, int &dirtyBegin, int &dirtyEnd) const
+{
+	dirtyBegin = numCellsZ;
+	dirtyEnd = 0;
+
+	// an empty clamp range hides every cell regardless of the cell ranges, entering or leaving it needs a full update
+	const bool previousRangeEmpty = previous && previous->clampMin - CLAMP_TOLERANCE > previous->clampMax + CLAMP_TOLERANCE;
+	const bool currentRangeEmpty = current.clampMin - CLAMP_TOLERANCE > current.clampMax + CLAMP_TOLERANCE;
+
+	if (previous && visibility.size() == minValues.size() && previous->skipEmpty == current.skipEmpty && previousRangeEmpty == currentRangeEmpty) {
+		if (!current.skipEmpty || currentRangeEmpty)
+			return;
+
+		// a moved lower clamp only affects cells whose maximum lies between the old and new value,
+		// a moved upper clamp only cells whose minimum does
+		if (previous->clampMin != current.clampMin)
+			updateCellsInRange(visibility, cellsByMax, maxValues, std::min(previous->clampMin, current.clampMin), std::max(previous->clampMin, current.clampMin),
+			                   current, dirtyBegin, dirtyEnd);
+		if (previous->clampMax != current.clampMax)
+			updateCellsInRange(visibility, cellsByMin, minValues, std::min(previous->clampMax, current.clampMax), std::max(previous->clampMax, current.clampMax),
+			                   current, dirtyBegin, dirtyEnd);
+		return;
+	}
+
+	// full update
+	visibility.resize(minValues.size());
+	parallelFor(0, minValues.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			visibility[i] = isVisible(int(i), current) ? 255 : 0;
+	}, 4096);
+
+	dirtyBegin = 0;
+	dirtyEnd = numCellsZ;
+}
+
+void MacrocellGrid::updateCellsInRange(std::vector<unsigned char> &visibility, const std::vector<unsigned int> &sorted,
+                                       const std::vector<float> &values, float from, float to,
+                                       const VisibilityParameters &parameters, int &dirtyBegin, int &dirtyEnd) const
+{
+	from -= 2 * CLAMP_TOLERANCE;
+	to += 2 * CLAMP_TOLERANCE;
+
+	std::vector<unsigned int>::const_iterator first = std::lower_bound(sorted.begin(), sorted.end(), from,
+		[&values](unsigned int i, float value) { return values[i] < value; });
+
+	const int cellsPerSlice = numCellsX * numCellsY;
+	for (std::vector<unsigned int>::const_iterator cell = first; cell != sorted.end() && values[*cell] <= to; ++cell) {
+		const unsigned char flag = isVisible(int(*cell), parameters) ? 255 : 0;
+		if (visibility[*cell] != flag) {
+			visibility[*cell] = flag;
+			dirtyBegin = std::min(dirtyBegin, int(*cell) / cellsPerSlice);
+			dirtyEnd = std::max(dirtyEnd, int(*cell) / cellsPerSlice + 1);
+		}
+	}
+}
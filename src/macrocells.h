@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+
+
+class Volume;
+
+
+//-------------------------------------------------------------------------------------------------
+// MacrocellGrid
+//-------------------------------------------------------------------------------------------------
+
+// coarse grid of cellSize^3 voxel cells storing the normalized intensity range of each cell,
+// used by the raycaster to skip cells that cannot contribute to the image.
+// the range of a cell includes the one voxel border that trilinear samples inside the cell interpolate from,
+// wrapped around at the volume borders like the volume texture, so it bounds every sample taken in the cell.
+class MacrocellGrid
+{
+	// stores and restores the cell ranges in the sidecar cache
+	friend class VolumeSidecar;
+
+public:
+
+	MacrocellGrid();
+
+	// compute the cell ranges in parallel over z-slices of cells
+	bool build(const Volume &volume, const int cellSize = 8);
+
+	const int getCellSize() const { return cellSize; }
+	const int getNumCellsX() const { return numCellsX; }
+	const int getNumCellsY() const { return numCellsY; }
+	const int getNumCellsZ() const { return numCellsZ; }
+	const int getNumCells() const { return int(minValues.size()); }
+
+	float getMin(const int i) const { return minValues[i]; }
+	float getMax(const int i) const { return maxValues[i]; }
+
+	// rendering parameters that decide whether a cell is empty.
+	// samples outside [clampMin, clampMax] are treated as intensity 0 by the raycaster, and cells whose
+	// samples are all 0 are empty. skipEmpty is false when zero intensity samples still contribute
+	// (e.g. opacity offset), then every cell is visible.
+	struct VisibilityParameters
+	{
+		float clampMin;
+		float clampMax;
+		bool skipEmpty;
+
+		bool operator==(const VisibilityParameters &other) const
+		{
+			return clampMin == other.clampMin && clampMax == other.clampMax && skipEmpty == other.skipEmpty;
+		}
+	};
+
+	// update visibility flags (255 visible, 0 empty), one per cell in x-fastest order.
+	// given the previous parameters only cells whose range crosses a moved clamp value are re-evaluated,
+	// otherwise all cells are computed. the changed cell slices are returned as [dirtyBegin, dirtyEnd), empty if none.
+	void updateVisibility(std::vector<unsigned char> &visibility, const VisibilityParameters *previous,
+	                      const VisibilityParameters &current, int &dirtyBegin, int &dirtyEnd) const;
+
+private:
+
+	bool isVisible(const int i, const VisibilityParameters &parameters) const;
+
+	// re-evaluate cells whose value in values lies within [from, to], sorted gives the cells ordered by value
+	void updateCellsInRange(std::vector<unsigned char> &visibility, const std::vector<unsigned int> &sorted,
+	                        const std::vector<float> &values, float from, float to,
+	                        const VisibilityParameters &parameters, int &dirtyBegin, int &dirtyEnd) const;
+
+	int cellSize;
+	int numCellsX, numCellsY, numCellsZ;
+
+	std::vector<float> minValues;
+	std::vector<float> maxValues;
+
+	// cell indices ordered by minimum and by maximum, to find the cells affected by a clamp change
+	std::vector<unsigned int> cellsByMin;
+	std::vector<unsigned int> cellsByMax;
+
+};
@@ -2,15 +2,19 @@
 
 #include <QFileDialog>
 #include <QPainter>
+#include <QCoreApplication>
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
     , volume(0)
+    , loader(0)
+    , loaderThread(0)
 {
 	ui->setupUi(this);
 
 	ui->progressBar->hide();
+	ui->cancelLoadPushButton->hide();
 
 	glWidget = ui->glWidget;
 
@@ -33,14 +37,32 @@ MainWindow::MainWindow(QWidget *parent)
 	connect(ui->midaParamSlider, &QSlider::valueChanged, [this](int value) { glWidget->setMIDAParam(value/1000.f); } );
 	connect(ui->compositingModeComboBox, static_cast<void(QComboBox::*)(int)>(&QComboBox::currentIndexChanged), this, &MainWindow::setCompositing);
 	connect(ui->loadDataPushButton, &QPushButton::clicked, this, &MainWindow::openFileAction);
+	connect(ui->cancelLoadPushButton, &QPushButton::clicked, this, &MainWindow::cancelLoadAction);
 	connect(ui->loadTffImageButton, &QPushButton::clicked, glWidget, &GLWidget::loadTransferFunctionImage);
 	connect(ui->shadedCheckBox, &QCheckBox::clicked, glWidget, &GLWidget::setShading);
 	connect(ui->perspectiveCheckBox, &QCheckBox::clicked, this, &MainWindow::setPerspective);
+	connect(ui->singlePassCheckBox, &QCheckBox::clicked, glWidget, &GLWidget::setSinglePass);
+	connect(ui->autoWindowPushButton, &QPushButton::clicked, this, &MainWindow::autoWindowAction);
 
 }
 
 MainWindow::~MainWindow()
 {
+	// stop all loads still running, also those replaced by a later one, before the volume they would replace goes away
+	loader = nullptr;
+	loaderThread = nullptr;
+	for (size_t i = 0; i < loaderThreads.size(); ++i)
+		loaderThreads[i].loader->cancel();
+	for (size_t i = 0; i < loaderThreads.size(); ++i)
+		loaderThreads[i].thread->wait();
+
+	// results still queued for the window are delivered now, loadFinished deletes them since no load is current
+	QCoreApplication::sendPostedEvents(this);
+	while (!loaderThreads.empty())
+		releaseLoaderThread(loaderThreads.front().thread);
+
+	// the widget computes gradients of the volume in the background
+	glWidget->releaseVolume();
 	delete volume;
 }
 
@@ -51,54 +73,142 @@ MainWindow::~MainWindow()
 
 void MainWindow::openFileAction()
 {
-	QString filepath = QFileDialog::getOpenFileName(this, "Load Volume Data File (*.dat)", 0, tr("Supported Volume Data Files: DAT (*.dat)"));
+	QString filepath = QFileDialog::getOpenFileName(this, "Load Volume Data File (*.dat, *.pvm)", 0, tr("Supported Volume Data Files: DAT, PVM (*.dat *.pvm)"));
 
 	openFile(filepath);
 }
 
 void MainWindow::openFile(QString filepath)
 {
-	if (!filepath.isEmpty())
-	{
-		// store filename
-		fileType.filename = filepath;
-		std::string fn = filepath.toStdString();
-		bool success = false;
-
-		// progress bar and top label
-		ui->progressBar->show();
-		ui->progressBar->setEnabled(true);
-		ui->labelTop->setText("Loading data ...");
-
-		fileType.type = VOLUME;
-		volume = new Volume();
-
-		// load volume data according to file extension
-		std::string fileExtension = fn.substr(fn.find_last_of(".") + 1);
-		if (fileExtension == "dat") {
-			success = volume->loadFromFileDAT(filepath, ui->progressBar);
-		}
+	if (filepath.isEmpty())
+		return;
+
+	cancelLoading();
+
+	// store filename
+	fileType.filename = filepath;
+	fileType.type = VOLUME;
 
-		ui->progressBar->setEnabled(false);
-		ui->progressBar->hide();
+	// progress bar and top label
+	ui->progressBar->setRange(0, 100);
+	ui->progressBar->setValue(0);
+	ui->progressBar->show();
+	ui->progressBar->setEnabled(true);
+	ui->cancelLoadPushButton->show();
+	ui->labelTop->setText("Loading data ...");
 
-		QString filename = filepath.split("/").last();
+	// load on a worker thread. the thread quits by itself when the loader reports its result,
+	// the window deletes both once the thread finished (or joins them when it is closed first)
+	VolumeLoader *newLoader = new VolumeLoader(filepath, (Volume::Layout)ui->layoutComboBox->currentIndex());
+	newLoader->setCacheBudget(size_t(ui->cacheBudgetSpinBox->value()) * 1024 * 1024);
+	if (ui->pyramidComboBox->currentIndex() > 0)
+		newLoader->setPyramid(true, (Volume::Reduction)(ui->pyramidComboBox->currentIndex() - 1));
+	QThread *newLoaderThread = new QThread();
+	newLoader->moveToThread(newLoaderThread);
 
-		// status message
-		if (success)
-		{
-			QString type;
-			if (fileType.type == VOLUME) {
-				type = "VOLUME";
-				emit dataLoaded(volume);
-			}
-			ui->labelTop->setText(QString("Loaded %1-bit VOLUME [%2 x %3 x %4]\n%5").arg(QString::number(volume->getBitsPerVoxel()), QString::number(volume->getWidth()), QString::number(volume->getHeight()), QString::number(volume->getDepth()), filename));
+	connect(newLoaderThread, &QThread::started, newLoader, &VolumeLoader::load);
+	connect(newLoader, &VolumeLoader::loaded, newLoaderThread, &QThread::quit, Qt::DirectConnection);
+	connect(newLoader, &VolumeLoader::failed, newLoaderThread, &QThread::quit, Qt::DirectConnection);
+	connect(newLoader, &VolumeLoader::canceled, newLoaderThread, &QThread::quit, Qt::DirectConnection);
+	connect(newLoaderThread, &QThread::finished, this, [this, newLoaderThread]() { releaseLoaderThread(newLoaderThread); });
+
+	connect(newLoader, &VolumeLoader::progressChanged, this, [this, newLoader](int percent) {
+		if (newLoader == loader) { ui->progressBar->setValue(percent); }
+	});
+	connect(newLoader, &VolumeLoader::loaded, this, [this, newLoader](Volume *loadedVolume) {
+		loadFinished(newLoader, loadedVolume, false);
+	});
+	connect(newLoader, &VolumeLoader::failed, this, [this, newLoader]() {
+		loadFinished(newLoader, nullptr, false);
+	});
+	connect(newLoader, &VolumeLoader::canceled, this, [this, newLoader]() {
+		loadFinished(newLoader, nullptr, true);
+	});
+
+	loader = newLoader;
+	loaderThread = newLoaderThread;
+	LoaderThread started = { newLoader, newLoaderThread };
+	loaderThreads.push_back(started);
+	loaderThread->start();
+}
+
+void MainWindow::releaseLoaderThread(QThread *thread)
+{
+	for (size_t i = 0; i < loaderThreads.size(); ++i) {
+		if (loaderThreads[i].thread == thread) {
+			// finished is emitted just before the thread exits
+			thread->wait();
+			delete loaderThreads[i].loader;
+			delete thread;
+			loaderThreads.erase(loaderThreads.begin() + i);
+			return;
 		}
-		else
-		{
-			ui->labelTop->setText("ERROR loading file " + filepath + "!");
-			ui->progressBar->setValue(0);
+	}
+}
+
+void MainWindow::cancelLoading()
+{
+	// the canceled loader still reports back, loadFinished then ignores it since it is no longer current.
+	// its thread stays in loaderThreads until it finished
+	if (loader) {
+		loader->cancel();
+		loader = nullptr;
+		loaderThread = nullptr;
+	}
+}
+
+void MainWindow::loadFinished(VolumeLoader *finishedLoader, Volume *loadedVolume, bool canceled)
+{
+	// result of a load that was canceled or replaced in the meantime.
+	// the loader itself may already be deleted with its thread, so it is only compared, never dereferenced
+	if (finishedLoader != loader) {
+		delete loadedVolume;
+		return;
+	}
+
+	QString filepath = fileType.filename;
+	QString filename = filepath.split("/").last();
+
+	loader = nullptr;
+	loaderThread = nullptr;
+
+	ui->progressBar->setEnabled(false);
+	ui->progressBar->hide();
+	ui->cancelLoadPushButton->hide();
+
+	// status message
+	if (loadedVolume)
+	{
+		// switch rendering over to the new volume before releasing the previous one
+		Volume *previousVolume = volume;
+		volume = loadedVolume;
+
+		if (fileType.type == VOLUME) {
+			emit dataLoaded(volume);
 		}
+		delete previousVolume;
+
+		ui->autoWindowPushButton->setEnabled(!volume->getStatistics().histogram.empty());
+
+		ui->labelTop->setText(QString("Loaded %1-bit VOLUME [%2 x %3 x %4]\n%5").arg(QString::number(volume->getBitsPerVoxel()), QString::number(volume->getWidth()), QString::number(volume->getHeight()), QString::number(volume->getDepth()), filename));
+	}
+	else if (canceled)
+	{
+		ui->labelTop->setText("Canceled loading " + filename);
+		ui->progressBar->setValue(0);
+	}
+	else
+	{
+		ui->labelTop->setText("ERROR loading file " + filepath + "!");
+		ui->progressBar->setValue(0);
+	}
+}
+
+void MainWindow::cancelLoadAction()
+{
+	if (loader) {
+		loader->cancel();
+		ui->labelTop->setText("Canceling ...");
 	}
 }
 
@@ -117,6 +227,30 @@ void MainWindow::setShading()
 	glWidget->setShading(ui->shadedCheckBox->isChecked());
 }
 
+void MainWindow::autoWindowAction()
+{
+	if (!volume || volume->getStatistics().histogram.empty())
+		return;
+
+	const Volume::Statistics &statistics = volume->getStatistics();
+
+	// window between the 1st and 99th percentile of the non-zero voxels, so that zero padding and
+	// background do not dominate. voxels below the window are clamped away, bright voxels above it
+	// are kept and saturate the transfer function.
+	const float low = volume->normalizeValue(statistics.percentile(0.01, 1));
+	const float high = volume->normalizeValue(statistics.percentile(0.99, 1));
+	if (high <= low)
+		return;
+
+	ui->intensityClampMinSpinBox->setValue(low);
+	ui->intensityClampMaxSpinBox->setValue(volume->normalizeValue(statistics.maxValue));
+
+	// map the window onto the full transfer function
+	const float factor = 1.f / (high - low);
+	ui->ttfSampleFactorSpinBox->setValue(factor);
+	ui->ttfSampleOffsetSpinBox->setValue(-low * factor);
+}
+
 void MainWindow::setPerspective(bool enabled)
 {
 	if (enabled) {
@@ -5,6 +5,7 @@
 #include "ui_mainwindow.h"
 #include "glwidget.h"
 #include "volume.h"
+#include "volumeloader.h"
 
 #include <QMainWindow>
 #include <QPushButton>
@@ -14,6 +15,7 @@
 #include <QVariant>
 #include <QComboBox>
 #include <QMouseEvent>
+#include <QThread>
 
 
 class MainWindow : public QMainWindow
@@ -25,6 +27,8 @@ public:
 	MainWindow(QWidget *parent = 0);
 	~MainWindow();
 
+	// start loading the file on a worker thread, the current volume keeps rendering until the new one is loaded.
+	// a load that is still running is canceled.
 	void openFile(QString filepath);
 
 signals:
@@ -34,10 +38,12 @@ signals:
 protected slots :
 
 	void openFileAction();
+	void cancelLoadAction();
 	void closeAction();
 	void setCompositing(int mode);
     void setShading();
 	void setPerspective(bool enabled);
+	void autoWindowAction();
 
 private:
 
@@ -62,6 +68,22 @@ private:
 
 	Volume *volume; // for Volume-Rendering
 
+	// worker thread loading the next volume, null if no load is running
+	VolumeLoader *loader;
+	QThread *loaderThread;
+
+	// every started load until its thread finished, including canceled and replaced ones
+	struct LoaderThread
+	{
+		VolumeLoader *loader;
+		QThread *thread;
+	};
+	std::vector<LoaderThread> loaderThreads;
+
+	void cancelLoading();
+	void releaseLoaderThread(QThread *thread);
+	void loadFinished(VolumeLoader *finishedLoader, Volume *loadedVolume, bool canceled);
+
 };
 
 #endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+
+//-------------------------------------------------------------------------------------------------
+// Morton Codes
+//-------------------------------------------------------------------------------------------------
+
+// 3D Morton (Z-order) codes interleave the bits of x, y and z as ...z1y1x1z0y0x0,
+// so voxels that are close in space are close in memory along all three axes.
+// coordinates may have up to 21 bits each.
+// with BMI2 (compile with -mbmi2, see VISMED_ENABLE_BMI2) encoding and decoding are a single pdep/pext per axis,
+// otherwise lookup tables handle 8 bits (encode) or 9 interleaved bits (decode) per step.
+
+namespace morton
+{
+
+const uint64_t MASK_X = 0x1249249249249249ull;
+const uint64_t MASK_Y = MASK_X << 1;
+const uint64_t MASK_Z = MASK_X << 2;
+
+// spreads the 8 bits of a byte to every third bit
+struct EncodeTable
+{
+	uint32_t spread[256];
+
+	EncodeTable()
+	{
+		for (uint32_t v = 0; v < 256; ++v) {
+			spread[v] = 0;
+			for (uint32_t bit = 0; bit < 8; ++bit)
+				spread[v] |= ((v >> bit) & 1u) << (3 * bit);
+		}
+	}
+};
+
+// compacts 9 interleaved bits into 3 bits per axis, packed as x | y << 3 | z << 6
+struct DecodeTable
+{
+	uint16_t compact[512];
+
+	DecodeTable()
+	{
+		for (uint32_t v = 0; v < 512; ++v) {
+			compact[v] = 0;
+			for (uint32_t bit = 0; bit < 3; ++bit) {
+				compact[v] |= ((v >> (3 * bit    )) & 1u) << (bit    );
+				compact[v] |= ((v >> (3 * bit + 1)) & 1u) << (bit + 3);
+				compact[v] |= ((v >> (3 * bit + 2)) & 1u) << (bit + 6);
+			}
+		}
+	}
+};
+
+inline const EncodeTable& encodeTable()
+{
+	static const EncodeTable table;
+	return table;
+}
+
+inline const DecodeTable& decodeTable()
+{
+	static const DecodeTable table;
+	return table;
+}
+
+inline uint64_t spreadBits(uint32_t v)
+{
+	const uint32_t *spread = encodeTable().spread;
+	return uint64_t(spread[v & 0xff])
+	     | uint64_t(spread[(v >> 8) & 0xff]) << 24
+	     | uint64_t(spread[(v >> 16) & 0x1f]) << 48;
+}
+
+inline uint64_t encode(uint32_t x, uint32_t y, uint32_t z)
+{
+#if defined(__BMI2__)
+	return _pdep_u64(x, MASK_X) | _pdep_u64(y, MASK_Y) | _pdep_u64(z, MASK_Z);
+#else
+	return spreadBits(x) | spreadBits(y) << 1 | spreadBits(z) << 2;
+#endif
+}
+
+inline void decode(uint64_t code, uint32_t &x, uint32_t &y, uint32_t &z)
+{
+#if defined(__BMI2__)
+	x = uint32_t(_pext_u64(code, MASK_X));
+	y = uint32_t(_pext_u64(code, MASK_Y));
+	z = uint32_t(_pext_u64(code, MASK_Z));
+#else
+	const uint16_t *compact = decodeTable().compact;
+	x = y = z = 0;
+	for (uint32_t shift = 0; shift < 21; shift += 3) {
+		uint32_t bits = compact[(code >> (3 * shift)) & 0x1ff];
+		x |= (bits & 7u) << shift;
+		y |= ((bits >> 3) & 7u) << shift;
+		z |= ((bits >> 6) & 7u) << shift;
+	}
+#endif
+}
+
+} // namespace morton
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+
+//-------------------------------------------------------------------------------------------------
+// Parallel Loops
+//-------------------------------------------------------------------------------------------------
+
+// number of threads used by parallelFor, 0 means one thread per hardware thread
+inline int& parallelThreadsSetting()
+{
+	static int numThreads = 0;
+	return numThreads;
+}
+
+inline void setNumThreads(int numThreads)
+{
+	parallelThreadsSetting() = std::max(0, numThreads);
+}
+
+inline int getNumThreads()
+{
+	// the hardware thread count is queried once, the query costs microseconds on some systems
+	static const int hardwareThreads = int(std::thread::hardware_concurrency());
+	int numThreads = parallelThreadsSetting();
+	if (numThreads <= 0)
+		numThreads = hardwareThreads;
+	return std::max(1, numThreads);
+}
+
+// split range [begin, end) into one contiguous chunk per thread and call func(chunkBegin, chunkEnd) for each chunk.
+// the calling thread processes the first chunk itself. ranges smaller than minChunkSize per thread use fewer threads.
+template<typename Func>
+void parallelFor(size_t begin, size_t end, Func func, size_t minChunkSize = 1)
+{
+	if (end <= begin)
+		return;
+
+	size_t count = end - begin;
+	size_t numChunks = std::min(size_t(getNumThreads()), std::max(size_t(1), count / std::max(size_t(1), minChunkSize)));
+	if (numChunks <= 1) {
+		func(begin, end);
+		return;
+	}
+
+	size_t chunkSize = (count + numChunks - 1) / numChunks;
+
+	std::vector<std::thread> threads;
+	threads.reserve(numChunks - 1);
+	for (size_t chunkBegin = begin + chunkSize; chunkBegin < end; chunkBegin += chunkSize) {
+		size_t chunkEnd = std::min(end, chunkBegin + chunkSize);
+		threads.push_back(std::thread(func, chunkBegin, chunkEnd));
+	}
+
+	func(begin, std::min(end, begin + chunkSize));
+
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
@@ -0,0 +1,92 @@
+#include "pvmfile.h"
+#include "parallel.h"
+
+#include <iostream>
+#include <mutex>
+#include <climits>
+#include <cstring>
+#include <cstdint>
+
+// included last, the pvm2dat code base defines macros like min, max and fabs
+#include "ddsbase.h"
+
+
+//-------------------------------------------------------------------------------------------------
+// PVM Files
+//-------------------------------------------------------------------------------------------------
+
+bool readPVMFile(QString filepath, int &width, int &height, int &depth, int &bitsPerVoxel, std::vector<unsigned char> &voxels)
+{
+	unsigned int w = 0, h = 0, d = 0, components = 0;
+	unsigned char *data = readPVMvolume(filepath.toStdString().c_str(), &w, &h, &d, &components);
+
+	if (!data) {
+		std::cerr << "Error loading PVM file: " << filepath.toStdString() << std::endl;
+		return false;
+	}
+
+	if (w > INT_MAX || h > INT_MAX || d > INT_MAX || components < 1 || components > 4) {
+		std::cerr << "Error loading PVM file. Unsupported dimensions or components: " << filepath.toStdString() << std::endl;
+		free(data);
+		return false;
+	}
+
+	width = int(w);
+	height = int(h);
+	depth = int(d);
+	bitsPerVoxel = (components == 2 || components == 4) ? 16 : 8;
+
+	const size_t size = size_t(w) * h * d;
+	const size_t minChunk = size_t(1) << 16;
+	voxels.resize(size * (bitsPerVoxel / 8));
+
+	if (components == 1) {
+		parallelFor(0, size, [&](size_t begin, size_t end) {
+			memcpy(&voxels[begin], data + begin, end - begin);
+		}, minChunk);
+	}
+	else if (components == 2) {
+		// 16 bit voxels are stored most significant byte first
+		unsigned short *dst = reinterpret_cast<unsigned short*>(&voxels.front());
+		parallelFor(0, size, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+				dst[i] = (unsigned short)((data[2 * i] << 8) | data[2 * i + 1]);
+		}, minChunk);
+	}
+	else if (components == 3) {
+		parallelFor(0, size, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+				voxels[i] = (unsigned char)((data[3 * i] + data[3 * i + 1] + data[3 * i + 2] + 1) / 3);
+		}, minChunk);
+	}
+	else {
+		// big endian floats, scaled by the largest magnitude but at least 1 (like convfloat of pvm2dat)
+		auto magnitude = [&](size_t i) {
+			const unsigned char *p = data + 4 * i;
+			const uint32_t bits = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+			float value;
+			memcpy(&value, &bits, sizeof(value));
+			return value < 0.0f ? -value : value;
+		};
+
+		float maxValue = 1.0f;
+		std::mutex maxMutex;
+		parallelFor(0, size, [&](size_t begin, size_t end) {
+			float chunkMax = 1.0f;
+			for (size_t i = begin; i < end; ++i)
+				chunkMax = std::max(chunkMax, magnitude(i));
+			std::lock_guard<std::mutex> lock(maxMutex);
+			maxValue = std::max(maxValue, chunkMax);
+		}, minChunk);
+
+		unsigned short *dst = reinterpret_cast<unsigned short*>(&voxels.front());
+		parallelFor(0, size, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+				dst[i] = (unsigned short)(65535.0f * (magnitude(i) / maxValue) + 0.5f);
+		}, minChunk);
+	}
+
+	free(data);
+
+	return true;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <QString>
+
+#include <vector>
+
+
+//-------------------------------------------------------------------------------------------------
+// PVM Files
+//-------------------------------------------------------------------------------------------------
+
+// read a PVM volume with the DDS decoder of the pvm2dat tool, so PVM files open without converting them first.
+// the file is read while the DDS stream is decoded, the component reordering and the conversion into
+// x-fastest voxels at native bit depth run on all cores:
+// 1 component: 8 bit, 2 components: 16 bit (stored MSB first in the file),
+// 3 components: RGB averaged to 8 bit, 4 components: 32 bit float magnitudes scaled to 16 bit.
+bool readPVMFile(QString filepath, int &width, int &height, int &depth, int &bitsPerVoxel, std::vector<unsigned char> &voxels);
@@ -9,8 +9,15 @@ out vec4 outColor;
 // uniforms use the same value for all fragments
 uniform sampler1D transferFunction; // to map sampled intensities to color
 uniform sampler2D exitPositions; // precalculated exit positions for an orthogonal ray from each fragment
+uniform bool singlePass; // intersect the rays with the volume box instead of reading exitPositions
+uniform mat4 invModelViewProjMat; // from clip space back to volume texture coordinates
 uniform sampler3D volume;
-//uniform sampler3D gradients; // directions of greatest change at each voxel, used as normals for shading
+uniform sampler3D gradients; // atlas of bricks of encoded sobel gradients in intensity change per voxel, used as normals for shading
+uniform isampler3D gradientBricks; // atlas slot of each gradient brick, -1 if not computed yet
+uniform int gradientBrickSize;
+uniform int gradientAtlasSlots; // bricks per row and column of the atlas
+uniform vec3 gradientVolumeSize; // voxels of the full resolution volume the gradients belong to
+uniform bool precomputedGradients; // gradient bricks are available, otherwise differences of volume samples are used
 uniform int numSamples; // number of samples along each ray
 uniform float sampleRangeStart; // skip samples up to this point
 uniform float sampleRangeEnd; // skip samples after this point
@@ -23,28 +30,162 @@ uniform float opacityOffset;
 uniform float ttfSampleFactor; // multiply transfer function texture sample position
 uniform float ttfSampleOffset; // offset transfer function texture sample position
 uniform float midaParam; // in range [-1,1]
+uniform float intensityScale; // rescale normalized integer volume textures to intensity range [0,1]
+uniform sampler3D macrocells; // 1 if a macrocell may contain visible samples, 0 if all samples in it are empty
+uniform vec3 macrocellExtent; // macrocell size in texture coordinates
+uniform bool enableSkipping;
 
 // COMPOSITING METHODS
 // 0: Alpha compositing ("DVR")
 // 1: Maximum Intensity Difference Accumulation
 // 2: Maximum Intensity Projection
 // 3: Average Intensity Projection
+// 4: Minimum Intensity Projection
+//
+// specialized programs are compiled with COMPOSITING_METHOD defined as one of the methods and SHADING as 0 or 1,
+// which leaves out the code and state of the other methods and the branches between them for every sample.
+// without the defines the uniforms compositingMethod and enableShading select at runtime.
+#ifndef COMPOSITING_METHOD
+#define COMPOSITING_METHOD -1
+#endif
+#ifndef SHADING
+#define SHADING -1
+#endif
+#define USES_METHOD(m) (COMPOSITING_METHOD < 0 || COMPOSITING_METHOD == (m))
+
+#if COMPOSITING_METHOD < 0
 uniform int compositingMethod;
+#else
+const int compositingMethod = COMPOSITING_METHOD;
+#endif
+#if SHADING < 0
 uniform bool enableShading;
+#else
+const bool enableShading = SHADING != 0;
+#endif
+
+// sample volume intensity at given position in range [0,1]
+float sampleVolume(vec3 pos)
+{
+    return min(texture(volume, pos).r * intensityScale, 1.0);
+}
+
+// decode a texel of the gradient texture as written by encodeGradients in gradients.cpp:
+// octahedral normal in rg with 127 steps per unit, square root of the magnitude in b
+vec3 decodeGradient(vec3 encoded)
+{
+    vec2 octahedral = encoded.xy * (255.0 / 127.0) - 1.0;
+    vec3 normal = vec3(octahedral, 1.0 - abs(octahedral.x) - abs(octahedral.y));
+    if (normal.z < 0.0) {
+        vec2 signs = vec2(octahedral.x < 0.0 ? -1.0 : 1.0, octahedral.y < 0.0 ? -1.0 : 1.0);
+        normal.xy = (1.0 - abs(octahedral.yx)) * signs;
+    }
+    return normalize(normal) * (encoded.b * encoded.b);
+}
+
+// decoded gradient of a voxel, false if its brick is not computed yet
+bool fetchGradient(ivec3 voxel, out vec3 gradient)
+{
+    ivec3 brick = voxel / gradientBrickSize;
+    int slot = texelFetch(gradientBricks, brick, 0).r;
+    if (slot < 0) {
+        return false;
+    }
+
+    ivec3 origin = ivec3(slot % gradientAtlasSlots, (slot / gradientAtlasSlots) % gradientAtlasSlots, slot / (gradientAtlasSlots * gradientAtlasSlots));
+    gradient = decodeGradient(texelFetch(gradients, origin * gradientBrickSize + voxel - brick * gradientBrickSize, 0).rgb);
+    return true;
+}
+
+// trilinear interpolation of the decoded gradients around pos, false if one of them is not computed yet
+bool sampleGradient(vec3 pos, out vec3 gradient)
+{
+    ivec3 size = ivec3(gradientVolumeSize);
+    vec3 texel = pos * gradientVolumeSize - 0.5;
+    ivec3 base = ivec3(floor(texel));
+    vec3 weight = texel - floor(texel);
+
+    gradient = vec3(0.0);
+    for (int i = 0; i < 8; ++i) {
+        ivec3 corner = ivec3(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+        vec3 w = mix(1.0 - weight, weight, vec3(corner));
+        vec3 cornerGradient;
+        if (!fetchGradient(clamp(base + corner, ivec3(0), size - 1), cornerGradient)) {
+            return false;
+        }
+        gradient += w.x * w.y * w.z * cornerGradient;
+    }
+    return true;
+}
+
+// number of samples from pos on along delta that lie in the same empty macrocell, 0 if the cell is visible
+int emptyCellSteps(vec3 pos, vec3 delta)
+{
+    if (any(lessThan(pos, vec3(0.0))) || any(greaterThanEqual(pos, vec3(1.0)))) {
+        return 0;
+    }
+
+    vec3 cell = floor(pos / macrocellExtent);
+    if (texelFetch(macrocells, ivec3(cell), 0).r > 0.0) {
+        return 0;
+    }
+
+    // steps until the ray leaves the cell through the nearest of the exit planes
+    vec3 exitPlane = (cell + step(0.0, delta)) * macrocellExtent;
+    float steps = 1.0e20;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (abs(delta[axis]) > 1.0e-12) {
+            steps = min(steps, (exitPlane[axis] - pos[axis]) / delta[axis]);
+        }
+    }
+
+    // samples strictly before the exit lie inside the cell, rounding down keeps the sample on the exit plane
+    return max(1, int(floor(steps)));
+}
 
 void main()
 {
 
-    vec3 exitPos = texture(exitPositions, gl_FragCoord.st/screenDimensions).xyz;
+    vec3 rayEntryPos = entryPos;
+    vec3 exitPos;
+
+    if (singlePass) {
+        // unproject the fragment at the near and far clip planes, which gives the ray in volume coordinates
+        // for perspective and orthographic projections, then clip it to the unit cube of the volume (slab test).
+        // entry and exit keep full float precision instead of the 8 bits of the exit position texture.
+        vec2 ndc = gl_FragCoord.xy / screenDimensions * 2.0 - 1.0;
+        vec4 nearPos = invModelViewProjMat * vec4(ndc, -1.0, 1.0);
+        vec4 farPos = invModelViewProjMat * vec4(ndc, 1.0, 1.0);
+        vec3 rayOrigin = nearPos.xyz / nearPos.w;
+        vec3 rayDir = farPos.xyz / farPos.w - rayOrigin;
+
+        vec3 invDir = 1.0 / rayDir;
+        vec3 t0 = -rayOrigin * invDir;
+        vec3 t1 = (vec3(1.0) - rayOrigin) * invDir;
+        vec3 tMin = min(t0, t1);
+        vec3 tMax = max(t0, t1);
+        float tEntry = max(max(max(tMin.x, tMin.y), tMin.z), 0.0); // rays start at the near plane inside the volume
+        float tExit = min(min(tMax.x, tMax.y), tMax.z);
+
+        if (tExit <= tEntry) {
+            discard;
+        }
 
-    if (entryPos == exitPos) {
+        rayEntryPos = rayOrigin + tEntry * rayDir;
+        exitPos = rayOrigin + tExit * rayDir;
+    }
+    else {
+        exitPos = texture(exitPositions, gl_FragCoord.st/screenDimensions).xyz;
+    }
+
+    if (rayEntryPos == exitPos) {
         discard;
     }
 
-    vec3  ray = exitPos - entryPos;
+    vec3  ray = exitPos - rayEntryPos;
     float sampleStepSize = length(ray)/numSamples;
     vec3  rayDelta = normalize(ray) * sampleStepSize;
-    vec3  currentVoxelPos = entryPos;
+    vec3  currentVoxelPos = rayEntryPos;
 
     // Shading
     vec3  view = vec3(0, 0, 10); // view vector pointing to camera
@@ -56,20 +197,44 @@ void main()
     vec3 lightSpec = vec3(0.6);
 
     float intensity = 0.0;
+#if USES_METHOD(4)
     float minIntensity = 1.0;
+#endif
+#if USES_METHOD(1) || USES_METHOD(2)
     float maxIntensity = 0.0;
+#endif
+#if USES_METHOD(3)
     float intensityAccum = 0.0;
     float intensityCount = 0.0;
+#endif
     vec4  mappedColor; // color mapped to intensity by transferFunction
+#if USES_METHOD(0) || USES_METHOD(1)
     vec4  colorAccum = vec4(0.0); // accumulated color from volume traversal
+#endif
 
     vec4 backgroundColor = vec4(1.0, 1.0, 1.0, 0.0);
 
     for (int i = 0; i < numSamples; ++i) {
 
+        // jump over samples in empty macrocells, they are all intensity 0 after clamping
+        if (enableSkipping) {
+            int skip = min(emptyCellSteps(currentVoxelPos, rayDelta), numSamples - i);
+            if (skip > 0) {
+#if USES_METHOD(4)
+                // intensity 0 is the minimum for skipped samples inside the sample range
+                if (compositingMethod == 4 && i + skip - 1 >= sampleRangeStart * numSamples && i <= sampleRangeEnd * numSamples) {
+                    minIntensity = 0.0;
+                }
+#endif
+                i += skip - 1;
+                currentVoxelPos += rayDelta * skip;
+                continue;
+            }
+        }
+
         if (i >= sampleRangeStart * numSamples && i <= sampleRangeEnd * numSamples) {
 
-            intensity = texture(volume, currentVoxelPos).r;
+            intensity = sampleVolume(currentVoxelPos);
 
             if (intensity < intensityClampMin || intensity > intensityClampMax) {
                 intensity = 0;
@@ -77,11 +242,14 @@ void main()
             }
 
 
-            if (firstHitPos == vec3(0) && intensity > shadingThreshold) {
+#if SHADING != 0
+            if (enableShading && firstHitPos == vec3(0) && intensity > shadingThreshold) {
                 firstHitPos = currentVoxelPos;
             }
+#endif
 
 
+#if USES_METHOD(0)
             if (compositingMethod == 0) { // ALPHA COMPOSITING
 
                 mappedColor = texture(transferFunction, intensity * ttfSampleFactor + ttfSampleOffset);
@@ -99,7 +267,9 @@ void main()
                     break; // terminate if accumulated opacity > 1
                 }
             }
+#endif
 
+#if USES_METHOD(1)
             if (compositingMethod == 1) { // MAXIMUM INTENSITY DIFFERENCE ACCUMULATION
 
                 // the traditional alpha compositing method here is referred to under broad term of DVR as in literature
@@ -164,35 +334,45 @@ void main()
                     break; // terminate if accumulated opacity > 1
                 }
             }
+#endif
 
-            else if (compositingMethod == 2) { // MAXIMUM INTENSITY PROJECTION
+#if USES_METHOD(2)
+            if (compositingMethod == 2) { // MAXIMUM INTENSITY PROJECTION
                 if (intensity > maxIntensity) {
                     maxIntensity = intensity;
                 }
             }
+#endif
 
-            else if (compositingMethod == 3) { // AVERAGE INTENSITY PROJECTION
+#if USES_METHOD(3)
+            if (compositingMethod == 3) { // AVERAGE INTENSITY PROJECTION
                 intensityAccum += intensity;
                 if (intensity > 0.0) {
                     intensityCount += 1;
                 }
             }
+#endif
 
-            else if (compositingMethod == 4) { // MINIMUM INTENSITY PROJECTION
+#if USES_METHOD(4)
+            if (compositingMethod == 4) { // MINIMUM INTENSITY PROJECTION
                 if (intensity < minIntensity) {
                     minIntensity = intensity;
                 }
             }
+#endif
 
         }
 
         currentVoxelPos += rayDelta;
     }
 
+#if USES_METHOD(0)
     if (compositingMethod == 0) { // ALPHA COMPOSITING
         outColor = colorAccum;
     }
-    else if (compositingMethod == 1) { // MIDA COMPOSITING
+#endif
+#if USES_METHOD(1)
+    if (compositingMethod == 1) { // MIDA COMPOSITING
 
         // interpolate resulting colors between MIDA and max value (MIP)
         if (midaParam > 0) {
@@ -203,28 +383,42 @@ void main()
             outColor = colorAccum;
         }
     }
-    else if (compositingMethod == 2) { // MAXIMUM INTENSITY PROJECTION
+#endif
+#if USES_METHOD(2)
+    if (compositingMethod == 2) { // MAXIMUM INTENSITY PROJECTION
         outColor = texture(transferFunction, maxIntensity * ttfSampleFactor + ttfSampleOffset);
     }
-    else if (compositingMethod == 3) { // AVERAGE INTENSITY PROJECTION
+#endif
+#if USES_METHOD(3)
+    if (compositingMethod == 3) { // AVERAGE INTENSITY PROJECTION
         intensityCount = intensityCount > 0.0 ? intensityCount : numSamples;
         float avgIntensity = intensityAccum / intensityCount;
         avgIntensity = min(avgIntensity, 1.0);
         outColor = texture(transferFunction, avgIntensity * ttfSampleFactor + ttfSampleOffset);
     }
-    else if (compositingMethod == 4) { // MINIMUM INTENSITY PROJECTION
+#endif
+#if USES_METHOD(4)
+    if (compositingMethod == 4) { // MINIMUM INTENSITY PROJECTION
         outColor = texture(transferFunction, minIntensity * ttfSampleFactor + ttfSampleOffset);
     }
+#endif
 
 
     // SHADING VIA BLINN PHONG ILLUMINATION MODEL
+#if SHADING != 0
     if (enableShading) {
 
         // approx. surface gradient at current voxel pos
         vec3 gradient;
-        gradient.x = texture(volume, vec3(firstHitPos.x+sampleStepSize, firstHitPos.yz)).r - texture(volume, vec3(firstHitPos.x-sampleStepSize, firstHitPos.yz)).r;
-        gradient.y = texture(volume, vec3(firstHitPos.x, firstHitPos.y+sampleStepSize, firstHitPos.z)).r - texture(volume, vec3(firstHitPos.x, firstHitPos.y-sampleStepSize, firstHitPos.z)).r;
-        gradient.z = texture(volume, vec3(firstHitPos.xy, firstHitPos.z+sampleStepSize)).r - texture(volume, vec3(firstHitPos.xy, firstHitPos.z-sampleStepSize)).r;
+        if (precomputedGradients && sampleGradient(firstHitPos, gradient)) {
+            // scaled to the difference over two voxels, comparable to the differences of samples below
+            gradient *= 2.0;
+        }
+        else {
+            gradient.x = sampleVolume(vec3(firstHitPos.x+sampleStepSize, firstHitPos.yz)) - sampleVolume(vec3(firstHitPos.x-sampleStepSize, firstHitPos.yz));
+            gradient.y = sampleVolume(vec3(firstHitPos.x, firstHitPos.y+sampleStepSize, firstHitPos.z)) - sampleVolume(vec3(firstHitPos.x, firstHitPos.y-sampleStepSize, firstHitPos.z));
+            gradient.z = sampleVolume(vec3(firstHitPos.xy, firstHitPos.z+sampleStepSize)) - sampleVolume(vec3(firstHitPos.xy, firstHitPos.z-sampleStepSize));
+        }
         float gradientMagnitude = length(gradient);
         vec3 normal = normalize(gradient);
 
@@ -244,6 +438,7 @@ void main()
         outColor = vec4(shadingWeight * shadedColor + (1 - shadingWeight) * unshadedColor, outColor.a);
 
     }
+#endif
 
     // DEBUG DRAW FRONT FACES (RAY ENTRY POSITIONS) / BACK FACES (RAY EXIT POSITIONS
     //outColor = vec4(entryPos, 1.0);
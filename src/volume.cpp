@@ -1,6 +1,27 @@
 #include "volume.h"
+#include "parallel.h"
+#include "morton.h"
+#include "brickcache.h"
+#include "macrocells.h"
+#include "brickcodec.h"
+#include "pvmfile.h"
 
 #include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <climits>
+#include <atomic>
+
+#include <QElapsedTimer>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define VOLUME_HAVE_SSE2_KERNELS
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VOLUME_HAVE_AVX2_KERNELS
+#include <immintrin.h>
+#endif
 
 
 //-------------------------------------------------------------------------------------------------
@@ -119,27 +140,139 @@ const Voxel Voxel::operator/(const float &value) const
 };
 
 
+//-------------------------------------------------------------------------------------------------
+// Voxel Conversion Kernels
+//-------------------------------------------------------------------------------------------------
+
+// convert native voxels to floats: dst[i] = min(1, src[i] * scale)
+// SSE2 is the x86-64 baseline, the AVX2 variants are selected at runtime if the cpu supports them.
+
+template<typename T>
+static void normalizeVoxelsScalar(const T *src, float *dst, size_t count, float scale)
+{
+	for (size_t i = 0; i < count; ++i)
+		dst[i] = std::min(1.0f, src[i] * scale);
+}
+
+#ifdef VOLUME_HAVE_SSE2_KERNELS
+
+static void normalizeVoxelsSSE2(const unsigned char *src, float *dst, size_t count, float scale)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 vScale = _mm_set1_ps(scale);
+	const __m128 vOne = _mm_set1_ps(1.0f);
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i lo = _mm_unpacklo_epi8(bytes, zero);
+		__m128i hi = _mm_unpackhi_epi8(bytes, zero);
+		__m128i v[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+		for (int k = 0; k < 4; ++k)
+			_mm_storeu_ps(dst + i + 4*k, _mm_min_ps(vOne, _mm_mul_ps(_mm_cvtepi32_ps(v[k]), vScale)));
+	}
+	normalizeVoxelsScalar(src + i, dst + i, count - i, scale);
+}
+
+static void normalizeVoxelsSSE2(const unsigned short *src, float *dst, size_t count, float scale)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 vScale = _mm_set1_ps(scale);
+	const __m128 vOne = _mm_set1_ps(1.0f);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i shorts = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i lo = _mm_unpacklo_epi16(shorts, zero);
+		__m128i hi = _mm_unpackhi_epi16(shorts, zero);
+		_mm_storeu_ps(dst + i,     _mm_min_ps(vOne, _mm_mul_ps(_mm_cvtepi32_ps(lo), vScale)));
+		_mm_storeu_ps(dst + i + 4, _mm_min_ps(vOne, _mm_mul_ps(_mm_cvtepi32_ps(hi), vScale)));
+	}
+	normalizeVoxelsScalar(src + i, dst + i, count - i, scale);
+}
+
+#endif
+
+#ifdef VOLUME_HAVE_AVX2_KERNELS
+
+__attribute__((target("avx2")))
+static void normalizeVoxelsAVX2(const unsigned char *src, float *dst, size_t count, float scale)
+{
+	const __m256 vScale = _mm256_set1_ps(scale);
+	const __m256 vOne = _mm256_set1_ps(1.0f);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+		_mm256_storeu_ps(dst + i, _mm256_min_ps(vOne, _mm256_mul_ps(_mm256_cvtepi32_ps(v), vScale)));
+	}
+	normalizeVoxelsScalar(src + i, dst + i, count - i, scale);
+}
+
+__attribute__((target("avx2")))
+static void normalizeVoxelsAVX2(const unsigned short *src, float *dst, size_t count, float scale)
+{
+	const __m256 vScale = _mm256_set1_ps(scale);
+	const __m256 vOne = _mm256_set1_ps(1.0f);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+		_mm256_storeu_ps(dst + i, _mm256_min_ps(vOne, _mm256_mul_ps(_mm256_cvtepi32_ps(v), vScale)));
+	}
+	normalizeVoxelsScalar(src + i, dst + i, count - i, scale);
+}
+
+#endif
+
+template<typename T>
+static void normalizeVoxels(const T *src, float *dst, size_t count, float scale)
+{
+#ifdef VOLUME_HAVE_AVX2_KERNELS
+	static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+	if (hasAVX2) {
+		normalizeVoxelsAVX2(src, dst, count, scale);
+		return;
+	}
+#endif
+#ifdef VOLUME_HAVE_SSE2_KERNELS
+	normalizeVoxelsSSE2(src, dst, count, scale);
+#else
+	normalizeVoxelsScalar(src, dst, count, scale);
+#endif
+}
+
+
 //-------------------------------------------------------------------------------------------------
 // Volume
 //-------------------------------------------------------------------------------------------------
 
 Volume::Volume()
-	: voxels(1), width(1), height(1), depth(1), size(0)
+	: mappedData(nullptr), rawVoxels(nullptr), width(1), height(1), depth(1), bitsPerVoxel(8), bytesPerVoxel(1), normalization(1.0f / 256), size(0)
+	, layout(LINEAR), brickSize(32), brickGhost(1), numBricksX(1), numBricksY(1), numBricksZ(1)
+	, numMortonTilesX(1), numMortonTilesY(1), pagedHeaderBytes(0)
 {
 }
 
 Volume::~Volume()
 {
+	// stop brick readahead before the paged file is closed
+	brickCache.reset();
+
+	if (mappedData) {
+		mappedFile.unmap(mappedData);
+		mappedFile.close();
+	}
 }
 
-const Voxel& Volume::getVoxel(const int x, const int y, const int z) const
+const Voxel Volume::getVoxel(const int x, const int y, const int z) const
 {
-	return voxels[x + y*width + z*width*height];
+	return Voxel(normalizedValueAt(size_t(x) + size_t(y)*width + size_t(z)*width*height));
 }
 
-const Voxel& Volume::getVoxel(const int i) const
+const Voxel Volume::getVoxel(const size_t i) const
 {
-	return voxels[i];
+	return Voxel(normalizedValueAt(i));
 }
 
 float Volume::valueAt(const int x, const int y, const int z) const
@@ -147,13 +280,71 @@ float Volume::valueAt(const int x, const int y, const int z) const
 	if (x < 0 || x >= width || y < 0 || y >= height || z < 0 || z >= depth)
 		return 0;
 
-	return voxels[x + y*width + z*width*height].getValue();
+	if (layout == BRICKED) {
+		const VolumeBrick &brick = *bricks[brickIndexAt(x, y, z)];
+		return brick.valueAt(x - brick.originX, y - brick.originY, z - brick.originZ);
+	}
+
+	if (layout == PAGED || layout == COMPRESSED) {
+		std::shared_ptr<const VolumeBrick> brick = brickCache->getBrick(brickIndexAt(x, y, z));
+		return brick ? brick->valueAt(x - brick->originX, y - brick->originY, z - brick->originZ) : 0.0f;
+	}
+
+	if (layout == MORTON)
+		return normalizedValue(&voxelData.front(), mortonIndex(x, y, z));
+
+	return normalizedValue(rawVoxels, size_t(x) + size_t(y)*width + size_t(z)*width*height);
 }
 
-const Voxel* Volume::getVoxels() const
+float Volume::normalizedValueAt(const size_t i) const
 {
-	return &(voxels.front());
-};
+	if (layout != LINEAR) {
+		const size_t slice = size_t(width) * height;
+		return valueAt(int(i % width), int((i % slice) / width), int(i / slice));
+	}
+
+	return normalizedValue(rawVoxels, i);
+}
+
+float Volume::normalizedValue(const uchar *voxels, const size_t i) const
+{
+	// intensities are converted to float, mapping range [0, 2^bitsPerVoxel] to [0.0, 1.0]
+	float value;
+	if (bytesPerVoxel == 1)
+		value = float(voxels[i]);
+	else
+		value = float(reinterpret_cast<const unsigned short*>(voxels)[i]);
+
+	return fmin(1.0f, value * normalization);
+}
+
+void Volume::getNormalizedValues(float *dst, const size_t first, const size_t count) const
+{
+	// each thread converts a contiguous range, chunks are kept large enough to amortize thread startup
+	const size_t minChunkSize = 1 << 16;
+
+	parallelFor(0, count, [&](size_t begin, size_t end) {
+		if (!rawVoxels) {
+			// no linear storage to vectorize over, convert voxel by voxel
+			for (size_t i = begin; i < end; ++i)
+				dst[i] = normalizedValueAt(first + i);
+		}
+		else if (bytesPerVoxel == 1)
+			normalizeVoxels(rawVoxels + first + begin, dst + begin, end - begin, normalization);
+		else
+			normalizeVoxels(reinterpret_cast<const unsigned short*>(rawVoxels) + first + begin, dst + begin, end - begin, normalization);
+	}, minChunkSize);
+}
+
+const void* Volume::getRawVoxels() const
+{
+	return rawVoxels;
+}
+
+bool Volume::isMapped() const
+{
+	return mappedData != nullptr;
+}
 
 const int Volume::getWidth() const
 {
@@ -175,18 +366,732 @@ const int Volume::getBitsPerVoxel() const
 	return bitsPerVoxel;
 };
 
-const int Volume::getSize() const
+const int Volume::getBytesPerVoxel() const
+{
+	return bytesPerVoxel;
+};
+
+const size_t Volume::getSize() const
 {
 	return size;
 };
 
 
 
+//-------------------------------------------------------------------------------------------------
+// Volume Bricks
+//-------------------------------------------------------------------------------------------------
+
+VolumeBrick::VolumeBrick()
+	: originX(0), originY(0), originZ(0), sizeX(0), sizeY(0), sizeZ(0), ghost(0)
+	, strideY(0), strideZ(0), bytesPerVoxel(1), normalization(1.0f / 256)
+{
+}
+
+Volume::Layout Volume::getLayout() const
+{
+	return layout;
+}
+
+bool Volume::setBrickSize(const int brickSize, const int ghost)
+{
+	if (layout != LINEAR || brickSize <= 0 || ghost < 0)
+		return false;
+
+	// brick indices are int
+	const size_t numBricks = size_t((width + brickSize - 1) / brickSize) * size_t((height + brickSize - 1) / brickSize) * size_t((depth + brickSize - 1) / brickSize);
+	if (numBricks > size_t(INT_MAX)) {
+		std::cerr << "Error setting brick size. Too many bricks: " << numBricks << std::endl;
+		return false;
+	}
+
+	this->brickSize = brickSize;
+	this->brickGhost = ghost;
+	updateBrickGrid();
+
+	return true;
+}
+
+void Volume::updateBrickGrid()
+{
+	numBricksX = (width + brickSize - 1) / brickSize;
+	numBricksY = (height + brickSize - 1) / brickSize;
+	numBricksZ = (depth + brickSize - 1) / brickSize;
+}
+
+const int Volume::getBrickSize() const
+{
+	return brickSize;
+}
+
+const int Volume::getBrickGhost() const
+{
+	return brickGhost;
+}
+
+const int Volume::getNumBricksX() const
+{
+	return numBricksX;
+}
+
+const int Volume::getNumBricksY() const
+{
+	return numBricksY;
+}
+
+const int Volume::getNumBricksZ() const
+{
+	return numBricksZ;
+}
+
+const int Volume::getNumBricks() const
+{
+	return numBricksX * numBricksY * numBricksZ;
+}
+
+int Volume::brickIndexAt(const int x, const int y, const int z) const
+{
+	return x / brickSize + (y / brickSize) * numBricksX + (z / brickSize) * numBricksX * numBricksY;
+}
+
+std::shared_ptr<const VolumeBrick> Volume::getBrick(const int bx, const int by, const int bz) const
+{
+	return getBrick(bx + by * numBricksX + bz * numBricksX * numBricksY);
+}
+
+std::shared_ptr<const VolumeBrick> Volume::getBrick(const int i) const
+{
+	if (layout == BRICKED)
+		return bricks[i];
+
+	if (layout == PAGED || layout == COMPRESSED)
+		return brickCache->getBrick(i);
+
+	// copy the brick out of the linear storage
+	std::shared_ptr<VolumeBrick> brick = std::make_shared<VolumeBrick>();
+	extractBrick(i, *brick);
+	return brick;
+}
+
+void Volume::extractBrick(const int i, VolumeBrick &brick) const
+{
+	extractBrick(i, brick, rawVoxels, 0, depth);
+}
+
+void Volume::extractBrick(const int i, VolumeBrick &brick, const uchar *slab, const int slabBegin, const int slabEnd) const
+{
+	// slab holds the linear voxels of slices [slabBegin, slabEnd), slices outside of it are not copied
+	initBrick(i, brick);
+
+	// copy rows clipped to the volume, including the ghost border inside the volume
+	const int x0 = std::max(0, brick.originX - brickGhost);
+	const int x1 = std::min(width, brick.originX + brick.sizeX + brickGhost);
+	const size_t rowBytes = size_t(x1 - x0) * bytesPerVoxel;
+
+	if (layout == MORTON) {
+		for (int z = std::max(-brickGhost, -brick.originZ); z < std::min(brick.sizeZ + brickGhost, depth - brick.originZ); ++z)
+			for (int y = std::max(-brickGhost, -brick.originY); y < std::min(brick.sizeY + brickGhost, height - brick.originY); ++y)
+				for (int x = x0; x < x1; ++x) {
+					const size_t src = mortonIndex(x, brick.originY + y, brick.originZ + z) * bytesPerVoxel;
+					const size_t dst = brick.localIndex(x - brick.originX, y, z) * bytesPerVoxel;
+					memcpy(&brick.voxels[dst], &voxelData[src], bytesPerVoxel);
+				}
+		return;
+	}
+
+	for (int z = -brickGhost; z < brick.sizeZ + brickGhost; ++z) {
+		const int vz = brick.originZ + z;
+		if (vz < slabBegin || vz >= slabEnd)
+			continue;
+
+		for (int y = -brickGhost; y < brick.sizeY + brickGhost; ++y) {
+			const int vy = brick.originY + y;
+			if (vy < 0 || vy >= height)
+				continue;
+
+			const size_t src = (size_t(x0) + size_t(vy) * width + size_t(vz - slabBegin) * width * height) * bytesPerVoxel;
+			const size_t dst = brick.localIndex(x0 - brick.originX, y, z) * bytesPerVoxel;
+			memcpy(&brick.voxels[dst], slab + src, rowBytes);
+		}
+	}
+}
+
+void Volume::initBrick(const int i, VolumeBrick &brick) const
+{
+	const int bx = i % numBricksX;
+	const int by = (i / numBricksX) % numBricksY;
+	const int bz = i / (numBricksX * numBricksY);
+
+	brick.originX = bx * brickSize;
+	brick.originY = by * brickSize;
+	brick.originZ = bz * brickSize;
+	brick.sizeX = std::min(brickSize, width - brick.originX);
+	brick.sizeY = std::min(brickSize, height - brick.originY);
+	brick.sizeZ = std::min(brickSize, depth - brick.originZ);
+	brick.ghost = brickGhost;
+	brick.bytesPerVoxel = bytesPerVoxel;
+	brick.normalization = normalization;
+
+	const int dimX = brick.sizeX + 2*brickGhost;
+	const int dimY = brick.sizeY + 2*brickGhost;
+	const int dimZ = brick.sizeZ + 2*brickGhost;
+	brick.strideY = size_t(dimX);
+	brick.strideZ = size_t(dimX) * dimY;
+
+	// ghost voxels outside of the volume stay zero
+	brick.voxels.assign(brick.strideZ * dimZ * bytesPerVoxel, 0);
+}
+
+bool Volume::convertToBricks(const int brickSize, const int ghost, ProgressCallback progress)
+{
+	if (layout != LINEAR || !rawVoxels || brickSize <= 0 || ghost < 0)
+		return false;
+
+	if (!setBrickSize(brickSize, ghost))
+		return false;
+
+	std::vector<std::shared_ptr<VolumeBrick> > newBricks(getNumBricks());
+
+	// extract one z-layer of bricks at a time in parallel, reporting progress in between
+	const int bricksPerLayer = numBricksX * numBricksY;
+	for (int bz = 0; bz < numBricksZ; ++bz) {
+		parallelFor(0, bricksPerLayer, [&](size_t begin, size_t end) {
+			for (size_t b = begin; b < end; ++b) {
+				const int i = int(b) + bz * bricksPerLayer;
+				newBricks[i] = std::make_shared<VolumeBrick>();
+				extractBrick(i, *newBricks[i]);
+			}
+		});
+
+		if (!reportProgress(progress, float(bz + 1) / numBricksZ))
+			return false;
+	}
+
+	bricks.swap(newBricks);
+	layout = BRICKED;
+
+	// release the linear storage
+	rawVoxels = nullptr;
+	std::vector<unsigned char>().swap(voxelData);
+	if (mappedData) {
+		mappedFile.unmap(mappedData);
+		mappedFile.close();
+		mappedData = nullptr;
+	}
+
+	std::cout << "Converted VOLUME to " << numBricksX << " x " << numBricksY << " x " << numBricksZ
+	          << " bricks of " << brickSize << "^3 voxels with ghost border " << ghost << std::endl;
+
+	return true;
+}
+
+
+
+//-------------------------------------------------------------------------------------------------
+// Volume Compression
+//-------------------------------------------------------------------------------------------------
+
+bool Volume::convertToCompressed(const size_t cacheBudgetBytes, const int brickSize, const int ghost, ProgressCallback progress)
+{
+	if ((layout != LINEAR && layout != BRICKED && layout != MORTON) || brickSize <= 0 || ghost < 0)
+		return false;
+
+	if (layout == LINEAR && (!rawVoxels || !setBrickSize(brickSize, ghost)))
+		return false;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	// bricks are compressed with their ghost border, so that a cache miss decompresses a single brick
+	std::vector<std::vector<unsigned char> > newCompressedBricks(getNumBricks());
+	size_t compressedBytes = 0;
+	std::mutex compressedBytesMutex;
+
+	const int bricksPerLayer = numBricksX * numBricksY;
+	for (int bz = 0; bz < numBricksZ; ++bz) {
+		parallelFor(0, bricksPerLayer, [&](size_t begin, size_t end) {
+			size_t bytes = 0;
+			for (size_t b = begin; b < end; ++b) {
+				const int i = int(b) + bz * bricksPerLayer;
+				std::shared_ptr<const VolumeBrick> brick = getBrick(i);
+				std::vector<unsigned char> &compressed = newCompressedBricks[i];
+				compressVoxels(brick->getRawVoxels(), bytesPerVoxel, int(brick->strideY), int(brick->strideZ / brick->strideY),
+				               brick->sizeZ + 2 * brick->ghost, compressed);
+				compressed.shrink_to_fit();
+				bytes += compressed.size();
+			}
+			std::lock_guard<std::mutex> lock(compressedBytesMutex);
+			compressedBytes += bytes;
+		});
+
+		if (!reportProgress(progress, float(bz + 1) / numBricksZ))
+			return false;
+	}
+
+	compressedBricks.swap(newCompressedBricks);
+	brickCache.reset(new BrickCache([this](int i) { return decompressBrick(i); }, getNumBricks(), cacheBudgetBytes));
+	layout = COMPRESSED;
+
+	// release the previous storage
+	rawVoxels = nullptr;
+	std::vector<unsigned char>().swap(voxelData);
+	std::vector<std::shared_ptr<VolumeBrick> >().swap(bricks);
+	if (mappedData) {
+		mappedFile.unmap(mappedData);
+		mappedFile.close();
+		mappedData = nullptr;
+	}
+
+	std::cout << "Compressed VOLUME into " << numBricksX << " x " << numBricksY << " x " << numBricksZ << " bricks, "
+	          << size * bytesPerVoxel / (1024 * 1024) << " MB to " << compressedBytes / (1024 * 1024) << " MB ("
+	          << double(size * bytesPerVoxel) / std::max(size_t(1), compressedBytes) << "x) in " << timer.elapsed() << " ms" << std::endl;
+
+	return true;
+}
+
+const size_t Volume::getCompressedBytes() const
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < compressedBricks.size(); ++i)
+		bytes += compressedBricks[i].size();
+	return bytes;
+}
+
+std::shared_ptr<VolumeBrick> Volume::decompressBrick(const int i) const
+{
+	std::shared_ptr<VolumeBrick> brick = std::make_shared<VolumeBrick>();
+	initBrick(i, *brick);
+
+	const std::vector<unsigned char> &compressed = compressedBricks[i];
+	if (!decompressVoxels(compressed.empty() ? nullptr : &compressed.front(), compressed.size(), &brick->voxels.front(), bytesPerVoxel,
+	                      int(brick->strideY), int(brick->strideZ / brick->strideY), brick->sizeZ + 2 * brick->ghost)) {
+		std::cerr << "Error decompressing brick " << i << std::endl;
+		return nullptr;
+	}
+
+	return brick;
+}
+
+
+
+//-------------------------------------------------------------------------------------------------
+// Volume Pyramid
+//-------------------------------------------------------------------------------------------------
+
+// reduce the voxels of one source brick into the next coarser level.
+// each destination voxel is handled by the brick containing its first source voxel,
+// the second source voxel along each axis may lie in the ghost border.
+template<typename T>
+static void reduceBrick(const VolumeBrick &brick, const Volume::Reduction reduction,
+                        const int width, const int height, const int depth, T *dst, const int dstWidth, const int dstHeight)
+{
+	const T *src = brick.getVoxelSpan<T>().data;
+
+	const int originX = brick.getOriginX(), originY = brick.getOriginY(), originZ = brick.getOriginZ();
+	const int endX = originX + brick.getSizeX(), endY = originY + brick.getSizeY(), endZ = originZ + brick.getSizeZ();
+
+	for (int z = (originZ + 1) / 2; z < (endZ + 1) / 2; ++z) {
+		for (int y = (originY + 1) / 2; y < (endY + 1) / 2; ++y) {
+			for (int x = (originX + 1) / 2; x < (endX + 1) / 2; ++x) {
+
+				// source voxels outside of odd sized volumes are left out
+				unsigned int sum = 0, count = 0;
+				T maximum = 0;
+				for (int sz = 2*z; sz < std::min(2*z + 2, depth); ++sz) {
+					for (int sy = 2*y; sy < std::min(2*y + 2, height); ++sy) {
+						for (int sx = 2*x; sx < std::min(2*x + 2, width); ++sx) {
+							const T value = src[brick.localIndex(sx - originX, sy - originY, sz - originZ)];
+							sum += value;
+							maximum = std::max(maximum, value);
+							++count;
+						}
+					}
+				}
+
+				const size_t i = size_t(x) + size_t(y) * dstWidth + size_t(z) * dstWidth * dstHeight;
+				dst[i] = (reduction == Volume::REDUCE_AVERAGE) ? T((sum + count / 2) / count) : maximum;
+			}
+		}
+	}
+}
+
+bool Volume::buildPyramid(const Reduction reduction, const int minSize, ProgressCallback progress)
+{
+	pyramid.clear();
+
+	// levels until the coarsest one fits into minSize^3
+	int numLevels = 0;
+	for (int w = width, h = height, d = depth; std::max(w, std::max(h, d)) > std::max(1, minSize); ++numLevels) {
+		w = (w + 1) / 2; h = (h + 1) / 2; d = (d + 1) / 2;
+	}
+
+	const Volume *source = this;
+	for (int level = 1; level <= numLevels; ++level) {
+
+		// bricks need a ghost border or an even size so the 2x2x2 blocks are complete
+		if (source->brickGhost < 1 && source->brickSize % 2 != 0) {
+			std::cerr << "Error building pyramid. Bricks need an even size or a ghost border" << std::endl;
+			pyramid.clear();
+			return false;
+		}
+
+		const int dstWidth = (source->width + 1) / 2;
+		const int dstHeight = (source->height + 1) / 2;
+		const int dstDepth = (source->depth + 1) / 2;
+		std::vector<unsigned char> voxels(size_t(dstWidth) * dstHeight * dstDepth * bytesPerVoxel);
+
+		std::atomic<bool> failed(false);
+		parallelFor(0, size_t(source->getNumBricks()), [&](size_t begin, size_t end) {
+			for (size_t b = begin; b < end; ++b) {
+				std::shared_ptr<const VolumeBrick> brick = source->getBrick(int(b));
+				if (!brick) {
+					failed = true;
+					continue;
+				}
+				if (bytesPerVoxel == 1)
+					reduceBrick(*brick, reduction, source->width, source->height, source->depth, &voxels.front(), dstWidth, dstHeight);
+				else
+					reduceBrick(*brick, reduction, source->width, source->height, source->depth, reinterpret_cast<unsigned short*>(&voxels.front()), dstWidth, dstHeight);
+			}
+		});
+
+		// a level with holes would be rendered while interacting, so a missing brick fails the pyramid
+		if (failed) {
+			std::cerr << "Error building pyramid. Could not read all volume bricks" << std::endl;
+			pyramid.clear();
+			return false;
+		}
+
+		std::unique_ptr<Volume> coarse(new Volume());
+		coarse->createFromVoxels(dstWidth, dstHeight, dstDepth, bitsPerVoxel, voxels);
+		pyramid.push_back(std::move(coarse));
+		source = pyramid.back().get();
+
+		if (!reportProgress(progress, float(level) / numLevels)) {
+			pyramid.clear();
+			return false;
+		}
+	}
+
+	std::cout << "Built VOLUME pyramid with " << numLevels << " coarser levels by "
+	          << ((reduction == REDUCE_AVERAGE) ? "averaging" : "maximum") << std::endl;
+
+	return true;
+}
+
+const int Volume::getNumLevels() const
+{
+	return 1 + int(pyramid.size());
+}
+
+const Volume* Volume::getLevel(const int level) const
+{
+	if (level <= 0)
+		return this;
+
+	return pyramid[std::min(level, int(pyramid.size())) - 1].get();
+}
+
+
+bool Volume::buildMacrocells(const int cellSize)
+{
+	for (int level = 0; level < getNumLevels(); ++level) {
+		Volume *volume = (level == 0) ? this : pyramid[level - 1].get();
+
+		std::unique_ptr<MacrocellGrid> grid(new MacrocellGrid());
+		if (!grid->build(*volume, cellSize)) {
+			std::cerr << "Error building macrocells. Invalid cell size " << cellSize << std::endl;
+			return false;
+		}
+		volume->macrocells = std::move(grid);
+	}
+
+	std::cout << "Built " << macrocells->getNumCellsX() << "x" << macrocells->getNumCellsY() << "x" << macrocells->getNumCellsZ()
+	          << " macrocells of " << cellSize << "^3 voxels" << std::endl;
+
+	return true;
+}
+
+const MacrocellGrid* Volume::getMacrocells() const
+{
+	return macrocells.get();
+}
+
+
+
+//-------------------------------------------------------------------------------------------------
+// Volume Statistics
+//-------------------------------------------------------------------------------------------------
+
+// count voxel values into four interleaved sub-histograms of numBins bins each, consecutive voxels go to
+// different sub-histograms so that runs of equal values (e.g. air) do not serialize on a single counter
+template<typename T>
+static void countVoxels(const T *src, const size_t count, uint32_t *histograms, const size_t numBins)
+{
+	const unsigned int lastBin = unsigned(numBins - 1);
+	uint32_t *h0 = histograms, *h1 = h0 + numBins, *h2 = h1 + numBins, *h3 = h2 + numBins;
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		++h0[std::min(unsigned(src[i    ]), lastBin)];
+		++h1[std::min(unsigned(src[i + 1]), lastBin)];
+		++h2[std::min(unsigned(src[i + 2]), lastBin)];
+		++h3[std::min(unsigned(src[i + 3]), lastBin)];
+	}
+	for (; i < count; ++i)
+		++h0[std::min(unsigned(src[i]), lastBin)];
+}
+
+// per-thread histograms of 32 bit counters, flushed into the 64 bit total before they can overflow
+class HistogramCounter
+{
+
+public:
+
+	HistogramCounter(const size_t numBins, std::vector<uint64_t> &total, std::mutex &totalMutex)
+		: numBins(numBins), histograms(4 * numBins, 0), pending(0), total(total), totalMutex(totalMutex)
+	{
+	}
+
+	~HistogramCounter()
+	{
+		flush();
+	}
+
+	void count(const unsigned char *src, size_t count, const int bytesPerVoxel)
+	{
+		while (count > 0) {
+			const size_t n = std::min(count, MAX_PENDING - pending);
+			if (bytesPerVoxel == 1)
+				countVoxels(src, n, &histograms.front(), numBins);
+			else
+				countVoxels(reinterpret_cast<const unsigned short*>(src), n, &histograms.front(), numBins);
+
+			src += n * bytesPerVoxel;
+			count -= n;
+			pending += n;
+			if (pending == MAX_PENDING)
+				flush();
+		}
+	}
+
+	void flush()
+	{
+		std::lock_guard<std::mutex> lock(totalMutex);
+		for (size_t bin = 0; bin < numBins; ++bin) {
+			total[bin] += uint64_t(histograms[bin]) + histograms[bin + numBins] + histograms[bin + 2*numBins] + histograms[bin + 3*numBins];
+		}
+		std::fill(histograms.begin(), histograms.end(), 0);
+		pending = 0;
+	}
+
+private:
+
+	static const size_t MAX_PENDING = size_t(1) << 31;
+
+	size_t numBins;
+	std::vector<uint32_t> histograms;
+	size_t pending;
+
+	std::vector<uint64_t> &total;
+	std::mutex &totalMutex;
+
+};
+
+bool Volume::computeStatistics()
+{
+	if (size == 0) {
+		std::cerr << "Error computing statistics. Volume is empty" << std::endl;
+		return false;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	Statistics result;
+	result.histogram.assign(size_t(1) << bitsPerVoxel, 0);
+	std::mutex histogramMutex;
+
+	if (rawVoxels && layout == LINEAR) {
+		// contiguous voxels, one range per thread
+		parallelFor(0, size, [&](size_t begin, size_t end) {
+			HistogramCounter counter(result.histogram.size(), result.histogram, histogramMutex);
+			counter.count(rawVoxels + begin * bytesPerVoxel, end - begin, bytesPerVoxel);
+		}, 1 << 16);
+	}
+	else {
+		// brick interiors row by row, ghost borders are left out so every voxel counts once
+		std::atomic<bool> failed(false);
+		parallelFor(0, size_t(getNumBricks()), [&](size_t begin, size_t end) {
+			HistogramCounter counter(result.histogram.size(), result.histogram, histogramMutex);
+			for (size_t b = begin; b < end; ++b) {
+				std::shared_ptr<const VolumeBrick> brick = getBrick(int(b));
+				if (!brick) {
+					failed = true;
+					continue;
+				}
+				const unsigned char *voxels = static_cast<const unsigned char*>(brick->getRawVoxels());
+				for (int z = 0; z < brick->getSizeZ(); ++z) {
+					for (int y = 0; y < brick->getSizeY(); ++y)
+						counter.count(voxels + brick->localIndex(0, y, z) * bytesPerVoxel, size_t(brick->getSizeX()), bytesPerVoxel);
+				}
+			}
+		});
+
+		if (failed) {
+			std::cerr << "Error computing statistics. Could not read all volume bricks" << std::endl;
+			return false;
+		}
+	}
+
+	statistics = result;
+	statistics.summarize();
+
+	std::cout << "Computed VOLUME statistics in " << timer.elapsed() << " ms: values " << statistics.minValue << " - " << statistics.maxValue
+	          << ", mean " << statistics.mean << ", standard deviation " << statistics.standardDeviation << std::endl;
+
+	return true;
+}
+
+const Volume::Statistics& Volume::getStatistics() const
+{
+	return statistics;
+}
+
+float Volume::normalizeValue(const int value) const
+{
+	return std::min(1.0f, value * normalization);
+}
+
+void Volume::Statistics::summarize()
+{
+	count = 0;
+	minValue = -1;
+	maxValue = 0;
+	double sum = 0.0, sumSquares = 0.0;
+	for (size_t value = 0; value < histogram.size(); ++value) {
+		const uint64_t n = histogram[value];
+		if (n == 0)
+			continue;
+		if (minValue < 0)
+			minValue = int(value);
+		maxValue = int(value);
+		count += n;
+		sum += double(n) * value;
+		sumSquares += double(n) * value * value;
+	}
+	minValue = std::max(0, minValue);
+	mean = count ? sum / count : 0.0;
+	standardDeviation = count ? sqrt(std::max(0.0, sumSquares / count - mean * mean)) : 0.0;
+}
+
+int Volume::Statistics::percentile(const double fraction, const int firstValue) const
+{
+	const size_t first = size_t(std::max(0, firstValue));
+	if (first >= histogram.size())
+		return int(histogram.size()) - 1;
+
+	uint64_t total = 0;
+	for (size_t value = first; value < histogram.size(); ++value)
+		total += histogram[value];
+	if (total == 0)
+		return int(first);
+
+	// rank of the requested voxel among the counted ones, at least the first one
+	const uint64_t rank = std::max(uint64_t(1), uint64_t(ceil(std::min(1.0, std::max(0.0, fraction)) * total)));
+
+	uint64_t cumulative = 0;
+	for (size_t value = first; value < histogram.size(); ++value) {
+		cumulative += histogram[value];
+		if (cumulative >= rank)
+			return int(value);
+	}
+	return int(histogram.size()) - 1;
+}
+
+
+
+//-------------------------------------------------------------------------------------------------
+// Volume Morton Order
+//-------------------------------------------------------------------------------------------------
+
+size_t Volume::mortonIndex(const int x, const int y, const int z) const
+{
+	// tiles of 2^MORTON_TILE_BITS voxels per dimension in x-fastest order, Z-order inside each tile
+	const int tileMask = (1 << MORTON_TILE_BITS) - 1;
+	const size_t tile = size_t(x >> MORTON_TILE_BITS) + size_t(y >> MORTON_TILE_BITS) * numMortonTilesX
+	                  + size_t(z >> MORTON_TILE_BITS) * numMortonTilesX * numMortonTilesY;
+
+	return (tile << (3 * MORTON_TILE_BITS)) + size_t(morton::encode(x & tileMask, y & tileMask, z & tileMask));
+}
+
+bool Volume::convertToMorton(ProgressCallback progress)
+{
+	if (layout != LINEAR || !rawVoxels)
+		return false;
+
+	const int tileSize = 1 << MORTON_TILE_BITS;
+	const size_t tileVoxels = size_t(1) << (3 * MORTON_TILE_BITS);
+
+	numMortonTilesX = (width + tileSize - 1) / tileSize;
+	numMortonTilesY = (height + tileSize - 1) / tileSize;
+	const int numMortonTilesZ = (depth + tileSize - 1) / tileSize;
+	const size_t tilesPerLayer = size_t(numMortonTilesX) * numMortonTilesY;
+
+	// voxels of border tiles outside of the volume stay zero
+	std::vector<unsigned char> mortonData(tilesPerLayer * numMortonTilesZ * tileVoxels * bytesPerVoxel, 0);
+
+	// fill one z-layer of tiles at a time in parallel, walking each tile along the curve
+	for (int tz = 0; tz < numMortonTilesZ; ++tz) {
+		parallelFor(0, tilesPerLayer, [&](size_t begin, size_t end) {
+			for (size_t t = begin; t < end; ++t) {
+				const int originX = int(t % numMortonTilesX) * tileSize;
+				const int originY = int(t / numMortonTilesX) * tileSize;
+				const int originZ = tz * tileSize;
+				const size_t tileStart = (t + tz * tilesPerLayer) * tileVoxels;
+
+				for (size_t m = 0; m < tileVoxels; ++m) {
+					uint32_t lx, ly, lz;
+					morton::decode(m, lx, ly, lz);
+					const int x = originX + int(lx), y = originY + int(ly), z = originZ + int(lz);
+					if (x >= width || y >= height || z >= depth)
+						continue;
+
+					const size_t src = (size_t(x) + size_t(y) * width + size_t(z) * width * height) * bytesPerVoxel;
+					memcpy(&mortonData[(tileStart + m) * bytesPerVoxel], rawVoxels + src, bytesPerVoxel);
+				}
+			}
+		});
+
+		if (!reportProgress(progress, float(tz + 1) / numMortonTilesZ))
+			return false;
+	}
+
+	// release the linear storage
+	rawVoxels = nullptr;
+	voxelData.swap(mortonData);
+	std::vector<unsigned char>().swap(mortonData);
+	if (mappedData) {
+		mappedFile.unmap(mappedData);
+		mappedFile.close();
+		mappedData = nullptr;
+	}
+
+	layout = MORTON;
+
+	std::cout << "Converted VOLUME to Morton order in " << numMortonTilesX << " x " << numMortonTilesY << " x " << numMortonTilesZ
+	          << " tiles of " << tileSize << "^3 voxels" << std::endl;
+
+	return true;
+}
+
+
+
 //-------------------------------------------------------------------------------------------------
 // Volume File Loader
 //-------------------------------------------------------------------------------------------------
 
-bool Volume::loadFromFileDAT(QString filepath, QProgressBar* progressBar)
+bool Volume::loadFromFileDAT(QString filepath, ProgressCallback progress)
 {
 	// open file
 	FILE *fp = fopen(filepath.toStdString().c_str(), "rb");
@@ -195,77 +1100,406 @@ bool Volume::loadFromFileDAT(QString filepath, QProgressBar* progressBar)
 		return false;
 	}
 
-	progressBar->setRange(0, size + 10);
-	progressBar->setValue(0);
-
 	// READ HEADER AND SET VOLUME DIMENSIONS
 
-	// header format: 16 bit width, 16 bit height, 16 bit depth, 16 bit bitsPerVoxel
+	// header format: 16 bit width, 16 bit height, 16 bit depth, 16 bit bitsPerVoxel,
+	// optionally followed by 32 bit width, height, depth (see readHeaderDAT)
 	// then voxel data with bitsPerVoxel intensity resolution
 
-	unsigned short uWidth, uHeight, uDepth, uBitsPerVoxel;
-	fread(&uWidth, sizeof(unsigned short), 1, fp);
-	fread(&uHeight, sizeof(unsigned short), 1, fp);
-	fread(&uDepth, sizeof(unsigned short), 1, fp);
-	fread(&uBitsPerVoxel, sizeof(unsigned short), 1, fp);
-	
-	width = int(uWidth);
-	height = int(uHeight);
-	depth = int(uDepth);
-	bitsPerVoxel = int(uBitsPerVoxel);
-
-	// check dataset dimensions
-	if (
-	    width  <= 0 || width  > 1000 ||
-		height <= 0 || height > 1000 ||
-	    depth  <= 0 || depth  > 1000)
+	unsigned short header[4];
+	unsigned int extent[3] = { 0, 0, 0 };
+	if (fread(header, sizeof(unsigned short), 4, fp) != 4 ||
+	    (isExtendedHeaderDAT(header) && fread(extent, sizeof(unsigned int), 3, fp) != 3) ||
+	    !readHeaderDAT(header, extent, filepath))
 	{
-		std::cerr << "Error loading file. Invalid volume dimensions: " << filepath.toStdString() << std::endl;
+		fclose(fp);
 		return false;
 	}
 
-	// compute dimensions
-	int slice = width * height;
-	size = slice * depth;
-	voxels.resize(size);
+	// READ VOLUME DATA
+
+	// voxels are kept at their native bit depth, so they can be read straight into the volume.
+	// reading happens in chunks so progress is only reported (and cancellation checked) once per percent.
+	voxelData.resize(size * bytesPerVoxel);
+
+	const int progressSteps = 100;
+	size_t chunkSize = std::max(size_t(1), size / progressSteps);
+	size_t numRead = 0;
+	while (numRead < size) {
+		size_t numChunk = std::min(chunkSize, size - numRead);
+		size_t numChunkRead = fread((void*)&(voxelData[numRead * bytesPerVoxel]), bytesPerVoxel, numChunk, fp);
+		numRead += numChunkRead;
+		if (numChunkRead != numChunk)
+			break;
+
+		if (!reportProgress(progress, float(double(numRead) / size))) {
+			fclose(fp);
+			voxelData.clear();
+			std::cout << "Canceled loading " << filepath.toStdString() << std::endl;
+			return false;
+		}
+	}
+	fclose(fp);
+
+	if (numRead != size) {
+		std::cerr << "Error loading file. File is truncated: " << filepath.toStdString() << std::endl;
+		voxelData.clear();
+		return false;
+	}
+
+	rawVoxels = &(voxelData.front());
+
+	std::cout << "Loaded " << bitsPerVoxel << "-bit VOLUME with dimensions " << width << " x " << height << " x " << depth << std::endl;
+
+	return true;
+}
+
+bool Volume::loadFromFilePVM(QString filepath, ProgressCallback progress)
+{
+	if (layout != LINEAR || rawVoxels)
+		return false;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	int pvmWidth = 0, pvmHeight = 0, pvmDepth = 0, pvmBits = 0;
+	std::vector<unsigned char> voxels;
+	if (!readPVMFile(filepath, pvmWidth, pvmHeight, pvmDepth, pvmBits, voxels) ||
+	    !setDimensions(pvmWidth, pvmHeight, pvmDepth, pvmBits, filepath))
+		return false;
+
+	// decoding is not interruptible, cancellation takes effect once the voxels are in memory
+	if (!reportProgress(progress, 1.0f)) {
+		std::cout << "Canceled loading " << filepath.toStdString() << std::endl;
+		return false;
+	}
+
+	voxelData.swap(voxels);
+	rawVoxels = &(voxelData.front());
+
+	std::cout << "Loaded " << bitsPerVoxel << "-bit VOLUME with dimensions " << width << " x " << height << " x " << depth
+	          << " from PVM in " << timer.elapsed() << " ms" << std::endl;
+
+	return true;
+}
+
+bool Volume::mapFromFileDAT(QString filepath, ProgressCallback progress)
+{
+	mappedFile.setFileName(filepath);
+	if (!mappedFile.open(QIODevice::ReadOnly)) {
+		std::cerr << "Error opening file: " << filepath.toStdString() << std::endl;
+		return false;
+	}
+
+	// READ HEADER AND SET VOLUME DIMENSIONS
+
+	qint64 headerBytes = 4*sizeof(unsigned short);
+	const qint64 fileBytes = mappedFile.size();
+	uchar *mapping = (fileBytes > headerBytes) ? mappedFile.map(0, fileBytes) : nullptr;
+	if (!mapping) {
+		std::cerr << "Error mapping file: " << filepath.toStdString() << std::endl;
+		mappedFile.close();
+		return false;
+	}
+
+	unsigned short header[4];
+	unsigned int extent[3] = { 0, 0, 0 };
+	memcpy(header, mapping, headerBytes);
+	if (isExtendedHeaderDAT(header) && fileBytes > headerBytes + qint64(sizeof(extent))) {
+		memcpy(extent, mapping + headerBytes, sizeof(extent));
+		headerBytes += sizeof(extent);
+	}
+
+	if (!readHeaderDAT(header, extent, filepath)) {
+		mappedFile.unmap(mapping);
+		mappedFile.close();
+		return false;
+	}
+
+	if (fileBytes < headerBytes + qint64(size * bytesPerVoxel)) {
+		std::cerr << "Error loading file. File is truncated: " << filepath.toStdString() << std::endl;
+		mappedFile.unmap(mapping);
+		mappedFile.close();
+		return false;
+	}
+
+	// VOLUME DATA
+
+	// voxels are read directly from the mapping, pages are faulted in on first access
+	mappedData = mapping;
+	rawVoxels = mapping + headerBytes;
+
+	reportProgress(progress, 1.0f);
+
+	std::cout << "Mapped " << bitsPerVoxel << "-bit VOLUME with dimensions " << width << " x " << height << " x " << depth << std::endl;
+
+	return true;
+}
+
+bool Volume::mapVoxelsFromFile(QString filepath, const qint64 offset, const int width, const int height, const int depth, const int bitsPerVoxel)
+{
+	if (layout != LINEAR || rawVoxels || !setDimensions(width, height, depth, bitsPerVoxel, filepath))
+		return false;
+
+	mappedFile.setFileName(filepath);
+	if (!mappedFile.open(QIODevice::ReadOnly))
+		return false;
+
+	const qint64 bytes = qint64(size * bytesPerVoxel);
+	uchar *mapping = (mappedFile.size() >= offset + bytes) ? mappedFile.map(offset, bytes) : nullptr;
+	if (!mapping) {
+		mappedFile.close();
+		return false;
+	}
+
+	mappedData = mapping;
+	rawVoxels = mapping;
+
+	return true;
+}
+
+bool Volume::loadBricksFromFileDAT(QString filepath, const int brickSize, const int ghost, ProgressCallback progress)
+{
+	if (layout != LINEAR || rawVoxels || brickSize <= 0 || ghost < 0)
+		return false;
+
+	QFile file(filepath);
+	if (!file.open(QIODevice::ReadOnly)) {
+		std::cerr << "Error opening file: " << filepath.toStdString() << std::endl;
+		return false;
+	}
+
+	// READ HEADER AND SET VOLUME DIMENSIONS
+
+	qint64 headerBytes = 0;
+	if (!readHeaderDAT(file, headerBytes, filepath))
+		return false;
+
+	if (!setBrickSize(brickSize, ghost))
+		return false;
 
 	// READ VOLUME DATA
 
-	// read into vector before writing data into volume to speed up process
-	// TODO unify this into using only bytes or shorts in all cases
-	std::vector<unsigned short> vecDataShorts;
-	std::vector<unsigned char> vecDataBytes;
-	if (bitsPerVoxel <= 8) {
-		vecDataBytes.resize(size);
-		fread((void*)&(vecDataBytes.front()), sizeof(unsigned char), size, fp);
+	// each z-layer of bricks needs its slices plus the ghost slices above and below.
+	// only this slab is held in memory, ghost slices are read again for the next layer.
+	const size_t sliceBytes = size_t(width) * height * bytesPerVoxel;
+	const int bricksPerLayer = numBricksX * numBricksY;
+	std::vector<std::shared_ptr<VolumeBrick> > newBricks(getNumBricks());
+	std::vector<unsigned char> slab;
+
+	for (int bz = 0; bz < numBricksZ; ++bz) {
+		const int slabBegin = std::max(0, bz * brickSize - ghost);
+		const int slabEnd = std::min(depth, (bz + 1) * brickSize + ghost);
+		const qint64 slabBytes = qint64(slabEnd - slabBegin) * sliceBytes;
+
+		slab.resize(size_t(slabBytes));
+		if (!file.seek(headerBytes + qint64(slabBegin) * sliceBytes) ||
+		    file.read(reinterpret_cast<char*>(&slab.front()), slabBytes) != slabBytes)
+		{
+			std::cerr << "Error loading file. File is truncated: " << filepath.toStdString() << std::endl;
+			return false;
+		}
+
+		parallelFor(0, bricksPerLayer, [&](size_t begin, size_t end) {
+			for (size_t b = begin; b < end; ++b) {
+				const int i = int(b) + bz * bricksPerLayer;
+				newBricks[i] = std::make_shared<VolumeBrick>();
+				extractBrick(i, *newBricks[i], &slab.front(), slabBegin, slabEnd);
+			}
+		});
+
+		if (!reportProgress(progress, float(bz + 1) / numBricksZ)) {
+			std::cout << "Canceled loading " << filepath.toStdString() << std::endl;
+			return false;
+		}
 	}
-	else {
-		vecDataShorts.resize(size);
-		fread((void*)&(vecDataShorts.front()), sizeof(unsigned short), size, fp);
+
+	bricks.swap(newBricks);
+	layout = BRICKED;
+
+	std::cout << "Loaded " << bitsPerVoxel << "-bit VOLUME with dimensions " << width << " x " << height << " x " << depth
+	          << " into " << numBricksX << " x " << numBricksY << " x " << numBricksZ << " bricks" << std::endl;
+
+	return true;
+}
+
+bool Volume::openPagedFromFileDAT(QString filepath, const size_t cacheBudgetBytes, const int brickSize, const int ghost)
+{
+	if (layout != LINEAR || rawVoxels || brickSize <= 0 || ghost < 0)
+		return false;
+
+	// the file stays open, bricks are read from it on demand
+	pagedFile.setFileName(filepath);
+	if (!pagedFile.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+		std::cerr << "Error opening file: " << filepath.toStdString() << std::endl;
+		return false;
 	}
-	fclose(fp);
 
-	progressBar->setValue(10);
+	if (!readHeaderDAT(pagedFile, pagedHeaderBytes, filepath) || !setBrickSize(brickSize, ghost)) {
+		pagedFile.close();
+		return false;
+	}
 
-	// store volume data
-	for (int i = 0; i < size; ++i)
+	if (pagedFile.size() < pagedHeaderBytes + qint64(size * bytesPerVoxel)) {
+		std::cerr << "Error loading file. File is truncated: " << filepath.toStdString() << std::endl;
+		pagedFile.close();
+		return false;
+	}
+
+	brickCache.reset(new BrickCache([this](int i) { return readBrickDAT(i); }, getNumBricks(), cacheBudgetBytes));
+	layout = PAGED;
+
+	std::cout << "Opened " << bitsPerVoxel << "-bit VOLUME with dimensions " << width << " x " << height << " x " << depth
+	          << " for paging " << numBricksX << " x " << numBricksY << " x " << numBricksZ << " bricks, cache budget "
+	          << cacheBudgetBytes / (1024 * 1024) << " MB" << std::endl;
+
+	return true;
+}
+
+std::shared_ptr<VolumeBrick> Volume::readBrickDAT(const int i)
+{
+	std::shared_ptr<VolumeBrick> brick = std::make_shared<VolumeBrick>();
+	initBrick(i, *brick);
+
+	const int x0 = std::max(0, brick->originX - brickGhost);
+	const int x1 = std::min(width, brick->originX + brick->sizeX + brickGhost);
+	const int y0 = std::max(0, brick->originY - brickGhost);
+	const int y1 = std::min(height, brick->originY + brick->sizeY + brickGhost);
+	const int z0 = std::max(0, brick->originZ - brickGhost);
+	const int z1 = std::min(depth, brick->originZ + brick->sizeZ + brickGhost);
+	const qint64 rowBytes = qint64(x1 - x0) * bytesPerVoxel;
+
+	// when the brick covers at least half of the volume width, the rows of a slice are read in one go
+	// and scattered into the brick, otherwise row by row
+	const bool readSlices = (2 * (x1 - x0) >= width);
+	const qint64 sliceBytes = qint64(y1 - y0) * width * bytesPerVoxel;
+	std::vector<unsigned char> slice(readSlices ? size_t(sliceBytes) : 0);
+
+	std::lock_guard<std::mutex> lock(pagedFileMutex);
+
+	for (int vz = z0; vz < z1; ++vz) {
+		if (readSlices) {
+			const qint64 src = pagedHeaderBytes + (qint64(y0) * width + qint64(vz) * width * height) * bytesPerVoxel;
+			if (!pagedFile.seek(src) || pagedFile.read(reinterpret_cast<char*>(&slice.front()), sliceBytes) != sliceBytes) {
+				std::cerr << "Error reading brick " << i << " from file: " << pagedFile.fileName().toStdString() << std::endl;
+				return nullptr;
+			}
+		}
+
+		for (int vy = y0; vy < y1; ++vy) {
+			const size_t dst = brick->localIndex(x0 - brick->originX, vy - brick->originY, vz - brick->originZ) * bytesPerVoxel;
+			if (readSlices) {
+				memcpy(&brick->voxels[dst], &slice[(size_t(vy - y0) * width + x0) * bytesPerVoxel], size_t(rowBytes));
+				continue;
+			}
+
+			const qint64 src = pagedHeaderBytes + (qint64(x0) + qint64(vy) * width + qint64(vz) * width * height) * bytesPerVoxel;
+			if (!pagedFile.seek(src) || pagedFile.read(reinterpret_cast<char*>(&brick->voxels[dst]), rowBytes) != rowBytes) {
+				std::cerr << "Error reading brick " << i << " from file: " << pagedFile.fileName().toStdString() << std::endl;
+				return nullptr;
+			}
+		}
+	}
+
+	return brick;
+}
+
+BrickCache* Volume::getBrickCache() const
+{
+	return brickCache.get();
+}
+
+bool Volume::createFromVoxels(const int width, const int height, const int depth, const int bitsPerVoxel, std::vector<unsigned char> &voxels)
+{
+	if (layout != LINEAR || rawVoxels || !setDimensions(width, height, depth, bitsPerVoxel, "voxel buffer"))
+		return false;
+
+	if (voxels.size() < size * bytesPerVoxel) {
+		std::cerr << "Error creating volume. Voxel buffer is too small" << std::endl;
+		return false;
+	}
+
+	voxelData.swap(voxels);
+	rawVoxels = &(voxelData.front());
+
+	return true;
+}
+
+bool Volume::readHeaderDAT(const unsigned short header[4], const unsigned int extent[3], QString filepath)
+{
+	// header format: 16 bit width, 16 bit height, 16 bit depth, 16 bit bitsPerVoxel
+	// then voxel data with bitsPerVoxel intensity resolution.
+	// volumes with a dimension above 65535 use the extended header: width, height and depth are 0
+	// and followed by 32 bit width, 32 bit height, 32 bit depth before the voxel data.
+
+	if (isExtendedHeaderDAT(header)) {
+		if (extent[0] > unsigned(MAX_DIMENSION) || extent[1] > unsigned(MAX_DIMENSION) || extent[2] > unsigned(MAX_DIMENSION)) {
+			std::cerr << "Error loading file. Invalid volume dimensions: " << filepath.toStdString() << std::endl;
+			return false;
+		}
+		return setDimensions(int(extent[0]), int(extent[1]), int(extent[2]), int(header[3]), filepath);
+	}
+
+	return setDimensions(int(header[0]), int(header[1]), int(header[2]), int(header[3]), filepath);
+}
+
+bool Volume::readHeaderDAT(QFile &file, qint64 &headerBytes, QString filepath)
+{
+	unsigned short header[4];
+	unsigned int extent[3] = { 0, 0, 0 };
+	headerBytes = sizeof(header);
+	if (file.read(reinterpret_cast<char*>(header), sizeof(header)) != qint64(sizeof(header)) ||
+	    (isExtendedHeaderDAT(header) && file.read(reinterpret_cast<char*>(extent), sizeof(extent)) != qint64(sizeof(extent))))
 	{
-		// intensities are converted to float, mapping range [0, 2^bitsPerVoxel] to [0.0, 1.0]
-		float value;
-		if (bitsPerVoxel <= 8)
-			value = fmax(0.0f, fmin(1.0f, float(vecDataBytes[i]) / (1 << bitsPerVoxel)));
-		else
-			value = fmax(0.0f, fmin(1.0f, float(vecDataShorts[i]) / (1 << bitsPerVoxel)));
+		std::cerr << "Error loading file. Missing header: " << filepath.toStdString() << std::endl;
+		return false;
+	}
+
+	if (isExtendedHeaderDAT(header))
+		headerBytes += sizeof(extent);
+
+	return readHeaderDAT(header, extent, filepath);
+}
+
+bool Volume::setDimensions(const int width, const int height, const int depth, const int bitsPerVoxel, QString filepath)
+{
+	this->width = width;
+	this->height = height;
+	this->depth = depth;
+	this->bitsPerVoxel = bitsPerVoxel;
 
-		voxels[i] = Voxel(value);
-		
-		progressBar->setValue(10 + i);
+	// check dataset dimensions
+	if (
+	    width  <= 0 || width  > MAX_DIMENSION ||
+		height <= 0 || height > MAX_DIMENSION ||
+	    depth  <= 0 || depth  > MAX_DIMENSION)
+	{
+		std::cerr << "Error loading file. Invalid volume dimensions: " << filepath.toStdString() << std::endl;
+		return false;
 	}
 
-	progressBar->setValue(0);
+	if (bitsPerVoxel <= 0 || bitsPerVoxel > 16)
+	{
+		std::cerr << "Error loading file. Invalid bits per voxel: " << filepath.toStdString() << std::endl;
+		return false;
+	}
 
-	std::cout << "Loaded " << bitsPerVoxel << "-bit VOLUME with dimensions " << width << " x " << height << " x " << depth << std::endl;
+	bytesPerVoxel = (bitsPerVoxel <= 8) ? 1 : 2;
+	normalization = 1.0f / (1 << bitsPerVoxel);
+
+	// compute dimensions, voxel counts are 64 bit
+	size_t slice = size_t(width) * height;
+	size = slice * depth;
+
+	updateBrickGrid();
 
 	return true;
 }
 
+bool Volume::reportProgress(const ProgressCallback &progress, float value) const
+{
+	if (!progress)
+		return true;
+
+	return progress(value);
+}
@@ -1,11 +1,17 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <cstdint>
 
-#include <QProgressBar>
+#include <QString>
+#include <QFile>
 
 
 //-------------------------------------------------------------------------------------------------
@@ -56,44 +62,379 @@ private:
 };
 
 
+//-------------------------------------------------------------------------------------------------
+// VoxelSpan
+//-------------------------------------------------------------------------------------------------
+
+// read-only view of contiguous voxels at their native bit depth
+template<typename T>
+struct VoxelSpan
+{
+	const T *data = nullptr;
+	size_t size = 0;
+
+	const T*				begin() const { return data; }
+	const T*				end() const { return data + size; }
+	const T&				operator[](const size_t i) const { return data[i]; }
+	bool					empty() const { return size == 0; }
+};
+
+
+//-------------------------------------------------------------------------------------------------
+// VolumeBrick
+//-------------------------------------------------------------------------------------------------
+
+// block of voxels at native bit depth, stored x-fastest together with a ghost border
+// replicating the neighbouring voxels (zero outside of the volume), so that neighbourhood
+// kernels can work on a single brick without bounds checks against other bricks.
+class VolumeBrick
+{
+	friend class Volume;
+
+public:
+
+	VolumeBrick();
+
+	// position of the first interior voxel in volume coordinates
+	const int getOriginX() const { return originX; }
+	const int getOriginY() const { return originY; }
+	const int getOriginZ() const { return originZ; }
+
+	// interior size, bricks at the upper volume borders may be smaller than the nominal brick size
+	const int getSizeX() const { return sizeX; }
+	const int getSizeY() const { return sizeY; }
+	const int getSizeZ() const { return sizeZ; }
+
+	const int getGhost() const { return ghost; }
+	const int getBytesPerVoxel() const { return bytesPerVoxel; }
+
+	// index into the brick voxels of local coordinates (x,y,z) relative to the brick origin,
+	// valid for coordinates in range [-ghost, size + ghost)
+	size_t localIndex(const int x, const int y, const int z) const
+	{
+		return size_t(x + ghost) + strideY * size_t(y + ghost) + strideZ * size_t(z + ghost);
+	}
+
+	// normalized intensity at local coordinates (x,y,z), see localIndex
+	float valueAt(const int x, const int y, const int z) const
+	{
+		const size_t i = localIndex(x, y, z);
+		const float value = (bytesPerVoxel == 1) ? float(voxels[i]) : float(reinterpret_cast<const unsigned short*>(&voxels.front())[i]);
+		return std::min(1.0f, value * normalization);
+	}
+
+	// raw brick voxels including the ghost border, empty if T does not match the native voxel width
+	template<typename T>
+	VoxelSpan<T> getVoxelSpan() const
+	{
+		VoxelSpan<T> span;
+		if (sizeof(T) == size_t(bytesPerVoxel) && !voxels.empty()) {
+			span.data = reinterpret_cast<const T*>(&voxels.front());
+			span.size = voxels.size() / bytesPerVoxel;
+		}
+		return span;
+	}
+
+	const void* getRawVoxels() const { return voxels.empty() ? nullptr : &voxels.front(); }
+
+	// voxel strides of the stored brick including the ghost border
+	const size_t getStrideY() const { return strideY; }
+	const size_t getStrideZ() const { return strideZ; }
+
+private:
+
+	int originX, originY, originZ;
+	int sizeX, sizeY, sizeZ;
+	int ghost;
+
+	size_t strideY, strideZ;
+
+	int bytesPerVoxel;
+	float normalization;
+
+	std::vector<unsigned char> voxels;
+
+};
+
+
 //-------------------------------------------------------------------------------------------------
 // Volume
 //-------------------------------------------------------------------------------------------------
 
+class BrickCache;
+class MacrocellGrid;
+
 class Volume
 {
+	// restores and stores derived data (statistics, pyramid, macrocells) in a cache file
+	friend class VolumeSidecar;
 
 public:
 
 	Volume();
 	~Volume();
 
+	// voxel storage layout.
+	// LINEAR: one x-fastest array, possibly a file mapping.
+	// BRICKED: independent bricks with ghost borders, the linear array is released.
+	// MORTON: one array in Z-order inside 64^3 tiles, tiles in x-fastest order.
+	// PAGED: bricks are read from the DAT file on demand and kept in a bounded LRU brick cache.
+	// COMPRESSED: bricks are kept losslessly compressed in memory and decompressed into the brick cache on access.
+	enum Layout
+	{
+		LINEAR     = 0,
+		BRICKED    = 1,
+		MORTON     = 2,
+		PAGED      = 3,
+		COMPRESSED = 4
+	};
+
 
 	// VOLUME DATA
 
-	const Voxel& getVoxel(const int i) const;
-	const Voxel& getVoxel(const int x, const int y, const int z) const;
+	// voxels are stored at their native bit depth, these accessors return intensities
+	// normalized to [0.0, 1.0] by mapping range [0, 2^bitsPerVoxel] to [0.0, 1.0]
+	const Voxel getVoxel(const size_t i) const;
+	const Voxel getVoxel(const int x, const int y, const int z) const;
 	float valueAt(const int x, const int y, const int z) const;
-	const Voxel* getVoxels() const;
+
+	// raw voxels, i.e. 8-bit bytes if getBytesPerVoxel() is 1 and 16-bit shorts if it is 2.
+	// when the volume is memory-mapped this points directly into the file mapping.
+	// only available in LINEAR layout, null otherwise.
+	const void* getRawVoxels() const;
+	bool isMapped() const;
+
+	// typed view of the raw voxels, empty if T does not match the native voxel width
+	template<typename T>
+	VoxelSpan<T> getVoxelSpan() const;
+
+	// convert count voxels starting at linear voxel index first to normalized float intensities.
+	// vectorized (SSE2/AVX2) and split across all cores, used by CPU consumers that need float data in bulk.
+	void getNormalizedValues(float *dst, const size_t first, const size_t count) const;
 
 	const int getWidth() const;
 	const int getHeight() const;
 	const int getDepth() const;
 	const int getBitsPerVoxel() const;
+	const int getBytesPerVoxel() const;
+
+	// number of voxels, 64 bit so that volumes beyond 2^31 voxels can be indexed
+	const size_t getSize() const;
+
+	// load progress in range [0,1] is reported to the callback, which returns false to cancel loading.
+	// loaders may be called from a worker thread, so the callback must not touch widgets directly.
+	typedef std::function<bool(float progress)> ProgressCallback;
+
+	bool loadFromFileDAT(QString filepath, ProgressCallback progress = ProgressCallback());
+
+	// memory-map the DAT file instead of reading it, no intermediate buffers.
+	// the file must stay in place while the volume is alive.
+	bool mapFromFileDAT(QString filepath, ProgressCallback progress = ProgressCallback());
+
+	// read the DAT file directly into bricks, a few slices at a time, so the full volume is never
+	// held in one contiguous buffer. used when the file cannot be mapped.
+	bool loadBricksFromFileDAT(QString filepath, const int brickSize = 32, const int ghost = 1, ProgressCallback progress = ProgressCallback());
+
+	// open the DAT file for out-of-core access in PAGED layout, only the header is read here.
+	// bricks are paged in on first access and evicted least recently used beyond cacheBudgetBytes.
+	// the file must stay in place while the volume is alive.
+	bool openPagedFromFileDAT(QString filepath, const size_t cacheBudgetBytes, const int brickSize = 32, const int ghost = 1);
+
+	// read a DDS compressed (or raw) PVM file into memory, see readPVMFile for the supported components
+	bool loadFromFilePVM(QString filepath, ProgressCallback progress = ProgressCallback());
+
+	// create a LINEAR volume from x-fastest voxels at native bit depth, the voxel buffer is taken over (swapped)
+	bool createFromVoxels(const int width, const int height, const int depth, const int bitsPerVoxel, std::vector<unsigned char> &voxels);
+
+
+	// BRICKS
+
+	// bricks tile the volume in a regular grid of brickSize^3 interior voxels, x-fastest brick order.
+	// in BRICKED layout bricks are returned from storage, in PAGED and COMPRESSED layout from the brick cache,
+	// in LINEAR and MORTON layout they are copied out on request, so brick-local kernels work with any layout.
+
+	Layout getLayout() const;
+
+	// reorganize the voxels into bricks and release the linear storage (and file mapping)
+	bool convertToBricks(const int brickSize = 32, const int ghost = 1, ProgressCallback progress = ProgressCallback());
 
-	const int getSize() const;
+	// reorder the voxels into Morton order and release the linear storage (and file mapping).
+	// the Z-order curve runs inside 64^3 tiles, which bounds the padding for non power of two
+	// and non cubic volumes to the border tiles.
+	bool convertToMorton(ProgressCallback progress = ProgressCallback());
 
-	bool loadFromFileDAT(QString filepath, QProgressBar* progressBar);
+	// compress the bricks (see brickcodec.h) and release the previous storage (and file mapping).
+	// decompressed bricks are kept in a brick cache of cacheBudgetBytes, the brick geometry of BRICKED
+	// volumes is kept, brickSize and ghost apply to the other layouts.
+	bool convertToCompressed(const size_t cacheBudgetBytes, const int brickSize = 32, const int ghost = 1, ProgressCallback progress = ProgressCallback());
+
+	// memory held by the compressed bricks in COMPRESSED layout, without the brick cache
+	const size_t getCompressedBytes() const;
+
+	// brick geometry used by getBrick, can only be changed in LINEAR layout
+	bool setBrickSize(const int brickSize, const int ghost);
+
+	const int getBrickSize() const;
+	const int getBrickGhost() const;
+	const int getNumBricksX() const;
+	const int getNumBricksY() const;
+	const int getNumBricksZ() const;
+	const int getNumBricks() const;
+
+	std::shared_ptr<const VolumeBrick> getBrick(const int bx, const int by, const int bz) const;
+	std::shared_ptr<const VolumeBrick> getBrick(const int i) const;
+
+	// index of the brick containing voxel (x,y,z)
+	int brickIndexAt(const int x, const int y, const int z) const;
+
+	// brick cache of the PAGED and COMPRESSED layouts with its hit and miss counters, null in other layouts
+	BrickCache* getBrickCache() const;
+
+
+	// PYRAMID
+
+	// reduction of 2x2x2 voxels to one voxel of the next coarser level
+	enum Reduction
+	{
+		REDUCE_AVERAGE = 0, // smooth, keeps mean intensities
+		REDUCE_MAXIMUM = 1  // keeps thin bright structures visible, e.g. vessels in MIP
+	};
+
+	// build 2x downsampled levels until no dimension exceeds minSize, in parallel over bricks.
+	// levels are LINEAR volumes at the native bit depth and stay resident with this volume.
+	bool buildPyramid(const Reduction reduction = REDUCE_AVERAGE, const int minSize = 16, ProgressCallback progress = ProgressCallback());
+
+	// number of levels including this full resolution volume as level 0
+	const int getNumLevels() const;
+
+	// level 0 is this volume, coarser levels are from buildPyramid
+	const Volume* getLevel(const int level) const;
+
+
+	// MACROCELLS
+
+	// build the min/max macrocell grid of this volume and of every pyramid level, for empty-space skipping.
+	// call after buildPyramid, rebuilding the pyramid drops the grids of the coarser levels.
+	bool buildMacrocells(const int cellSize = 8);
+
+	// macrocell grid from buildMacrocells, null if not built
+	const MacrocellGrid* getMacrocells() const;
+
+
+	// STATISTICS
+
+	// intensity distribution of the voxels at native bit depth
+	struct Statistics
+	{
+		Statistics() : count(0), minValue(0), maxValue(0), mean(0.0), standardDeviation(0.0) {}
+
+		std::vector<uint64_t> histogram; // one bin per voxel value 0 .. 2^bitsPerVoxel-1, larger values go to the last bin
+		uint64_t count;
+		int minValue;
+		int maxValue;
+		double mean;
+		double standardDeviation;
+
+		// smallest voxel value that at least the given fraction of the voxels with value >= firstValue do not exceed.
+		// firstValue = 1 leaves out zero padding and background.
+		int percentile(const double fraction, const int firstValue = 0) const;
+
+		// derive count, min, max, mean and standard deviation from the histogram
+		void summarize();
+	};
+
+	// count the histogram in parallel, every thread into its own histograms which are merged at the end.
+	// summary values are derived from the merged histogram without another pass over the voxels.
+	bool computeStatistics();
+
+	// statistics from computeStatistics, the histogram is empty if not computed
+	const Statistics& getStatistics() const;
+
+	// normalized intensity [0,1] of a voxel value, as sampled by valueAt and the renderer
+	float normalizeValue(const int value) const;
 
 private:
 
-	std::vector<Voxel> voxels;
+	void updateBrickGrid();
+	void extractBrick(const int i, VolumeBrick &brick) const;
+	void extractBrick(const int i, VolumeBrick &brick, const uchar *slab, const int slabBegin, const int slabEnd) const;
+	void initBrick(const int i, VolumeBrick &brick) const;
+	std::shared_ptr<VolumeBrick> readBrickDAT(const int i);
+
+	// index into voxelData of voxel (x,y,z) in MORTON layout
+	size_t mortonIndex(const int x, const int y, const int z) const;
+
+	bool setDimensions(const int width, const int height, const int depth, const int bitsPerVoxel, QString filepath);
+
+	// map LINEAR voxels stored without header at offset in a file, e.g. pyramid levels in the sidecar cache
+	bool mapVoxelsFromFile(QString filepath, const qint64 offset, const int width, const int height, const int depth, const int bitsPerVoxel);
+	static bool isExtendedHeaderDAT(const unsigned short header[4]) { return header[0] == 0 && header[1] == 0 && header[2] == 0; }
+	bool readHeaderDAT(const unsigned short header[4], const unsigned int extent[3], QString filepath);
+	bool readHeaderDAT(QFile &file, qint64 &headerBytes, QString filepath);
+	bool reportProgress(const ProgressCallback &progress, float value) const;
+	float normalizedValueAt(const size_t i) const;
+	float normalizedValue(const uchar *voxels, const size_t i) const;
+
+	// voxels read into memory at native bit depth, in LINEAR or MORTON order
+	std::vector<unsigned char> voxelData;
+
+	// memory-mapped DAT file, voxel payload starts after the 8 byte header
+	QFile mappedFile;
+	uchar *mappedData;
+
+	// linear voxels, points either into voxelData or into the file mapping. null if not in LINEAR layout
+	const uchar *rawVoxels;
 
 	int width;
 	int height;
 	int depth;
 	int bitsPerVoxel;
+	int bytesPerVoxel;
+	float normalization; // 1 / 2^bitsPerVoxel
+
+	size_t size;
 
-	int size;
+	Layout layout;
+	int brickSize;
+	int brickGhost;
+	int numBricksX, numBricksY, numBricksZ;
+
+	// brick storage in BRICKED layout
+	std::vector<std::shared_ptr<VolumeBrick> > bricks;
+
+	// largest supported dimension, keeps voxel coordinates within int
+	static const int MAX_DIMENSION = 1 << 20;
+
+	// tile grid in MORTON layout
+	static const int MORTON_TILE_BITS = 6;
+	int numMortonTilesX, numMortonTilesY;
+
+	// DAT file and brick cache in PAGED layout, file reads are serialized
+	QFile pagedFile;
+	qint64 pagedHeaderBytes;
+	std::mutex pagedFileMutex;
+	std::unique_ptr<BrickCache> brickCache;
+
+	// brick data in COMPRESSED layout
+	std::vector<std::vector<unsigned char> > compressedBricks;
+	std::shared_ptr<VolumeBrick> decompressBrick(const int i) const;
+
+	// coarser levels 1, 2, ... of the pyramid
+	std::vector<std::unique_ptr<Volume> > pyramid;
+
+	std::unique_ptr<MacrocellGrid> macrocells;
+
+	Statistics statistics;
 
 };
+
+template<typename T>
+VoxelSpan<T> Volume::getVoxelSpan() const
+{
+	VoxelSpan<T> span;
+	if (rawVoxels && sizeof(T) == size_t(bytesPerVoxel)) {
+		span.data = reinterpret_cast<const T*>(rawVoxels);
+		span.size = size;
+	}
+	return span;
+}
@@ -0,0 +1,135 @@
+#include "volumeloader.h"
+#include "volumesidecar.h"
+
+VolumeLoader::VolumeLoader(QString filepath, Volume::Layout layout)
+	: filepath(filepath)
+	, layout(layout)
+	, cacheBudget(size_t(1024) * 1024 * 1024)
+	, buildPyramid(false)
+	, pyramidReduction(Volume::REDUCE_AVERAGE)
+	, useSidecarCache(true)
+	, cancelRequested(false)
+	, lastPercent(-1)
+{
+	qRegisterMetaType<Volume*>("Volume*");
+}
+
+VolumeLoader::~VolumeLoader()
+{
+}
+
+void VolumeLoader::cancel()
+{
+	cancelRequested = true;
+}
+
+void VolumeLoader::setCacheBudget(const size_t bytes)
+{
+	cacheBudget = bytes;
+}
+
+void VolumeLoader::setPyramid(const bool enabled, const Volume::Reduction reduction)
+{
+	buildPyramid = enabled;
+	pyramidReduction = reduction;
+}
+
+void VolumeLoader::setSidecarCache(const bool enabled)
+{
+	useSidecarCache = enabled;
+}
+
+void VolumeLoader::load()
+{
+	// forward progress to the gui thread only when the percentage changes
+	Volume::ProgressCallback progress = [this](float value) {
+		int percent = int(value * 100);
+		if (percent != lastPercent) {
+			lastPercent = percent;
+			emit progressChanged(percent);
+		}
+		return !cancelRequested;
+	};
+
+	Volume *volume = new Volume();
+	bool success = false;
+
+	// load volume data according to file extension
+	std::string fn = filepath.toStdString();
+	std::string fileExtension = fn.substr(fn.find_last_of(".") + 1);
+	if (fileExtension == "dat" && layout == Volume::PAGED) {
+		// only the header is read, bricks are paged in when they are accessed
+		success = volume->openPagedFromFileDAT(filepath, cacheBudget);
+		progress(1.0f);
+	}
+	else if (fileExtension == "dat") {
+		// map the file for zero-copy access, fall back to reading it if mapping is not possible.
+		// bricks are read slab by slab in the fallback, so no buffer of the full volume size is needed.
+		success = volume->mapFromFileDAT(filepath, progress);
+		if (!success && !cancelRequested) {
+			delete volume;
+			volume = new Volume();
+			if (layout == Volume::BRICKED || layout == Volume::COMPRESSED)
+				success = volume->loadBricksFromFileDAT(filepath, 32, 1, progress);
+			else
+				success = volume->loadFromFileDAT(filepath, progress);
+		}
+	}
+
+	else if (fileExtension == "pvm") {
+		// the compressed file is decoded into memory, paging needs the uncompressed DAT file
+		if (layout == Volume::PAGED)
+			std::cout << "Paged layout needs a DAT file, keeping the PVM volume in memory" << std::endl;
+		success = volume->loadFromFilePVM(filepath, progress);
+	}
+
+	// reorganize into the requested storage layout
+	if (success && layout == Volume::BRICKED && volume->getLayout() != Volume::BRICKED) {
+		success = volume->convertToBricks(32, 1, progress);
+	}
+	else if (success && layout == Volume::MORTON) {
+		success = volume->convertToMorton(progress);
+	}
+	else if (success && layout == Volume::COMPRESSED) {
+		success = volume->convertToCompressed(cacheBudget, 32, 1, progress);
+	}
+
+	// derived data of an earlier open of the same file is restored from its sidecar cache
+	const int macrocellSize = 8;
+	VolumeSidecar sidecar(filepath);
+	bool restored = false;
+	if (success && useSidecarCache && !cancelRequested) {
+		restored = sidecar.load(*volume, buildPyramid, pyramidReduction, macrocellSize);
+	}
+
+	// histogram for auto-windowing, a parallel pass over the voxels
+	if (success && !restored && !cancelRequested) {
+		success = volume->computeStatistics();
+	}
+
+	if (success && !restored && buildPyramid) {
+		success = volume->buildPyramid(pyramidReduction, 16, progress);
+	}
+
+	// min/max cells for empty-space skipping in the raycaster
+	if (success && !restored && !cancelRequested) {
+		success = volume->buildMacrocells(macrocellSize);
+	}
+
+	// a failed write only costs the preprocessing again on the next open
+	if (success && !restored && useSidecarCache && !cancelRequested) {
+		sidecar.save(*volume, buildPyramid, pyramidReduction, macrocellSize);
+	}
+
+	if (success && !cancelRequested) {
+		emit loaded(volume);
+		return;
+	}
+
+	delete volume;
+
+	if (cancelRequested)
+		emit canceled();
+	else
+		emit failed();
+}
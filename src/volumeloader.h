@@ -0,0 +1,68 @@
+#ifndef VOLUMELOADER_H
+#define VOLUMELOADER_H
+
+#include "volume.h"
+
+#include <QObject>
+#include <QString>
+#include <QMetaType>
+
+#include <atomic>
+
+
+// loads a volume file on a worker thread.
+// move the loader to a QThread and invoke load() from it, results are delivered through queued signals.
+class VolumeLoader : public QObject
+{
+	Q_OBJECT
+
+public:
+
+	VolumeLoader(QString filepath, Volume::Layout layout = Volume::LINEAR);
+	~VolumeLoader();
+
+	// request cancellation, can be called from any thread.
+	// the loader stops at its next progress report and emits canceled().
+	void cancel();
+
+	// brick cache budget used for the PAGED and COMPRESSED layouts
+	void setCacheBudget(const size_t bytes);
+
+	// build a multi-resolution pyramid with the given reduction after loading
+	void setPyramid(const bool enabled, const Volume::Reduction reduction = Volume::REDUCE_AVERAGE);
+
+	// restore derived data from a sidecar cache file next to the volume file and write it after preprocessing
+	void setSidecarCache(const bool enabled);
+
+public slots:
+
+	void load();
+
+signals:
+
+	// load progress in percent
+	void progressChanged(int percent);
+
+	// ownership of volume passes to the receiver
+	void loaded(Volume *volume);
+
+	void failed();
+	void canceled();
+
+private:
+
+	QString filepath;
+	Volume::Layout layout;
+	size_t cacheBudget;
+	bool buildPyramid;
+	Volume::Reduction pyramidReduction;
+	bool useSidecarCache;
+	std::atomic<bool> cancelRequested;
+	int lastPercent;
+
+};
+
+// volumes are passed between threads through queued signals
+Q_DECLARE_METATYPE(Volume*)
+
+#endif
@@ -0,0 +1,379 @@
+#include "volumesidecar.h"
+#include "macrocells.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QElapsedTimer>
+
+#include <string.h>
+
+
+//-------------------------------------------------------------------------------------------------
+// Sidecar File Layout
+//-------------------------------------------------------------------------------------------------
+
+// file layout: SidecarHeader, numSections x SidecarSection, then the section data,
+// every section starting at a multiple of SECTION_ALIGNMENT. all values in native byte order.
+
+static const char SIDECAR_MAGIC[8] = { 'V', 'O', 'L', 'C', 'A', 'C', 'H', 'E' };
+static const uint32_t SIDECAR_VERSION = 1;
+static const uint64_t SECTION_ALIGNMENT = 4096;
+
+struct SidecarHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t numSections;
+
+	// key of the volume file
+	uint64_t fileBytes;
+	int64_t modified;
+	uint64_t checksum;
+
+	int32_t width, height, depth, bitsPerVoxel;
+
+	// settings the derived data was built with
+	int32_t numLevels; // including the full resolution level 0
+	int32_t pyramidReduction; // -1 without pyramid
+	int32_t macrocellSize;
+	int32_t reserved;
+};
+
+enum SectionType
+{
+	SECTION_HISTOGRAM      = 1, // uint64 per voxel value
+	SECTION_PYRAMID_LEVEL  = 2, // voxels of a coarser level at native bit depth, x-fastest
+	SECTION_MACROCELL_MIN  = 3, // float per cell
+	SECTION_MACROCELL_MAX  = 4, // float per cell
+	SECTION_CELLS_BY_MIN   = 5, // uint32 cell indices sorted by minimum
+	SECTION_CELLS_BY_MAX   = 6  // uint32 cell indices sorted by maximum
+};
+
+struct SidecarSection
+{
+	uint32_t type;
+	int32_t level;
+	uint64_t offset;
+	uint64_t bytes;
+};
+
+static uint64_t alignSection(const uint64_t offset)
+{
+	return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+// FNV-1a
+static uint64_t hashBytes(uint64_t hash, const char *data, const size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		hash ^= uint64_t(static_cast<unsigned char>(data[i]));
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+template<typename T>
+static bool readSection(QFile &file, const SidecarSection &section, std::vector<T> &values)
+{
+	if (section.bytes % sizeof(T) != 0)
+		return false;
+
+	values.resize(size_t(section.bytes / sizeof(T)));
+	if (values.empty())
+		return true;
+
+	return file.seek(qint64(section.offset)) && file.read(reinterpret_cast<char*>(&values.front()), qint64(section.bytes)) == qint64(section.bytes);
+}
+
+
+
+//-------------------------------------------------------------------------------------------------
+// VolumeSidecar
+//-------------------------------------------------------------------------------------------------
+
+VolumeSidecar::VolumeSidecar(QString filepath)
+	: volumeFilepath(filepath), cacheFilepath(filepath + ".cache"), keyValid(false)
+{
+}
+
+QString VolumeSidecar::getFilepath() const
+{
+	return cacheFilepath;
+}
+
+bool VolumeSidecar::computeKey()
+{
+	if (keyValid)
+		return true;
+
+	QFile file(volumeFilepath);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+
+	key.fileBytes = uint64_t(file.size());
+	key.modified = QFileInfo(volumeFilepath).lastModified().toMSecsSinceEpoch();
+
+	// checksum over the first and last 64 KiB (header, first and last slices) and 64 blocks spread
+	// over the file, a full pass would cost as much as the load itself
+	const qint64 edgeBytes = 64 * 1024;
+	const qint64 blockBytes = 4096;
+	const int numBlocks = 64;
+
+	std::vector<char> buffer(static_cast<size_t>(edgeBytes));
+	uint64_t hash = 14695981039346656037ull;
+
+	std::vector<std::pair<qint64, qint64> > ranges;
+	ranges.push_back(std::make_pair(qint64(0), std::min(edgeBytes, file.size())));
+	for (int i = 1; i <= numBlocks; ++i)
+		ranges.push_back(std::make_pair(file.size() / (numBlocks + 1) * i, blockBytes));
+	ranges.push_back(std::make_pair(std::max(qint64(0), file.size() - edgeBytes), edgeBytes));
+
+	for (size_t i = 0; i < ranges.size(); ++i) {
+		if (!file.seek(ranges[i].first))
+			return false;
+		const qint64 numRead = file.read(&buffer.front(), std::min(ranges[i].second, file.size() - ranges[i].first));
+		if (numRead < 0)
+			return false;
+		hash = hashBytes(hash, &buffer.front(), size_t(numRead));
+	}
+
+	key.checksum = hash;
+	keyValid = true;
+	return true;
+}
+
+bool VolumeSidecar::load(Volume &volume, const bool pyramid, const Volume::Reduction reduction, const int macrocellSize)
+{
+	QElapsedTimer timer;
+	timer.start();
+
+	QFile file(cacheFilepath);
+	if (!QFile::exists(cacheFilepath) || !computeKey() || !file.open(QIODevice::ReadOnly))
+		return false;
+
+	// HEADER, KEY AND SETTINGS
+
+	SidecarHeader header;
+	if (file.read(reinterpret_cast<char*>(&header), sizeof(header)) != qint64(sizeof(header)) ||
+	    memcmp(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC)) != 0 || header.version != SIDECAR_VERSION) {
+		std::cout << "Ignoring sidecar cache of an unknown format: " << cacheFilepath.toStdString() << std::endl;
+		return false;
+	}
+
+	if (header.fileBytes != key.fileBytes || header.modified != key.modified || header.checksum != key.checksum ||
+	    header.width != volume.getWidth() || header.height != volume.getHeight() || header.depth != volume.getDepth() ||
+	    header.bitsPerVoxel != volume.getBitsPerVoxel()) {
+		std::cout << "Ignoring stale sidecar cache: " << cacheFilepath.toStdString() << std::endl;
+		return false;
+	}
+
+	if (header.pyramidReduction != (pyramid ? int(reduction) : -1) || header.macrocellSize != macrocellSize || header.numLevels < 1 || header.numLevels > 32 || header.numSections > 1024)
+		return false;
+
+	std::vector<SidecarSection> sections(header.numSections);
+	if (header.numSections > 0 && file.read(reinterpret_cast<char*>(&sections.front()), qint64(sections.size() * sizeof(SidecarSection))) != qint64(sections.size() * sizeof(SidecarSection)))
+		return false;
+
+	// SECTIONS
+
+	// everything is restored into temporaries first, the volume only changes if the whole cache is valid
+	Volume::Statistics statistics;
+	std::vector<std::unique_ptr<Volume> > levels;
+	std::vector<std::unique_ptr<MacrocellGrid> > grids(size_t(header.numLevels));
+	for (size_t level = 0; level < grids.size(); ++level)
+		grids[level].reset(new MacrocellGrid());
+
+	// level dimensions follow from halving, as in Volume::buildPyramid
+	std::vector<int> levelWidth(1, volume.getWidth()), levelHeight(1, volume.getHeight()), levelDepth(1, volume.getDepth());
+	for (int level = 1; level < header.numLevels; ++level) {
+		levelWidth.push_back((levelWidth.back() + 1) / 2);
+		levelHeight.push_back((levelHeight.back() + 1) / 2);
+		levelDepth.push_back((levelDepth.back() + 1) / 2);
+	}
+	levels.resize(levelWidth.size());
+
+	bool valid = true;
+	for (size_t i = 0; i < sections.size() && valid; ++i) {
+		const SidecarSection &section = sections[i];
+		if (section.level < 0 || section.level >= int(grids.size()) || section.offset + section.bytes > uint64_t(file.size())) {
+			valid = false;
+			break;
+		}
+
+		MacrocellGrid &grid = *grids[section.level];
+		switch (section.type) {
+			case SECTION_HISTOGRAM:
+				valid = readSection(file, section, statistics.histogram);
+				break;
+			case SECTION_PYRAMID_LEVEL: {
+				// mapped, the pages are read when the level is first accessed
+				std::unique_ptr<Volume> level(new Volume());
+				valid = section.level > 0 && level->mapVoxelsFromFile(cacheFilepath, qint64(section.offset), levelWidth[section.level],
+				                                                       levelHeight[section.level], levelDepth[section.level], volume.getBitsPerVoxel());
+				levels[section.level] = std::move(level);
+				break;
+			}
+			case SECTION_MACROCELL_MIN:
+				valid = readSection(file, section, grid.minValues);
+				break;
+			case SECTION_MACROCELL_MAX:
+				valid = readSection(file, section, grid.maxValues);
+				break;
+			case SECTION_CELLS_BY_MIN:
+				valid = readSection(file, section, grid.cellsByMin);
+				break;
+			case SECTION_CELLS_BY_MAX:
+				valid = readSection(file, section, grid.cellsByMax);
+				break;
+			default:
+				break; // sections of later versions are skipped
+		}
+	}
+
+	// complete contents
+	valid = valid && statistics.histogram.size() == (size_t(1) << volume.getBitsPerVoxel());
+	for (size_t level = 0; level < grids.size() && valid; ++level) {
+		MacrocellGrid &grid = *grids[level];
+		grid.cellSize = macrocellSize;
+		grid.numCellsX = (levelWidth[level] + macrocellSize - 1) / macrocellSize;
+		grid.numCellsY = (levelHeight[level] + macrocellSize - 1) / macrocellSize;
+		grid.numCellsZ = (levelDepth[level] + macrocellSize - 1) / macrocellSize;
+
+		const size_t numCells = size_t(grid.numCellsX) * grid.numCellsY * grid.numCellsZ;
+		valid = (level == 0 || levels[level]) && grid.minValues.size() == numCells && grid.maxValues.size() == numCells &&
+		        grid.cellsByMin.size() == numCells && grid.cellsByMax.size() == numCells;
+	}
+
+	if (!valid) {
+		std::cerr << "Error reading sidecar cache, recomputing: " << cacheFilepath.toStdString() << std::endl;
+		return false;
+	}
+
+	// HAND OVER
+
+	statistics.summarize();
+	volume.statistics = statistics;
+
+	volume.pyramid.clear();
+	for (size_t level = 1; level < levels.size(); ++level)
+		volume.pyramid.push_back(std::move(levels[level]));
+
+	volume.macrocells = std::move(grids[0]);
+	for (size_t level = 1; level < grids.size(); ++level)
+		volume.pyramid[level - 1]->macrocells = std::move(grids[level]);
+
+	std::cout << "Restored VOLUME statistics, " << (header.numLevels - 1) << " pyramid levels and macrocells from sidecar cache in "
+	          << timer.elapsed() << " ms" << std::endl;
+
+	return true;
+}
+
+bool VolumeSidecar::save(const Volume &volume, const bool pyramid, const Volume::Reduction reduction, const int macrocellSize)
+{
+	if (!computeKey())
+		return false;
+
+	// SECTION TABLE
+
+	struct Data
+	{
+		const void *data;
+		uint64_t bytes;
+	};
+
+	std::vector<SidecarSection> sections;
+	std::vector<Data> contents;
+
+	const auto addSection = [&](const SectionType type, const int level, const void *data, const uint64_t bytes) {
+		SidecarSection section;
+		section.type = type;
+		section.level = level;
+		section.offset = 0;
+		section.bytes = bytes;
+		sections.push_back(section);
+
+		Data content = { data, bytes };
+		contents.push_back(content);
+	};
+
+	const std::vector<uint64_t> &histogram = volume.getStatistics().histogram;
+	if (histogram.empty())
+		return false;
+	addSection(SECTION_HISTOGRAM, 0, &histogram.front(), histogram.size() * sizeof(uint64_t));
+
+	for (int level = 0; level < volume.getNumLevels(); ++level) {
+		const Volume *levelVolume = volume.getLevel(level);
+		const MacrocellGrid *grid = levelVolume->getMacrocells();
+		if (!grid || grid->getCellSize() != macrocellSize || grid->minValues.empty())
+			return false;
+
+		if (level > 0) {
+			if (!levelVolume->getRawVoxels())
+				return false;
+			addSection(SECTION_PYRAMID_LEVEL, level, levelVolume->getRawVoxels(), uint64_t(levelVolume->getSize()) * levelVolume->getBytesPerVoxel());
+		}
+
+		const uint64_t numCells = grid->minValues.size();
+		addSection(SECTION_MACROCELL_MIN, level, &grid->minValues.front(), numCells * sizeof(float));
+		addSection(SECTION_MACROCELL_MAX, level, &grid->maxValues.front(), numCells * sizeof(float));
+		addSection(SECTION_CELLS_BY_MIN, level, &grid->cellsByMin.front(), numCells * sizeof(unsigned int));
+		addSection(SECTION_CELLS_BY_MAX, level, &grid->cellsByMax.front(), numCells * sizeof(unsigned int));
+	}
+
+	uint64_t offset = sizeof(SidecarHeader) + sections.size() * sizeof(SidecarSection);
+	for (size_t i = 0; i < sections.size(); ++i) {
+		sections[i].offset = alignSection(offset);
+		offset = sections[i].offset + sections[i].bytes;
+	}
+
+	SidecarHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+	header.version = SIDECAR_VERSION;
+	header.numSections = uint32_t(sections.size());
+	header.fileBytes = key.fileBytes;
+	header.modified = key.modified;
+	header.checksum = key.checksum;
+	header.width = volume.getWidth();
+	header.height = volume.getHeight();
+	header.depth = volume.getDepth();
+	header.bitsPerVoxel = volume.getBitsPerVoxel();
+	header.numLevels = volume.getNumLevels();
+	header.pyramidReduction = pyramid ? int(reduction) : -1;
+	header.macrocellSize = macrocellSize;
+
+	// WRITE
+
+	// written to a temporary file first, so that an interrupted write never leaves a truncated cache.
+	// pyramid levels of an earlier cache stay mapped from the replaced file until their volume is released.
+	const QString tempFilepath = cacheFilepath + ".tmp";
+	QFile file(tempFilepath);
+	if (!file.open(QIODevice::WriteOnly)) {
+		std::cerr << "Error writing sidecar cache: " << cacheFilepath.toStdString() << std::endl;
+		return false;
+	}
+
+	bool success = file.write(reinterpret_cast<const char*>(&header), sizeof(header)) == qint64(sizeof(header)) &&
+	               file.write(reinterpret_cast<const char*>(&sections.front()), qint64(sections.size() * sizeof(SidecarSection))) == qint64(sections.size() * sizeof(SidecarSection));
+
+	const std::vector<char> padding(SECTION_ALIGNMENT, 0);
+	uint64_t position = sizeof(SidecarHeader) + sections.size() * sizeof(SidecarSection);
+	for (size_t i = 0; i < sections.size() && success; ++i) {
+		const qint64 paddingBytes = qint64(sections[i].offset - position);
+		success = file.write(&padding.front(), paddingBytes) == paddingBytes &&
+		          file.write(static_cast<const char*>(contents[i].data), qint64(contents[i].bytes)) == qint64(contents[i].bytes);
+		position = sections[i].offset + sections[i].bytes;
+	}
+	file.close();
+
+	if (!success || (QFile::exists(cacheFilepath) && !QFile::remove(cacheFilepath)) || !QFile::rename(tempFilepath, cacheFilepath)) {
+		std::cerr << "Error writing sidecar cache: " << cacheFilepath.toStdString() << std::endl;
+		QFile::remove(tempFilepath);
+		return false;
+	}
+
+	std::cout << "Wrote sidecar cache of " << position / 1024 << " KB: " << cacheFilepath.toStdString() << std::endl;
+
+	return true;
+}
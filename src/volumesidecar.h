@@ -0,0 +1,55 @@
+#pragma once
+
+#include "volume.h"
+
+#include <QString>
+
+#include <cstdint>
+
+
+//-------------------------------------------------------------------------------------------------
+// VolumeSidecar
+//-------------------------------------------------------------------------------------------------
+
+// cache file next to a volume file holding the data derived from it on load: histogram, pyramid levels
+// and macrocell grids. reopening the same file restores them instead of recomputing.
+// the cache is keyed by size, modification time and a checksum of the volume file, a stale or
+// incompatible cache is ignored and replaced on the next save. sections are page aligned, so that
+// pyramid levels are mapped straight from the cache file like a mapped DAT file.
+class VolumeSidecar
+{
+
+public:
+
+	// cache for the volume file at filepath, stored as filepath + ".cache"
+	VolumeSidecar(QString filepath);
+
+	QString getFilepath() const;
+
+	// restore statistics, pyramid and macrocells into a freshly loaded volume.
+	// only succeeds if the cache is current and was built with the same pyramid and macrocell settings,
+	// the volume is left untouched otherwise.
+	bool load(Volume &volume, const bool pyramid, const Volume::Reduction reduction, const int macrocellSize);
+
+	// write the derived data of the volume, replacing an existing cache
+	bool save(const Volume &volume, const bool pyramid, const Volume::Reduction reduction, const int macrocellSize);
+
+private:
+
+	// identity of the volume file the cache was built from
+	struct Key
+	{
+		uint64_t fileBytes;
+		int64_t modified; // msecs since epoch
+		uint64_t checksum;
+	};
+
+	bool computeKey();
+
+	QString volumeFilepath;
+	QString cacheFilepath;
+
+	Key key;
+	bool keyValid;
+
+};